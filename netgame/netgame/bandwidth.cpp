@@ -0,0 +1,76 @@
+#include "bandwidth.h"
+
+#include <algorithm>
+
+#include "protocol.h"
+
+// Shortest interval the estimate is updated over (short round trips are noisy)
+const std::chrono::milliseconds MIN_BANDWIDTH_INTERVAL(50);
+
+BandwidthBudget::BandwidthBudget()
+	: m_limit(BANDWIDTH_ESTIMATE)
+	, m_rate(INITIAL_BANDWIDTH)
+	, m_tokens(0)
+	, m_refilled(false)
+	, m_interval_acked(0)
+	, m_interval_lost(false)
+{
+}
+
+void BandwidthBudget::set_limit(unsigned int bytesPerSecond)
+{
+	m_limit = bytesPerSecond;
+	m_rate = bytesPerSecond == BANDWIDTH_ESTIMATE ? INITIAL_BANDWIDTH : bytesPerSecond;
+	m_refilled = false;
+}
+
+void BandwidthBudget::refill(net_time now, net_duration interval)
+{
+	if (m_limit == BANDWIDTH_UNLIMITED) {
+		m_tokens = LLONG_MAX / 2;
+		return;
+	}
+
+	long long burst = std::max((long long)(std::chrono::duration<double>(interval).count() * m_rate * BANDWIDTH_BURST_TICKS), (long long)MAX_PACKET_SIZE);
+	if (!m_refilled) {
+		m_tokens = burst;
+		m_refilled = true;
+	} else if (now > m_last_refill) {
+		m_tokens += (long long)(std::chrono::duration<double>(now - m_last_refill).count() * m_rate);
+		m_tokens = std::min(m_tokens, burst);
+	}
+	m_last_refill = now;
+}
+
+void BandwidthBudget::on_acked(unsigned int bytes, net_time now, net_duration rtt)
+{
+	if (m_limit != BANDWIDTH_ESTIMATE)
+		return;
+
+	m_interval_acked += bytes;
+	net_duration length = now - m_interval_start;
+	if (length < std::max<net_duration>(rtt, MIN_BANDWIDTH_INTERVAL))
+		return;
+
+	// Grow only when the traffic was limited by the budget, not by the application
+	double delivered = m_interval_acked / std::chrono::duration<double>(length).count();
+	if (!m_interval_lost && delivered * 4 >= (double)m_rate * 3)
+		m_rate = std::min(m_rate + m_rate / 8, MAX_BANDWIDTH);
+
+	m_interval_start = now;
+	m_interval_acked = 0;
+	m_interval_lost = false;
+}
+
+void BandwidthBudget::on_lost(net_time now, net_duration rtt)
+{
+	if (m_limit != BANDWIDTH_ESTIMATE)
+		return;
+
+	m_interval_lost = true;
+	// One cut per round trip, the losses of a burst are one congestion event
+	if (now - m_last_cut < std::max<net_duration>(rtt, MIN_BANDWIDTH_INTERVAL))
+		return;
+	m_rate = std::max(m_rate / 10 * 7, MIN_BANDWIDTH);
+	m_last_cut = now;
+}
\ No newline at end of file
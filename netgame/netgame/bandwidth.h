@@ -0,0 +1,61 @@
+#ifndef _NETGAME_BANDWIDTH_H
+#define _NETGAME_BANDWIDTH_H
+
+#include <climits>
+
+#include "timing.h"
+
+// Limit to follow the link with an estimate (the default)
+const unsigned int BANDWIDTH_ESTIMATE = 0;
+
+// Limit that never holds anything back
+const unsigned int BANDWIDTH_UNLIMITED = UINT_MAX;
+
+// Bounds of the estimated rate and where it starts (bytes per second)
+const unsigned int MIN_BANDWIDTH = 8 * 1024;
+const unsigned int INITIAL_BANDWIDTH = 64 * 1024;
+const unsigned int MAX_BANDWIDTH = 16 * 1024 * 1024;
+
+// Ticks worth of sending the budget can save up
+const unsigned int BANDWIDTH_BURST_TICKS = 2;
+
+// Bytes a connection may send, refilled at a configured or estimated rate
+// The estimate grows while the acknowledged traffic uses most of it and is cut
+// when packets are lost (at most once per round trip), like TCP's AIMD
+class BandwidthBudget
+{
+public:
+	BandwidthBudget();
+
+	// Bytes per second or `BANDWIDTH_ESTIMATE`/`BANDWIDTH_UNLIMITED`
+	void set_limit(unsigned int bytesPerSecond);
+	unsigned int limit() const { return m_limit; }
+
+	// Rate the budget is refilled at (bytes per second)
+	unsigned int rate() const { return m_rate; }
+
+	// Add what was earned since the last refill (at the start of every tick)
+	void refill(net_time now, net_duration interval);
+
+	// Bytes that can still be sent, negative once a large message overdrew it
+	long long available() const { return m_tokens; }
+	void spend(unsigned int bytes) { m_tokens -= bytes; }
+
+	void on_acked(unsigned int bytes, net_time now, net_duration rtt);
+	void on_lost(net_time now, net_duration rtt);
+
+private:
+	unsigned int m_limit;
+	unsigned int m_rate;
+	long long m_tokens;
+	bool m_refilled;
+	net_time m_last_refill;
+
+	// Traffic acknowledged since `m_interval_start` (a round trip long)
+	net_time m_interval_start;
+	unsigned long long m_interval_acked;
+	bool m_interval_lost;
+	net_time m_last_cut;
+};
+
+#endif
\ No newline at end of file
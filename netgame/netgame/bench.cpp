@@ -0,0 +1,1246 @@
+#include "bench.h"
+
+#include <netlib/address.h>
+#include <netlib/socket.h>
+
+#include "protocol.h"
+#include "packet.h"
+#include "transport.h"
+#include "uring_transport.h"
+#include "spsc_queue.h"
+#include "connection.h"
+#include "compress.h"
+#include "handshake.h"
+#include "server.h"
+#include "connection_store.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+static std::ostream *bench_out = &std::cout;
+static bool bench_json = false;
+static unsigned int bench_failed = 0;
+
+void set_bench_output(std::ostream& out, bool json)
+{
+	bench_out = &out;
+	bench_json = json;
+}
+
+unsigned int bench_failures()
+{
+	return bench_failed;
+}
+
+// The measurements of one case of a benchmark
+// Keys carry the unit (eg. `tick_us`) so the JSON needs no schema
+class BenchResult
+{
+public:
+	BenchResult(const char *bench, const std::string& name)
+		: m_bench(bench)
+		, m_name(name)
+	{ }
+
+	BenchResult& add(const char *key, double value)
+	{
+		m_values.push_back(std::make_pair(key, value));
+		return *this;
+	}
+
+	// Mark the case failed with `what` unless `ok`
+	BenchResult& check(const char *what, bool ok)
+	{
+		if (!ok)
+			m_failed.push_back(what);
+		return *this;
+	}
+
+	// Write to the output set with `set_bench_output()`
+	void report() const
+	{
+		std::ostream& out = *bench_out;
+		std::streamsize precision = out.precision(bench_json ? 6 : 4);
+		if (bench_json) {
+			out << "{\"bench\":\"" << m_bench << "\",\"case\":\"" << m_name << "\"";
+			for (auto& value : m_values) {
+				out << ",\"" << value.first << "\":";
+				// JSON has no infinities or NaNs
+				if (value.second == value.second && std::fabs(value.second) <= DBL_MAX)
+					write_value(out, value.second);
+				else
+					out << "null";
+			}
+			if (!m_failed.empty()) {
+				out << ",\"failed\":[";
+				for (size_t i = 0; i < m_failed.size(); i++)
+					out << (i ? ",\"" : "\"") << m_failed[i] << "\"";
+				out << "]";
+			}
+			out << "}";
+		} else {
+			out << std::left << std::setw(12) << m_bench << " " << std::setw(28) << m_name << std::right;
+			for (auto& value : m_values) {
+				out << "  " << value.first << " ";
+				write_value(out, value.second);
+			}
+			for (auto what : m_failed)
+				out << "  FAILED " << what;
+		}
+		out << std::endl;
+		out.precision(precision);
+		if (!m_failed.empty())
+			bench_failed++;
+	}
+
+private:
+	// Counts (and large values in text) are written whole, not rounded to the precision
+	static void write_value(std::ostream& out, double value)
+	{
+		if (std::fabs(value) < 1e15 && (value == std::floor(value) || (!bench_json && std::fabs(value) >= 1000.0)))
+			out << (long long)std::floor(value + 0.5);
+		else
+			out << value;
+	}
+
+	const char *m_bench;
+	std::string m_name;
+	std::vector<std::pair<const char*, double>> m_values;
+	std::vector<const char*> m_failed;
+};
+
+// Number of datagrams to send per run
+const unsigned int BENCH_DATAGRAM_COUNT = 200000;
+
+// Payload size of the benchmark datagrams
+const unsigned int BENCH_DATAGRAM_SIZE = 128;
+
+enum BenchTransportKind
+{
+	BENCH_TRANSPORT_SINGLE,
+	BENCH_TRANSPORT_BATCHED,
+	BENCH_TRANSPORT_URING,
+};
+
+static void bench_transport_run(BenchTransportKind kind)
+{
+	Socket recvSocket(Address::inet_any(13370), SocketType::UDP);
+	Socket sendSocket(Address::inet_any(), SocketType::UDP);
+	recvSocket.set_blocking(false);
+	sendSocket.set_blocking(false);
+	Address target = *Address::find_by_name("127.0.0.1", "13370", SocketType::UDP, AF_INET).begin();
+
+	std::unique_ptr<Transport> sender, receiver;
+	const char *name = "single";
+	if (kind == BENCH_TRANSPORT_BATCHED) {
+		sender.reset(new BatchTransport(sendSocket, IO_BATCH_SIZE));
+		receiver.reset(new BatchTransport(recvSocket, IO_BATCH_SIZE));
+		name = "batched";
+	} else if (kind == BENCH_TRANSPORT_URING) {
+#ifdef __linux__
+		std::unique_ptr<UringTransport> uringSender(new UringTransport(sendSocket.get_handle()));
+		std::unique_ptr<UringTransport> uringReceiver(new UringTransport(recvSocket.get_handle()));
+		// Not supported by the kernel (or not allowed)
+		if (!uringSender->is_open() || !uringReceiver->is_open())
+			return;
+		sender = std::move(uringSender);
+		receiver = std::move(uringReceiver);
+		name = "uring";
+#else
+		return;
+#endif
+	} else {
+		sender.reset(new SocketTransport(sendSocket));
+		receiver.reset(new SocketTransport(recvSocket));
+	}
+
+	PacketPool sendPool(MAX_PACKET_SIZE);
+	PacketPool recvPool(MAX_PACKET_SIZE);
+	Datagram recv[IO_BATCH_SIZE];
+
+	unsigned int sent = 0, received = 0, damaged = 0;
+	auto drain = [&]() -> unsigned int {
+		unsigned int count = receiver->receive(recvPool, recv, IO_BATCH_SIZE);
+		for (unsigned int i = 0; i < count; i++) {
+			const Packet& p = recv[i].packet;
+			if (p.size() != BENCH_DATAGRAM_SIZE || p.data()[0] != p.data()[BENCH_DATAGRAM_SIZE - 1])
+				damaged++;
+			recv[i].packet = Packet();
+		}
+		received += count;
+		return count;
+	};
+	auto begin = std::chrono::high_resolution_clock::now();
+	while (sent < BENCH_DATAGRAM_COUNT) {
+		// Send one batch and drain it from the other end (loopback delivers immediately)
+		unsigned int n = std::min(IO_BATCH_SIZE, BENCH_DATAGRAM_COUNT - sent);
+		for (unsigned int i = 0; i < n; i++) {
+			memset(sendPool.nextData(), (char)i, BENCH_DATAGRAM_SIZE);
+			sender->send(target, sendPool.allocate(BENCH_DATAGRAM_SIZE));
+		}
+		sender->flush();
+		sent += n;
+
+		while (drain() == IO_BATCH_SIZE)
+			;
+	}
+	// The last datagrams may not have been picked up yet
+	while (received < sent && drain() > 0)
+		;
+	auto end = std::chrono::high_resolution_clock::now();
+
+	double seconds = std::chrono::duration<double>(end - begin).count();
+	const TransportStats& ss = sender->stats();
+	const TransportStats& rs = receiver->stats();
+	BenchResult("transport", name)
+		.add("packets_per_s", received / seconds)
+		.add("send_syscalls_per_packet", (double)ss.send_calls / std::max(ss.send_datagrams, 1ULL))
+		.add("recv_syscalls_per_packet", (double)rs.recv_calls / std::max(rs.recv_datagrams, 1ULL))
+		.add("received", received)
+		.add("sent", sent)
+		.check("datagrams lost on loopback", received == sent)
+		.check("datagrams damaged", damaged == 0)
+		.report();
+}
+
+void bench_transport()
+{
+	bench_transport_run(BENCH_TRANSPORT_SINGLE);
+	bench_transport_run(BENCH_TRANSPORT_BATCHED);
+	bench_transport_run(BENCH_TRANSPORT_URING);
+}
+
+// Number of packets to hand over per run
+const unsigned int HANDOFF_PACKET_COUNT = 2000000;
+
+// Payload size of the handed over packets
+const unsigned int HANDOFF_PACKET_SIZE = 100;
+
+// Slot used to copy a payload to the consumer
+struct HandoffCopy
+{
+	unsigned int size;
+	char data[MAX_PACKET_SIZE];
+};
+
+static void bench_handoff_print(const char *name, std::chrono::high_resolution_clock::time_point begin, unsigned int checksum)
+{
+	auto end = std::chrono::high_resolution_clock::now();
+	double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+	// Every packet starts with the low byte of its index
+	unsigned int expected = 0;
+	for (unsigned int i = 0; i < HANDOFF_PACKET_COUNT; i++)
+		expected += i & 0xFF;
+	BenchResult("handoff", name)
+		.add("packet_ns", ns / HANDOFF_PACKET_COUNT)
+		.add("checksum", checksum)
+		.check("packets lost or damaged in the handoff", checksum == expected)
+		.report();
+}
+
+// Allocate and release on one thread
+static void bench_handoff_local(bool concurrent)
+{
+	PacketPool pool(MAX_PACKET_SIZE, 0, concurrent);
+	unsigned int checksum = 0;
+	auto begin = std::chrono::high_resolution_clock::now();
+	for (unsigned int i = 0; i < HANDOFF_PACKET_COUNT; i++) {
+		memset(pool.nextData(), (char)i, HANDOFF_PACKET_SIZE);
+		Packet p = pool.allocate(HANDOFF_PACKET_SIZE);
+		Packet copy = p;
+		checksum += (unsigned char)copy.data()[0];
+		if (i % 1024 == 0)
+			pool.trim();
+	}
+	bench_handoff_print(concurrent ? "local, atomic refcount" : "local, plain refcount", begin, checksum);
+}
+
+// Copy every payload to the consumer thread
+static void bench_handoff_copy()
+{
+	PacketPool pool(MAX_PACKET_SIZE);
+	SpscQueue<HandoffCopy> queue(1024);
+	unsigned int checksum = 0;
+	auto begin = std::chrono::high_resolution_clock::now();
+
+	std::thread consumer([&]() {
+		PacketPool local(MAX_PACKET_SIZE);
+		for (unsigned int i = 0; i < HANDOFF_PACKET_COUNT;) {
+			HandoffCopy *slot = queue.front();
+			if (slot == nullptr) {
+				std::this_thread::yield();
+				continue;
+			}
+			memcpy(local.nextData(), slot->data, slot->size);
+			Packet p = local.allocate(slot->size);
+			checksum += (unsigned char)p.data()[0];
+			queue.pop();
+			i++;
+		}
+	});
+
+	for (unsigned int i = 0; i < HANDOFF_PACKET_COUNT;) {
+		HandoffCopy *slot = queue.push_slot();
+		if (slot == nullptr) {
+			std::this_thread::yield();
+			continue;
+		}
+		memset(pool.nextData(), (char)i, HANDOFF_PACKET_SIZE);
+		Packet p = pool.allocate(HANDOFF_PACKET_SIZE);
+		slot->size = p.size();
+		memcpy(slot->data, p.data(), p.size());
+		queue.push();
+		i++;
+	}
+	consumer.join();
+	bench_handoff_print("cross-thread, copy", begin, checksum);
+}
+
+// Move the packets to the consumer thread which releases them
+static void bench_handoff_shared()
+{
+	PacketPool pool(MAX_PACKET_SIZE, 0, true);
+	SpscQueue<Packet> queue(1024);
+	unsigned int checksum = 0;
+	auto begin = std::chrono::high_resolution_clock::now();
+
+	std::thread consumer([&]() {
+		for (unsigned int i = 0; i < HANDOFF_PACKET_COUNT;) {
+			Packet *slot = queue.front();
+			if (slot == nullptr) {
+				std::this_thread::yield();
+				continue;
+			}
+			checksum += (unsigned char)slot->data()[0];
+			*slot = Packet();
+			queue.pop();
+			i++;
+		}
+	});
+
+	for (unsigned int i = 0; i < HANDOFF_PACKET_COUNT;) {
+		Packet *slot = queue.push_slot();
+		if (slot == nullptr) {
+			pool.trim();
+			std::this_thread::yield();
+			continue;
+		}
+		memset(pool.nextData(), (char)i, HANDOFF_PACKET_SIZE);
+		*slot = pool.allocate(HANDOFF_PACKET_SIZE);
+		queue.push();
+		i++;
+	}
+	consumer.join();
+	bench_handoff_print("cross-thread, zero-copy", begin, checksum);
+}
+
+void bench_packet_handoff()
+{
+	bench_handoff_local(false);
+	bench_handoff_local(true);
+	bench_handoff_copy();
+	bench_handoff_shared();
+}
+
+// Ticks to pack per distribution
+const unsigned int PACKER_TICKS = 2000;
+
+// Messages queued per tick
+const unsigned int PACKER_MESSAGES_PER_TICK = 200;
+
+// Counts the datagrams instead of sending them
+// Keeps the datagrams of the last tick to hand them to the peer
+class CountingTransport : public Transport
+{
+public:
+	CountingTransport()
+		: bytes(0)
+	{ }
+
+	virtual unsigned int receive(PacketPool& /*pool*/, Datagram * /*out*/, unsigned int /*count*/) { return 0; }
+	virtual void send(const Address& /*addr*/, const Packet& packet)
+	{
+		bytes += packet.size();
+		m_stats.send_datagrams++;
+		sent.push_back(std::vector<Packet>(1, packet));
+	}
+	virtual void send_gather(const Address& /*addr*/, const PacketChain& chain)
+	{
+		bytes += chain.size();
+		m_stats.send_datagrams++;
+		sent.push_back(std::vector<Packet>());
+		for (unsigned int i = 0; i < chain.num_slices(); i++)
+			sent.back().push_back(chain.slice(i));
+	}
+
+	// Process the kept datagram `i` with `conn`
+	void deliver(Connection& conn, unsigned int i, net_time now)
+	{
+		PacketChain chain;
+		for (auto& slice : sent[i])
+			chain.append(slice);
+		conn.process_packet(chain.flatten(m_gather_pool), now);
+	}
+
+	// Process all the kept datagrams with `conn`
+	void deliver(Connection& conn, net_time now)
+	{
+		for (unsigned int i = 0; i < sent.size(); i++)
+			deliver(conn, i, now);
+		sent.clear();
+	}
+
+	unsigned long long bytes;
+	std::vector<std::vector<Packet>> sent;
+};
+
+struct PackerDistribution
+{
+	const char *name;
+	// Message sizes are uniform in [min, max], `large_share` of them in [large_min, large_max]
+	unsigned int min, max;
+	double large_share;
+	unsigned int large_min, large_max;
+};
+
+static void bench_packer_run(const PackerDistribution& dist)
+{
+	// The peer acknowledges the packets so the reliable channel doesn't pile up resends
+	Connection conn(Address::inet_any(), 0xDEADBEEF);
+	Connection peer(Address::inet_any(), 0xDEADBEEF);
+	ChannelOut *chan = conn.get_channel_out_by_id(0);
+	ChannelIn *peerChan = peer.get_channel_in_by_id(0);
+	// Measure the packer alone, not how the budget holds the messages back
+	conn.set_bandwidth(BANDWIDTH_UNLIMITED);
+	peer.set_bandwidth(BANDWIDTH_UNLIMITED);
+	CountingTransport transport, ackTransport;
+	net_time now;
+	PacketPool payloads(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+
+	std::mt19937 rng(1337);
+	std::uniform_int_distribution<unsigned int> small(dist.min, dist.max);
+	std::uniform_int_distribution<unsigned int> large(dist.large_min, dist.large_max);
+	std::uniform_real_distribution<double> pick(0.0, 1.0);
+
+	unsigned long long payloadBytes = 0, receivedBytes = 0, received = 0;
+	double seconds = 0.0;
+	for (unsigned int tick = 0; tick < PACKER_TICKS; tick++) {
+		for (unsigned int i = 0; i < PACKER_MESSAGES_PER_TICK; i++) {
+			unsigned int size = pick(rng) < dist.large_share ? large(rng) : small(rng);
+			Packet p = payloads.allocate_buffer(size);
+			memset(p.data(), (char)i, size);
+			chan->send(p);
+			payloadBytes += size;
+		}
+
+		auto begin = std::chrono::high_resolution_clock::now();
+		conn.send_outgoing(transport, now);
+		seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+
+		// Answer every datagram, one ack per tick can't cover the busier distributions
+		for (unsigned int i = 0; i < transport.sent.size(); i++) {
+			transport.deliver(peer, i, now);
+			peer.send_outgoing(ackTransport, now);
+		}
+		transport.sent.clear();
+		Packet message;
+		while (!(message = peerChan->receive()).empty()) {
+			receivedBytes += message.size();
+			received++;
+		}
+		ackTransport.deliver(conn, now);
+		now += conn.send_interval();
+		payloads.trim();
+	}
+
+	unsigned long long datagrams = transport.stats().send_datagrams;
+	BenchResult("packer", dist.name)
+		.add("tick_us", seconds * 1e6 / PACKER_TICKS)
+		.add("message_ns", seconds * 1e9 / (PACKER_TICKS * PACKER_MESSAGES_PER_TICK))
+		.add("efficiency", (double)payloadBytes / transport.bytes)
+		.add("datagrams_per_tick", (double)datagrams / PACKER_TICKS)
+		.check("messages lost", received == PACKER_TICKS * PACKER_MESSAGES_PER_TICK && receivedBytes == payloadBytes)
+		.report();
+}
+
+void bench_packer()
+{
+	static const PackerDistribution dists[] = {
+		{ "tiny 1-16",      1,  16, 0.0, 0, 0 },
+		{ "small 16-128",  16, 128, 0.0, 0, 0 },
+		{ "mixed 1-480",    1, 480, 0.0, 0, 0 },
+		{ "fragmented",     1, 128, 0.05, 1000, 8000 },
+	};
+	for (auto& dist : dists)
+		bench_packer_run(dist);
+}
+
+// Ticks of the recorded session
+const unsigned int COMPRESSION_TICKS = 600;
+
+// Share of the recorded datagrams used to train the dictionary
+const unsigned int COMPRESSION_TRAIN_TICKS = 200;
+
+// Entities updated every tick
+const unsigned int COMPRESSION_ENTITIES = 40;
+
+// Size of the trained dictionary
+const unsigned int COMPRESSION_DICTIONARY_SIZE = 4096;
+
+// Times every datagram is compressed to time it
+const unsigned int COMPRESSION_REPEAT = 20;
+
+// An entity update as a game would send it
+struct BenchEntity
+{
+	uint16_t id;
+	uint8_t type;
+	uint8_t animation;
+	float position[3];
+	float velocity[3];
+	uint16_t health;
+	uint16_t flags;
+};
+
+// Record the datagrams of a session with entity updates and some events
+// (or random payloads if `random`)
+static void bench_compression_record(Connection& conn, bool random, std::vector<Packet>& out)
+{
+	static const char *events[] = {
+		"player_joined", "player_left", "weapon_fired:rifle", "weapon_fired:shotgun",
+		"item_picked:health_pack", "item_picked:ammo_box", "chat:gg", "chat:nice shot",
+	};
+
+	conn.add_channel(1, Channel::RAW);
+	conn.add_channel(2, Channel::RAW);
+	conn.set_bandwidth(BANDWIDTH_UNLIMITED);
+	ChannelOut *updates = conn.get_channel_out_by_id(1);
+	ChannelOut *news = conn.get_channel_out_by_id(2);
+	CountingTransport transport;
+	PacketPool payloads(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+	net_time now;
+
+	std::mt19937 rng(1337);
+	std::vector<BenchEntity> entities(COMPRESSION_ENTITIES);
+	for (unsigned int i = 0; i < COMPRESSION_ENTITIES; i++) {
+		BenchEntity& e = entities[i];
+		memset(&e, 0, sizeof(e));
+		e.id = (uint16_t)(100 + i);
+		e.type = (uint8_t)(i % 4);
+		e.health = 100;
+		for (int k = 0; k < 3; k++) {
+			e.position[k] = (float)(rng() % 1000);
+			e.velocity[k] = (float)(rng() % 5) - 2.0f;
+		}
+	}
+
+	for (unsigned int tick = 0; tick < COMPRESSION_TICKS; tick++) {
+		for (auto& e : entities) {
+			for (int k = 0; k < 3; k++)
+				e.position[k] += e.velocity[k] * 0.033f;
+			e.animation = (uint8_t)(tick / 10 % 8);
+			Packet p = payloads.allocate_buffer(sizeof(e));
+			if (random) {
+				for (unsigned int j = 0; j < sizeof(e); j++)
+					p.data()[j] = (char)rng();
+			} else {
+				memcpy(p.data(), &e, sizeof(e));
+			}
+			updates->send(p);
+		}
+		if (rng() % 4 == 0) {
+			const char *event = events[rng() % (sizeof(events) / sizeof(events[0]))];
+			Packet p = payloads.allocate_buffer((unsigned int)strlen(event));
+			memcpy(p.data(), event, strlen(event));
+			news->send(p);
+		}
+
+		conn.send_outgoing(transport, now);
+		for (auto& datagram : transport.sent) {
+			PacketChain chain;
+			for (auto& slice : datagram)
+				chain.append(slice);
+			Packet copy = payloads.allocate_buffer(chain.size());
+			chain.copy_to(copy.data());
+			out.push_back(copy);
+		}
+		transport.sent.clear();
+		now += conn.send_interval();
+	}
+}
+
+static void bench_compression_run(const char *name, const std::vector<Packet>& datagrams, unsigned int first, const CompressionDictionary *dict)
+{
+	std::vector<char> compressed(lz_max_size(MAX_PACKET_SIZE));
+	std::vector<char> decompressed(MAX_PACKET_SIZE);
+	unsigned long long bytesIn = 0, bytesOut = 0;
+	unsigned int errors = 0;
+	double compressSeconds = 0.0, decompressSeconds = 0.0;
+
+	for (unsigned int i = first; i < datagrams.size(); i++) {
+		const Packet& p = datagrams[i];
+		unsigned int size = 0;
+		auto begin = std::chrono::high_resolution_clock::now();
+		for (unsigned int r = 0; r < COMPRESSION_REPEAT; r++)
+			size = lz_compress(p.data(), p.size(), &compressed[0], (unsigned int)compressed.size(), dict);
+		auto middle = std::chrono::high_resolution_clock::now();
+		unsigned int outSize = 0;
+		bool ok = true;
+		for (unsigned int r = 0; r < COMPRESSION_REPEAT; r++)
+			ok = lz_decompress(&compressed[0], size, &decompressed[0], (unsigned int)decompressed.size(), dict, outSize);
+		auto end = std::chrono::high_resolution_clock::now();
+
+		compressSeconds += std::chrono::duration<double>(middle - begin).count();
+		decompressSeconds += std::chrono::duration<double>(end - middle).count();
+		if (!ok || outSize != p.size() || memcmp(&decompressed[0], p.data(), p.size()) != 0)
+			errors++;
+		bytesIn += p.size();
+		bytesOut += size;
+	}
+
+	double bytes = (double)bytesIn * COMPRESSION_REPEAT;
+	BenchResult("compression", name)
+		.add("ratio", (double)bytesOut / bytesIn)
+		.add("compress_byte_ns", compressSeconds * 1e9 / bytes)
+		.add("decompress_byte_ns", decompressSeconds * 1e9 / bytes)
+		.add("errors", errors)
+		.check("datagrams that didn't decompress to themselves", errors == 0)
+		.report();
+}
+
+// Send recorded-like traffic through a connection with compression on and print what it did
+static void bench_compression_adaptive(const char *name, bool random, const CompressionDictionary *dict)
+{
+	Connection conn(Address::inet_any(), 0xDEADBEEF);
+	conn.set_compression(true, dict);
+	std::vector<Packet> datagrams;
+	bench_compression_record(conn, random, datagrams);
+
+	const CompressionStats& stats = conn.compression_stats();
+	BenchResult("compression", name)
+		.add("ratio", stats.ratio())
+		.add("byte_ns", stats.bytes_in ? (double)stats.nanoseconds / stats.bytes_in : 0.0)
+		.add("compressed", (double)stats.compressed)
+		.add("datagrams", (double)datagrams.size())
+		.add("turned_off", (double)stats.disabled)
+		.check(random ? "compression kept on for random data" : "game traffic not compressed", random ? stats.disabled > 0 : stats.compressed > 0 && stats.ratio() < 1.0)
+		.report();
+}
+
+void bench_compression()
+{
+	Connection conn(Address::inet_any(), 0xDEADBEEF);
+	std::vector<Packet> datagrams;
+	bench_compression_record(conn, false, datagrams);
+
+	// Train on the start of the session, measure on the rest
+	unsigned int first = (unsigned int)(datagrams.size() * COMPRESSION_TRAIN_TICKS / COMPRESSION_TICKS);
+	std::vector<Packet> training(datagrams.begin(), datagrams.begin() + first);
+	CompressionDictionary dict = CompressionDictionary::train(training, COMPRESSION_DICTIONARY_SIZE);
+
+	bench_compression_run("lz", datagrams, first, nullptr);
+	bench_compression_run("lz + dictionary", datagrams, first, &dict);
+	bench_compression_adaptive("adaptive", false, &dict);
+	bench_compression_adaptive("adaptive (random)", true, &dict);
+}
+
+// Connections the events are broadcast to
+const unsigned int BROADCAST_CONNECTIONS = 256;
+
+// Events broadcast per tick and ticks per size
+const unsigned int BROADCAST_EVENTS_PER_TICK = 8;
+const unsigned int BROADCAST_TICKS = 50;
+
+static void bench_broadcast_run(unsigned int size, bool shared)
+{
+	std::vector<Connection> conns;
+	for (unsigned int i = 0; i < BROADCAST_CONNECTIONS; i++) {
+		conns.push_back(Connection(Address::inet_any(), 0xDEADBEEF));
+		conns.back().add_channel(1, Channel::RAW);
+		conns.back().set_bandwidth(BANDWIDTH_UNLIMITED);
+	}
+	CountingTransport transport;
+	PacketPool payloads(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+	std::vector<char> event(size, 7);
+	net_time now;
+
+	double queueSeconds = 0.0, sendSeconds = 0.0;
+	for (unsigned int tick = 0; tick < BROADCAST_TICKS; tick++) {
+		auto begin = std::chrono::high_resolution_clock::now();
+		for (unsigned int e = 0; e < BROADCAST_EVENTS_PER_TICK; e++) {
+			if (shared) {
+				// Serialize once, every connection references the buffer
+				Packet p = payloads.allocate_buffer(size);
+				memcpy(p.data(), event.data(), size);
+				for (auto& conn : conns)
+					conn.send(1, p);
+			} else {
+				for (auto& conn : conns) {
+					Packet p = payloads.allocate_buffer(size);
+					memcpy(p.data(), event.data(), size);
+					conn.send(1, p);
+				}
+			}
+		}
+		auto queued = std::chrono::high_resolution_clock::now();
+		for (auto& conn : conns)
+			conn.send_outgoing(transport, now);
+		auto sent = std::chrono::high_resolution_clock::now();
+		queueSeconds += std::chrono::duration<double>(queued - begin).count();
+		sendSeconds += std::chrono::duration<double>(sent - queued).count();
+
+		transport.sent.clear();
+		now += conns[0].send_interval();
+		payloads.trim();
+	}
+
+	// Raw messages are sent once, every recipient got every event
+	unsigned long long payloadBytes = 0;
+	for (auto& conn : conns)
+		payloadBytes += conn.metrics().payload_bytes;
+
+	std::ostringstream name;
+	name << size << " bytes " << (shared ? "shared" : "copied");
+	BenchResult("broadcast", name.str())
+		.add("queue_tick_us", queueSeconds * 1e6 / BROADCAST_TICKS)
+		.add("send_tick_us", sendSeconds * 1e6 / BROADCAST_TICKS)
+		.add("recipient_event_ns", (queueSeconds + sendSeconds) * 1e9 / (BROADCAST_TICKS * BROADCAST_EVENTS_PER_TICK * BROADCAST_CONNECTIONS))
+		.check("events not sent to every recipient", payloadBytes == (unsigned long long)size * BROADCAST_TICKS * BROADCAST_EVENTS_PER_TICK * BROADCAST_CONNECTIONS)
+		.report();
+}
+
+void bench_broadcast()
+{
+	static const unsigned int sizes[] = { 64, 1024, 8000 };
+	for (auto size : sizes) {
+		bench_broadcast_run(size, false);
+		bench_broadcast_run(size, true);
+	}
+}
+
+// Allocations per pool run
+const unsigned int POOL_ALLOCATIONS = 1000000;
+
+// `live` packets are kept alive at once, like the messages waiting in a window
+static void bench_pool_run(const char *name, unsigned int size, unsigned int live, bool buffer)
+{
+	PacketPool pool(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+	std::vector<Packet> window(live);
+	auto begin = std::chrono::high_resolution_clock::now();
+	for (unsigned int i = 0; i < POOL_ALLOCATIONS; i++) {
+		Packet p;
+		if (buffer) {
+			p = pool.allocate_buffer(size);
+		} else {
+			pool.nextData()[0] = (char)i;
+			p = pool.allocate(size);
+		}
+		window[i % live] = p;
+		if (i % 1024 == 0)
+			pool.trim();
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	// The packets kept alive still hold what was written to them
+	bool intact = true;
+	for (unsigned int j = 0; j < live; j++) {
+		unsigned int i = POOL_ALLOCATIONS - 1 - (POOL_ALLOCATIONS - 1 - j) % live;
+		intact = intact && window[j].size() == size && (buffer || window[j].data()[0] == (char)i);
+	}
+
+	const PacketPoolStats& stats = pool.stats();
+	BenchResult("pool", name)
+		.add("allocation_ns", std::chrono::duration<double, std::nano>(end - begin).count() / POOL_ALLOCATIONS)
+		.add("peak_pages", stats.peak_pages)
+		.add("fragmentation", stats.fragmentation())
+		.check("live packets overwritten", intact)
+		.report();
+}
+
+void bench_pool()
+{
+	bench_pool_run("allocate 64", 64, 1, false);
+	bench_pool_run("allocate 64, 256 live", 64, 256, false);
+	bench_pool_run("allocate max", MAX_PACKET_SIZE, 1, false);
+	bench_pool_run("allocate max, 256 live", MAX_PACKET_SIZE, 256, false);
+	bench_pool_run("buffer 4000", 4000, 1, true);
+	bench_pool_run("buffer 4000, 256 live", 4000, 256, true);
+}
+
+// Messages per channel run
+const unsigned int CHANNEL_BENCH_MESSAGES = 200000;
+
+// Payload size of the messages (or of every fragment)
+const unsigned int CHANNEL_BENCH_SIZE = 64;
+
+// How many messages a reordered one falls behind at most
+const unsigned int CHANNEL_REORDER_DISTANCE = 8;
+
+// How many messages later a lost one arrives again on reliable channels
+const unsigned int CHANNEL_RESEND_DISTANCE = 32;
+
+static const char *channel_type_name(Channel::Type type)
+{
+	switch (type) {
+	case Channel::RAW:
+		return "raw";
+	case Channel::NEWEST:
+		return "newest";
+	case Channel::RELIABLE:
+		return "reliable";
+	case Channel::SEQUENTIAL:
+		return "sequential";
+	default:
+		return "other";
+	}
+}
+
+// Feed a channel messages of `fragments` fragments, some reordered and some lost
+// (lost ones arrive again later on reliable channels), reading after every arrival
+// Delivered with `Delivery` (`ChannelIn::Bound` or the policy of the type)
+template <typename Delivery>
+static void bench_channel_run(Channel::Type type, unsigned int fragments, double reorder, double loss)
+{
+	PacketPool pool(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+	ChannelIn chan(pool, type);
+
+	// Decide the arrival order first so only the channel is timed
+	std::mt19937 rng(1337);
+	std::uniform_real_distribution<double> pick(0.0, 1.0);
+	std::vector<std::pair<double, unsigned int>> arrivals;
+	unsigned int units = CHANNEL_BENCH_MESSAGES * fragments;
+	bool reliable = type == Channel::RELIABLE || type == Channel::SEQUENTIAL;
+	for (unsigned int i = 0; i < units; i++) {
+		double at = i;
+		if (pick(rng) < reorder)
+			at += pick(rng) * CHANNEL_REORDER_DISTANCE * fragments;
+		if (pick(rng) < loss) {
+			if (!reliable)
+				continue;
+			at += CHANNEL_RESEND_DISTANCE * fragments;
+		}
+		arrivals.push_back(std::make_pair(at, i));
+	}
+	std::sort(arrivals.begin(), arrivals.end());
+
+	Packet payload = pool.allocate_buffer(CHANNEL_BENCH_SIZE);
+	memset(payload.data(), 1, CHANNEL_BENCH_SIZE);
+	PacketChain message;
+	unsigned int received = 0;
+	unsigned int windowBudget = RECEIVE_WINDOW_BUDGET;
+	auto begin = std::chrono::high_resolution_clock::now();
+	for (auto& arrival : arrivals) {
+		seq_t seq = arrival.second / fragments + 1;
+		if (fragments == 1)
+			chan.add_packet<Delivery>(seq, payload, windowBudget);
+		else
+			chan.add_fragment<Delivery>(seq, payload, (fragment_id_t)(arrival.second % fragments), (fragment_id_t)fragments, windowBudget);
+		while (chan.receive<Delivery>(message))
+			received++;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	std::ostringstream name;
+	name << channel_type_name(type);
+	if (fragments > 1)
+		name << " x" << fragments;
+	if (reorder > 0.0 || loss > 0.0)
+		name << " disordered";
+	if (!std::is_same<Delivery, ChannelIn::Bound>::value)
+		name << " static";
+	// Reliable channels deliver everything, the others nothing twice (and everything in order)
+	bool disordered = reorder > 0.0 || loss > 0.0;
+	bool complete = reliable || !disordered ? received == CHANNEL_BENCH_MESSAGES : received <= arrivals.size() / fragments;
+	BenchResult("channel_in", name.str())
+		.add("message_ns", std::chrono::duration<double, std::nano>(end - begin).count() / CHANNEL_BENCH_MESSAGES)
+		.add("received", received)
+		.add("sent", CHANNEL_BENCH_MESSAGES)
+		.check(reliable || !disordered ? "messages lost" : "messages received twice", complete)
+		.report();
+}
+
+// Every case of a delivery policy, through the pointers bound to the channel and dispatched statically
+template <typename Delivery>
+static void bench_channel_policy()
+{
+	bench_channel_run<ChannelIn::Bound>(Delivery::TYPE, 1, 0.0, 0.0);
+	bench_channel_run<Delivery>(Delivery::TYPE, 1, 0.0, 0.0);
+	bench_channel_run<ChannelIn::Bound>(Delivery::TYPE, 1, 0.1, 0.05);
+	bench_channel_run<Delivery>(Delivery::TYPE, 1, 0.1, 0.05);
+}
+
+void bench_channel_receive()
+{
+	bench_channel_policy<ChannelIn::Raw>();
+	bench_channel_policy<ChannelIn::Newest>();
+	bench_channel_policy<ChannelIn::Reliable>();
+	bench_channel_policy<ChannelIn::Sequential>();
+	bench_channel_run<ChannelIn::Bound>(Channel::RELIABLE, 4, 0.0, 0.0);
+	bench_channel_run<ChannelIn::Bound>(Channel::RELIABLE, 4, 0.1, 0.05);
+	bench_channel_run<ChannelIn::Bound>(Channel::SEQUENTIAL, 4, 0.1, 0.05);
+}
+
+// Ticks per ack run and datagrams sent per tick
+const unsigned int ACK_TICKS = 2000;
+const unsigned int ACK_DATAGRAMS_PER_TICK = 16;
+
+// Time processing the acks of a busy connection, the peer misses `loss` of the datagrams
+static void bench_ack_run(double loss)
+{
+	Connection conn(Address::inet_any(), 0xDEADBEEF);
+	Connection peer(Address::inet_any(), 0xDEADBEEF);
+	conn.add_channel(1, Channel::RAW);
+	peer.add_channel(1, Channel::RAW);
+	conn.set_bandwidth(BANDWIDTH_UNLIMITED);
+	peer.set_bandwidth(BANDWIDTH_UNLIMITED);
+	conn.set_max_packet_size(MIN_PACKET_SIZE);
+	CountingTransport transport, ackTransport;
+	PacketPool payloads(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+	ChannelIn *peerChan = peer.get_channel_in_by_id(1);
+	net_time now;
+
+	std::mt19937 rng(1337);
+	std::uniform_real_distribution<double> pick(0.0, 1.0);
+	double seconds = 0.0;
+	unsigned long long acks = 0, delivered = 0;
+	for (unsigned int tick = 0; tick < ACK_TICKS; tick++) {
+		// A message per datagram
+		for (unsigned int i = 0; i < ACK_DATAGRAMS_PER_TICK; i++) {
+			Packet p = payloads.allocate_buffer(MAX_UNFRAGMENTED_MESSAGE_SIZE / 2 + 1);
+			memset(p.data(), (char)i, p.size());
+			conn.send(1, p);
+		}
+		conn.send_outgoing(transport, now);
+		for (unsigned int i = 0; i < transport.sent.size(); i++) {
+			if (pick(rng) >= loss) {
+				transport.deliver(peer, i, now);
+				delivered++;
+			}
+		}
+		transport.sent.clear();
+		while (!peerChan->receive().empty())
+			;
+		peer.send_outgoing(ackTransport, now);
+		acks += ackTransport.sent.size();
+
+		auto begin = std::chrono::high_resolution_clock::now();
+		ackTransport.deliver(conn, now);
+		seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+		now += conn.send_interval();
+		payloads.trim();
+	}
+
+	std::ostringstream name;
+	name << "loss " << loss;
+	BenchResult("ack", name.str())
+		.add("ack_datagram_ns", seconds * 1e9 / std::max(acks, 1ULL))
+		.add("acked_packet_ns", seconds * 1e9 / std::max(delivered, 1ULL))
+		.add("packets_lost", (double)conn.metrics().packets_lost)
+		.check(loss > 0.0 ? "losses not detected" : "packets lost without losses", (conn.metrics().packets_lost > 0) == (loss > 0.0))
+		.report();
+}
+
+void bench_ack()
+{
+	bench_ack_run(0.0);
+	bench_ack_run(0.02);
+	bench_ack_run(0.2);
+}
+
+// Connections in the store benchmark and lookups timed
+const unsigned int STORE_CONNECTIONS = 10000;
+const unsigned int STORE_LOOKUPS = 1000000;
+// Passes of the scans timed
+const unsigned int STORE_SCANS = 1000;
+
+static Address load_address(unsigned int index);
+
+void bench_connection_store()
+{
+	ConnectionStore store;
+	std::map<Address, Connection*> tree;
+	std::vector<Address> addresses;
+	net_time now = net_clock::now();
+	std::mt19937 rng(1337);
+	size_t expectedDue = 0;
+	for (unsigned int i = 0; i < STORE_CONNECTIONS; i++) {
+		Address addr = load_address(i);
+		addresses.push_back(addr);
+		// Deadlines spread over a tick, a few are due
+		unsigned int offset = rng() % 33000;
+		expectedDue += offset <= 1000;
+		ConnectionHandle h = store.add(addr, Connection(addr, 0xDEADBEEF, now), now + std::chrono::microseconds(offset));
+		tree[addr] = store.get(h);
+	}
+	std::vector<unsigned int> order(STORE_LOOKUPS);
+	for (auto& i : order)
+		i = rng() % STORE_CONNECTIONS;
+
+	unsigned int found = 0;
+	auto begin = std::chrono::high_resolution_clock::now();
+	for (auto i : order)
+		found += store.get(store.find(addresses[i])) != nullptr;
+	auto middle = std::chrono::high_resolution_clock::now();
+	for (auto i : order)
+		found += tree.find(addresses[i]) != tree.end();
+	auto end = std::chrono::high_resolution_clock::now();
+
+	std::vector<ConnectionHandle> out;
+	size_t due = 0;
+	auto scanBegin = std::chrono::high_resolution_clock::now();
+	for (unsigned int i = 0; i < STORE_SCANS; i++) {
+		store.collect_due(now + std::chrono::milliseconds(1), out);
+		due += out.size();
+		store.collect_silent(now - std::chrono::seconds(10), out);
+	}
+	auto scanEnd = std::chrono::high_resolution_clock::now();
+
+	std::ostringstream name;
+	name << STORE_CONNECTIONS << " connections";
+	BenchResult("store", name.str())
+		.add("find_ns", std::chrono::duration<double, std::nano>(middle - begin).count() / STORE_LOOKUPS)
+		.add("map_find_ns", std::chrono::duration<double, std::nano>(end - middle).count() / STORE_LOOKUPS)
+		.add("scan_us", std::chrono::duration<double, std::micro>(scanEnd - scanBegin).count() / STORE_SCANS)
+		.add("due", (double)due / STORE_SCANS)
+		.add("found", found)
+		.check("connections not found", found == 2 * STORE_LOOKUPS)
+		.check("wrong connections due", due == expectedDue * STORE_SCANS)
+		.report();
+}
+
+// Client inputs and server state broadcast every tick of the load test
+const unsigned int LOAD_INPUT_SIZE = 32;
+const unsigned int LOAD_STATE_SIZE = 200;
+
+// Ticks between the reliable events of the load test
+const unsigned int LOAD_EVENT_INTERVAL = 10;
+
+// Resident memory of the process, 0 where unknown
+static unsigned long long resident_bytes()
+{
+#ifdef __linux__
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm == nullptr)
+		return 0;
+	unsigned long long size = 0, resident = 0;
+	if (fscanf(statm, "%llu %llu", &size, &resident) != 2)
+		resident = 0;
+	fclose(statm);
+	return resident * sysconf(_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+// The clients of the load test are at 10.x.y.z:port addresses made from their index
+static Address load_address(unsigned int index)
+{
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short)(1024 + index % 50000));
+	addr.sin_addr.s_addr = htonl((10u << 24) | index / 50000);
+	return Address(reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+}
+
+static unsigned int load_index(const Address& addr)
+{
+	const sockaddr_in *in = reinterpret_cast<const sockaddr_in*>(addr.get_sockaddr());
+	return (ntohl(in->sin_addr.s_addr) & 0xFFFFFF) * 50000 + ntohs(in->sin_port) - 1024;
+}
+
+// One end of the in-process network of the load test
+// The server's end receives what the clients sent and sends to the client inboxes,
+// the clients' end sends to the server from `from`
+class LoadTransport : public Transport
+{
+public:
+	LoadTransport(std::vector<Datagram>& toServer, std::vector<std::vector<Packet>>& toClients)
+		: m_to_server(toServer)
+		, m_to_clients(toClients)
+		, m_read(0)
+	{ }
+
+	virtual unsigned int receive(PacketPool& /*pool*/, Datagram *out, unsigned int count)
+	{
+		unsigned int received = 0;
+		while (received < count && m_read < m_to_server.size())
+			out[received++] = std::move(m_to_server[m_read++]);
+		if (m_read == m_to_server.size()) {
+			m_to_server.clear();
+			m_read = 0;
+		}
+		return received;
+	}
+
+	virtual void send(const Address& addr, const Packet& packet)
+	{
+		m_stats.send_datagrams++;
+		bytes_sent += packet.size();
+		if (server)
+			m_to_clients[load_index(addr)].push_back(packet);
+		else
+			m_to_server.push_back(Datagram(from, packet));
+	}
+
+	bool server;
+	Address from;
+	unsigned long long bytes_sent;
+
+private:
+	std::vector<Datagram>& m_to_server;
+	std::vector<std::vector<Packet>>& m_to_clients;
+	size_t m_read;
+};
+
+void bench_load(unsigned int clients, unsigned int seconds)
+{
+	std::vector<Datagram> toServer;
+	std::vector<std::vector<Packet>> toClients(clients);
+	LoadTransport *serverTransport = new LoadTransport(toServer, toClients);
+	serverTransport->server = true;
+	serverTransport->bytes_sent = 0;
+	LoadTransport clientTransport(toServer, toClients);
+	clientTransport.server = false;
+	clientTransport.bytes_sent = 0;
+	ServerShard shard((std::unique_ptr<Transport>(serverTransport)));
+	shard.set_log(nullptr);
+	PacketPool payloads(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+
+	// Handshake every client, the second round creates the server's connections
+	Packet request = payloads.allocate_buffer(HANDSHAKE_REQUEST_SIZE);
+	memset(request.data(), 0, request.size());
+	NetWriter(request.data(), request.size()).write(HANDSHAKE_REQUEST);
+	for (unsigned int i = 0; i < clients; i++)
+		toServer.push_back(Datagram(load_address(i), request));
+	shard.receive();
+	for (unsigned int i = 0; i < clients; i++) {
+		for (auto& challenge : toClients[i]) {
+			Packet response = payloads.allocate_buffer(challenge.size());
+			memcpy(response.data(), challenge.data(), challenge.size());
+			NetWriter(response.data(), response.size()).write(HANDSHAKE_RESPONSE);
+			toServer.push_back(Datagram(load_address(i), response));
+		}
+		toClients[i].clear();
+	}
+	unsigned long long memoryBefore = resident_bytes();
+	shard.receive();
+	unsigned long long memoryAfter = resident_bytes();
+
+	std::vector<Connection> conns(clients);
+	for (unsigned int i = 0; i < clients; i++) {
+		for (auto& accept : toClients[i]) {
+			NetReader reader = accept.read();
+			magic_t type, magic;
+			if (reader.read(type) && type == HANDSHAKE_ACCEPT && reader.read(magic))
+				conns[i] = Connection(Address::inet_any(), magic, net_clock::now());
+		}
+		toClients[i].clear();
+		conns[i].add_channel(1, Channel::RAW);
+	}
+	shard.for_each_connection([](Connection& conn) {
+		conn.add_channel(1, Channel::RAW);
+	});
+
+	Histogram tickTimes;
+	unsigned long long inputs = 0, states = 0, datagramsIn = 0, ticks = 0, overruns = 0;
+	double busy = 0.0;
+	net_duration interval = conns.empty() ? std::chrono::milliseconds(33) : conns[0].send_interval();
+	net_time begin = net_clock::now();
+	net_time end = begin + std::chrono::seconds(seconds);
+	net_time next = begin;
+	while (next < end) {
+		net_time now = net_clock::now();
+		for (unsigned int i = 0; i < clients; i++) {
+			Packet input = payloads.allocate_buffer(LOAD_INPUT_SIZE);
+			memset(input.data(), (char)i, LOAD_INPUT_SIZE);
+			conns[i].send(1, input);
+			clientTransport.from = load_address(i);
+			conns[i].send_outgoing(clientTransport, now);
+		}
+		datagramsIn += toServer.size();
+
+		// The server's part is what is measured
+		auto tickBegin = std::chrono::high_resolution_clock::now();
+		shard.receive();
+		shard.for_each_connection([&](Connection& conn) {
+			ChannelIn *chan = conn.get_channel_in_by_id(1);
+			while (!chan->receive().empty())
+				inputs++;
+			while (!conn.get_channel_in_by_id(0)->receive().empty())
+				;
+		});
+		Packet state = payloads.allocate_buffer(LOAD_STATE_SIZE);
+		memset(state.data(), (char)ticks, LOAD_STATE_SIZE);
+		shard.broadcast(1, state);
+		if (ticks % LOAD_EVENT_INTERVAL == 0)
+			shard.broadcast(0, state.subpacket(0, LOAD_INPUT_SIZE));
+		shard.tick(net_clock::now());
+		auto tickEnd = std::chrono::high_resolution_clock::now();
+		double tickSeconds = std::chrono::duration<double>(tickEnd - tickBegin).count();
+		tickTimes.add((uint64_t)(tickSeconds * 1e6));
+		busy += tickSeconds;
+
+		now = net_clock::now();
+		for (unsigned int i = 0; i < clients; i++) {
+			for (auto& packet : toClients[i])
+				conns[i].process_packet(packet, now);
+			toClients[i].clear();
+			while (!conns[i].get_channel_in_by_id(1)->receive().empty())
+				states++;
+			while (!conns[i].get_channel_in_by_id(0)->receive().empty())
+				;
+		}
+		payloads.trim();
+
+		ticks++;
+		next += interval;
+		if (net_clock::now() > next)
+			overruns++;
+		else
+			std::this_thread::sleep_until(next);
+	}
+	double elapsed = std::chrono::duration<double>(net_clock::now() - begin).count();
+
+	std::ostringstream name;
+	name << clients << " clients";
+	BenchResult("load", name.str())
+		.add("connections", (double)shard.num_connections())
+		.add("ticks", (double)ticks)
+		.add("overruns", (double)overruns)
+		.add("datagrams_in_per_s", datagramsIn / elapsed)
+		.add("datagrams_out_per_s", serverTransport->stats().send_datagrams / elapsed)
+		.add("bytes_out_per_s", serverTransport->bytes_sent / elapsed)
+		.add("inputs_per_s", inputs / elapsed)
+		.add("states_per_s", states / elapsed)
+		.add("server_busy", busy / elapsed)
+		.add("capacity_datagrams_per_s", busy > 0.0 ? datagramsIn / busy : 0.0)
+		.add("tick_p50_us", (double)tickTimes.percentile(0.5))
+		.add("tick_p90_us", (double)tickTimes.percentile(0.9))
+		.add("tick_p99_us", (double)tickTimes.percentile(0.99))
+		.add("tick_max_us", (double)tickTimes.max)
+		.add("connection_bytes", clients && memoryAfter > memoryBefore ? (double)(memoryAfter - memoryBefore) / clients : 0.0)
+		.check("clients not connected", shard.num_connections() == clients)
+		.check("inputs or states lost", inputs == ticks * clients && states == ticks * clients)
+		.report();
+}
\ No newline at end of file
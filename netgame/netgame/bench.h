@@ -0,0 +1,62 @@
+#ifndef _NETGAME_BENCH_H
+#define _NETGAME_BENCH_H
+
+#include <ostream>
+
+// Where the results go: a line of text per case, or a JSON object per line
+// ({"bench":...,"case":...} and the measurements) to compare runs across releases
+void set_bench_output(std::ostream& out, bool json);
+
+// Number of cases whose results were wrong so far (eg. datagrams lost on loopback)
+// Every case checks what it measured, the failures are reported with the measurements
+unsigned int bench_failures();
+
+// Compare the single, batched and io_uring (Linux) datagram I/O over loopback
+// Reports packets per second and syscalls per packet for each
+void bench_transport();
+
+// Compare handing received packets to another thread with a concurrent pool
+// against copying the payloads and against staying on one thread
+// Reports nanoseconds per packet for each
+void bench_packet_handoff();
+
+// Measure the `send_outgoing` packer over different message size distributions
+// Reports packing time and wire efficiency (payload bytes / datagram bytes)
+void bench_packer();
+
+// Compress datagrams recorded from a simulated game session with and without a
+// trained dictionary, and check the adaptive switch on incompressible traffic
+// Reports compression ratio and nanoseconds per byte
+void bench_compression();
+
+// Queue the same events on many connections, serialized per recipient against one
+// shared buffer, and send them
+// Reports microseconds per tick for queueing and for sending with both
+void bench_broadcast();
+
+// Allocate packets and buffers from a pool, releasing them at once or after a while
+// Reports nanoseconds per allocation and the pages it took
+void bench_pool();
+
+// Feed the receiving side of each channel type whole and fragmented messages, in
+// order and with some reordered and lost (resent later on reliable channels)
+// Reports nanoseconds per message from `add_packet`/`add_fragment` to `receive`, with
+// the type switch and with the delivery policy called directly ("static")
+void bench_channel_receive();
+
+// Process the acks of a connection sending many datagrams a tick with some lost
+// Reports nanoseconds per ack datagram and per acknowledged packet
+void bench_ack();
+
+// Look up connections by address in the connection store and in a `std::map`, and
+// scan the store for the connections due to send and the silent ones
+// Reports nanoseconds per lookup and microseconds per pass of the scans
+void bench_connection_store();
+
+// Run a server shard and `clients` clients in one process for `seconds`, connected by
+// in-memory queues: the clients send inputs every tick and the server broadcasts a state
+// Reports the datagram throughput, percentiles of the server's tick time and the memory
+// a connection takes on the server
+void bench_load(unsigned int clients, unsigned int seconds);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,203 @@
+#include "bitstream.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "util.h"
+
+unsigned int bits_required(uint32_t range)
+{
+	return range == 0 ? 0 : highest_bit(range) + 1;
+}
+
+// Number of steps of `resolution` in [min, max]
+static uint32_t float_steps(float min, float max, float resolution)
+{
+	return (uint32_t)((max - min) / resolution + 0.5f);
+}
+
+BitWriter::BitWriter(char *data, unsigned int capacity)
+	: m_data(data)
+	, m_capacity(capacity)
+	, m_bits(0)
+	, m_overflow(false)
+{
+}
+
+void BitWriter::write_bits(uint32_t value, unsigned int bits)
+{
+	if (m_overflow || m_bits + bits > m_capacity * 8) {
+		m_overflow = true;
+		return;
+	}
+	while (bits > 0) {
+		unsigned int byte = m_bits / 8;
+		unsigned int offset = m_bits % 8;
+		unsigned int n = std::min(bits, 8 - offset);
+		// Starting a new byte, clear it
+		if (offset == 0)
+			m_data[byte] = 0;
+		m_data[byte] |= (char)((value & ((1u << n) - 1)) << offset);
+		value >>= n;
+		bits -= n;
+		m_bits += n;
+	}
+}
+
+void BitWriter::write_bounded(uint32_t value, uint32_t min, uint32_t max)
+{
+	value = std::min(std::max(value, min), max);
+	write_bits(value - min, bits_required(max - min));
+}
+
+void BitWriter::write_varint(uint32_t value)
+{
+	while (value >= 0x80) {
+		write_bits((value & 0x7f) | 0x80, 8);
+		value >>= 7;
+	}
+	write_bits(value, 8);
+}
+
+void BitWriter::write_signed_varint(int32_t value)
+{
+	write_varint(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+void BitWriter::write_float(float value, float min, float max, float resolution)
+{
+	uint32_t steps = float_steps(min, max, resolution);
+	value = std::min(std::max(value, min), max);
+	write_bits((uint32_t)((value - min) / resolution + 0.5f), bits_required(steps));
+}
+
+void BitWriter::align()
+{
+	if (m_bits % 8 != 0)
+		write_bits(0, 8 - m_bits % 8);
+}
+
+void BitWriter::write_bytes(const char *data, unsigned int size)
+{
+	align();
+	if (m_overflow || m_bits / 8 + size > m_capacity) {
+		m_overflow = true;
+		return;
+	}
+	memcpy(m_data + m_bits / 8, data, size);
+	m_bits += size * 8;
+}
+
+void BitWriter::pad(unsigned int size)
+{
+	align();
+	if (m_overflow || size > m_capacity) {
+		m_overflow = true;
+		return;
+	}
+	if (size * 8 > m_bits) {
+		memset(m_data + m_bits / 8, 0, size - m_bits / 8);
+		m_bits = size * 8;
+	}
+}
+
+BitReader::BitReader(const char *data, unsigned int size)
+	: m_data(data)
+	, m_size(size)
+	, m_bits(0)
+{
+}
+
+bool BitReader::read_bits(uint32_t& value, unsigned int bits)
+{
+	if (m_bits + bits > m_size * 8)
+		return false;
+	value = 0;
+	unsigned int shift = 0;
+	while (bits > 0) {
+		unsigned int offset = m_bits % 8;
+		unsigned int n = std::min(bits, 8 - offset);
+		uint32_t byte = (unsigned char)m_data[m_bits / 8];
+		value |= ((byte >> offset) & ((1u << n) - 1)) << shift;
+		shift += n;
+		bits -= n;
+		m_bits += n;
+	}
+	return true;
+}
+
+bool BitReader::read_bool(bool& value)
+{
+	uint32_t bit;
+	if (!read_bits(bit, 1))
+		return false;
+	value = bit != 0;
+	return true;
+}
+
+bool BitReader::read_bounded(uint32_t& value, uint32_t min, uint32_t max)
+{
+	if (!read_bits(value, bits_required(max - min)))
+		return false;
+	value += min;
+	return value <= max;
+}
+
+bool BitReader::read_varint(uint32_t& value)
+{
+	value = 0;
+	for (unsigned int shift = 0; shift < 35; shift += 7) {
+		uint32_t group;
+		if (!read_bits(group, 8))
+			return false;
+		value |= (group & 0x7f) << shift;
+		if (!(group & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool BitReader::read_signed_varint(int32_t& value)
+{
+	uint32_t zigzag;
+	if (!read_varint(zigzag))
+		return false;
+	value = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+	return true;
+}
+
+bool BitReader::read_float(float& value, float min, float max, float resolution)
+{
+	uint32_t steps = float_steps(min, max, resolution);
+	uint32_t quantized;
+	if (!read_bits(quantized, bits_required(steps)) || quantized > steps)
+		return false;
+	value = min + quantized * resolution;
+	return true;
+}
+
+void BitReader::align()
+{
+	m_bits = (m_bits + 7) / 8 * 8;
+	if (m_bits > m_size * 8)
+		m_bits = m_size * 8;
+}
+
+bool BitReader::skip_bytes(unsigned int size)
+{
+	align();
+	if (m_bits / 8 + size > m_size)
+		return false;
+	m_bits += size * 8;
+	return true;
+}
+
+bool BitReader::read_bytes(char *out, unsigned int size)
+{
+	align();
+	if (m_bits / 8 + size > m_size)
+		return false;
+	memcpy(out, m_data + m_bits / 8, size);
+	m_bits += size * 8;
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,84 @@
+#ifndef _NETGAME_BITSTREAM_H
+#define _NETGAME_BITSTREAM_H
+
+#include <cstdint>
+
+// Number of bits needed to store every value in [0, range]
+unsigned int bits_required(uint32_t range);
+
+// Writes values with the least bits needed (for headers and compact state)
+// Bits are packed from the lowest bit of every byte, `align()` before raw bytes
+class BitWriter
+{
+public:
+	BitWriter(char *data, unsigned int capacity);
+
+	// Write the low `bits` bits of `value` (0 to 32 bits)
+	void write_bits(uint32_t value, unsigned int bits);
+	void write_bool(bool value) { write_bits(value ? 1 : 0, 1); }
+
+	// Value in [min, max] (clamped)
+	void write_bounded(uint32_t value, uint32_t min, uint32_t max);
+
+	// 7 bits per group, small values take fewer bytes
+	void write_varint(uint32_t value);
+	// Zigzag encoded so small negative values are small too
+	void write_signed_varint(int32_t value);
+
+	// Quantized to `resolution` steps in [min, max] (clamped)
+	void write_float(float value, float min, float max, float resolution);
+
+	// Pad to the next byte boundary with zeros
+	void align();
+
+	// Aligns and copies bytes
+	void write_bytes(const char *data, unsigned int size);
+
+	// Fill with zeros up to `size` bytes
+	void pad(unsigned int size);
+
+	char *data() { return m_data; }
+	unsigned int bits_written() const { return m_bits; }
+	// Written size rounded up to whole bytes
+	unsigned int bytes_written() const { return (m_bits + 7) / 8; }
+
+	// Set if a write didn't fit (the writes after it are ignored)
+	bool overflowed() const { return m_overflow; }
+
+private:
+	char *m_data;
+	unsigned int m_capacity;
+	unsigned int m_bits;
+	bool m_overflow;
+};
+
+// Reads the values written by `BitWriter`, every read returns false past the end
+class BitReader
+{
+public:
+	BitReader(const char *data, unsigned int size);
+
+	bool read_bits(uint32_t& value, unsigned int bits);
+	bool read_bool(bool& value);
+	bool read_bounded(uint32_t& value, uint32_t min, uint32_t max);
+	bool read_varint(uint32_t& value);
+	bool read_signed_varint(int32_t& value);
+	bool read_float(float& value, float min, float max, float resolution);
+
+	void align();
+
+	// Skip `size` bytes after aligning (eg. a payload referenced in place)
+	bool skip_bytes(unsigned int size);
+	bool read_bytes(char *out, unsigned int size);
+
+	// Offset of the next byte (after aligning)
+	unsigned int byte_position() const { return (m_bits + 7) / 8; }
+	unsigned int bits_left() const { return m_size * 8 - m_bits; }
+
+private:
+	const char *m_data;
+	unsigned int m_size;
+	unsigned int m_bits;
+};
+
+#endif
\ No newline at end of file
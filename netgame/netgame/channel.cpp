@@ -1,18 +1,19 @@
 #include "channel.h"
 #include <algorithm>
 #include <utility>
+#include <cstring>
+#include "delta.h"
 #include "util.h"
 
-ChannelIn::PendingPacket::PendingPacket(fragment_bitfield_t frags, seq_t seq, Packet&& p)
-	: frag_need(frags)
-	, seq(seq)
-	, packet(std::move(p))
+ChannelIn::PendingPacket::PendingPacket()
+	: frag_need(0)
+	, seq(0)
 { }
 
 ChannelIn::PendingPacket::PendingPacket(PendingPacket&& p)
 	: frag_need(p.frag_need)
 	, seq(p.seq)
-	, packet(std::move(p.packet))
+	, chain(std::move(p.chain))
 {
 }
 
@@ -20,18 +21,113 @@ ChannelIn::PendingPacket& ChannelIn::PendingPacket::operator=(PendingPacket p)
 {
 	frag_need = p.frag_need;
 	seq = p.seq;
-	std::swap(packet, p.packet);
+	std::swap(chain, p.chain);
+	return *this;
+}
+
+// = default
+ChannelIn::ChannelIn(ChannelIn&& c)
+	: Channel(c)
+	, m_last_read(c.m_last_read)
+	, m_newest(c.m_newest)
+	, m_received(std::move(c.m_received))
+	, m_ready(std::move(c.m_ready))
+	, m_baselines(std::move(c.m_baselines))
+	, m_stream_offset(c.m_stream_offset)
+	, m_stream_size(c.m_stream_size)
+	, m_advertised(c.m_advertised)
+	, m_update_ticks(c.m_update_ticks)
+	, fragPool(c.fragPool)
+	, m_completed(c.m_completed)
+	, m_receive(c.m_receive)
+{
+}
+
+ChannelIn& ChannelIn::operator=(ChannelIn c)
+{
+	std::swap(m_type, c.m_type);
+	std::swap(m_metrics, c.m_metrics);
+	std::swap(m_last_read, c.m_last_read);
+	std::swap(m_newest, c.m_newest);
+	std::swap(m_received, c.m_received);
+	m_ready.swap(c.m_ready);
+	std::swap(m_baselines, c.m_baselines);
+	std::swap(m_stream_offset, c.m_stream_offset);
+	std::swap(m_stream_size, c.m_stream_size);
+	std::swap(m_advertised, c.m_advertised);
+	std::swap(m_update_ticks, c.m_update_ticks);
+	std::swap(fragPool, c.fragPool);
+	std::swap(m_completed, c.m_completed);
+	std::swap(m_receive, c.m_receive);
+	return *this;
+}
+
+// = default
+ChannelOut::ChannelOut(ChannelOut&& c)
+	: Channel(c)
+	, m_outgoing(std::move(c.m_outgoing))
+	, m_seq(c.m_seq)
+	, m_acked(c.m_acked)
+	, m_snapshots(std::move(c.m_snapshots))
+	, m_encode_buffer(std::move(c.m_encode_buffer))
+	, m_stream(std::move(c.m_stream))
+	, m_stream_offset(c.m_stream_offset)
+	, m_stream_base(c.m_stream_base)
+	, m_stream_read(c.m_stream_read)
+	, m_unacked(std::move(c.m_unacked))
+	, m_pool(c.m_pool)
+	, m_priority(c.m_priority)
+	, m_accumulator(c.m_accumulator)
+{
+}
+
+ChannelOut& ChannelOut::operator=(ChannelOut c)
+{
+	std::swap(m_type, c.m_type);
+	std::swap(m_metrics, c.m_metrics);
+	m_outgoing.swap(c.m_outgoing);
+	std::swap(m_seq, c.m_seq);
+	std::swap(m_acked, c.m_acked);
+	std::swap(m_snapshots, c.m_snapshots);
+	m_encode_buffer.swap(c.m_encode_buffer);
+	m_stream.swap(c.m_stream);
+	std::swap(m_stream_offset, c.m_stream_offset);
+	std::swap(m_stream_base, c.m_stream_base);
+	std::swap(m_stream_read, c.m_stream_read);
+	std::swap(m_unacked, c.m_unacked);
+	std::swap(m_pool, c.m_pool);
+	std::swap(m_priority, c.m_priority);
+	std::swap(m_accumulator, c.m_accumulator);
 	return *this;
 }
 
+ChannelOut::OutgoingPacket::OutgoingPacket()
+	: seq(0)
+	, frag_index(0)
+	, frag_count(0)
+{ }
+
 ChannelOut::OutgoingPacket::OutgoingPacket(seq_t seq, Packet&& p)
 	: seq(seq)
 	, packet(std::move(p))
+	, frag_index(0)
+	, frag_count(0)
+{ }
+
+ChannelOut::OutgoingPacket::OutgoingPacket(seq_t seq, Packet&& p, fragment_id_t fragIndex, fragment_id_t fragCount, const Packet& message)
+	: seq(seq)
+	, packet(std::move(p))
+	, frag_index(fragIndex)
+	, frag_count(fragCount)
+	, message(message)
 { }
 
 ChannelOut::OutgoingPacket::OutgoingPacket(OutgoingPacket&& p)
 	: seq(p.seq)
 	, packet(std::move(p.packet))
+	, frag_index(p.frag_index)
+	, frag_count(p.frag_count)
+	, message(std::move(p.message))
 {
 }
 
@@ -39,133 +135,420 @@ ChannelOut::OutgoingPacket& ChannelOut::OutgoingPacket::operator=(OutgoingPacket
 {
 	seq = p.seq;
 	std::swap(packet, p.packet);
+	frag_index = p.frag_index;
+	frag_count = p.frag_count;
+	std::swap(message, p.message);
 	return *this;
 }
 
-ChannelIn::PendingPacket* ChannelIn::add_packet(seq_t seq, Packet packet, fragment_bitfield_t frags)
+ChannelIn::PendingPacket* ChannelIn::insert(seq_t seq, unsigned int& windowBudget)
 {
-	auto pending = PendingPacket(frags, seq, std::move(packet));
-
-	if (m_type == RAW) {
-		// Remove too old packets (if raw)
-		if (m_received.size() > 32) {
-			m_last_read = m_received.front().seq;
-			m_received.pop_front();
-		}
-	}
 	// Don't add duplicate packets
-	if (pending.seq <= m_last_read)
+	if (seq <= m_last_read || m_received.exists(seq))
 		return nullptr;
 
-	if (m_received.empty() || pending.seq > m_received.back().seq) {
-		// Always push if empty or newer than the last
-		m_received.push_back(std::move(pending));
-		return &m_received.back();
-	} else {
-		// Else insert to the correct position in the queue (if new)
-		auto pos = std::lower_bound(m_received.begin(), m_received.end(), pending,
-			[](const decltype(pending)& a, const decltype(pending)& b) {
-				return a.seq < b.seq;
-			});
-		NETGAME_ASSERT(pos != m_received.end());
-		if (pos->seq != pending.seq)
-			m_received.insert(pos, std::move(pending));
-		else
-			return nullptr;
-		return &*pos;
+	// Make room for a message past the window
+	if (seq - m_last_read > m_received.capacity()) {
+		if (is_reliable()) {
+			if (!grow(seq, windowBudget)) {
+				m_metrics.messages_dropped++;
+				return nullptr;
+			}
+		} else {
+			// Remove too old packets (if not reliable)
+			drop_until(seq - m_received.capacity());
+		}
 	}
+
+	PendingPacket& pending = m_received.insert(seq);
+	pending.seq = seq;
+	pending.frag_need = 0;
+	pending.chain.clear();
+	return &pending;
+}
+
+bool ChannelIn::store_packet(seq_t seq, const Packet& packet, unsigned int& windowBudget)
+{
+	PendingPacket *pending = insert(seq, windowBudget);
+	if (pending == nullptr)
+		return false;
+	pending->chain.append(packet);
+	return true;
 }
 
-void ChannelIn::add_fragment(seq_t seq, const Packet& packet, fragment_id_t fragId, fragment_id_t fragCount, unsigned int startIndex, message_size_t msgSize)
+bool ChannelIn::store_fragment(seq_t seq, const Packet& packet, fragment_id_t fragId, fragment_id_t fragCount, unsigned int& windowBudget)
 {
 	// Find the pending packet that misses the fragment
-	auto pos = std::find_if(m_received.begin(), m_received.end(),
-		[=](const PendingPacket& p){ return p.seq == seq; });
-
-	PendingPacket *pending = nullptr;
-	if (pos != m_received.end()) {
-		// If the packet is pending copy to it
-		pending = &*pos;
-	} else {
-		// Else try to create a new packet
-		pending = add_packet(seq, fragPool.allocate(msgSize), (~(fragment_bitfield_t)0 >> (FRAGMENTS_PER_BITFIELD - fragCount)) & ~(1 << fragId));
-	}
-	
-	// Extend a packet if found and is not consumed
-	if (pending != nullptr && !pending->packet.empty()) {
-		fragment_bitfield_t bit = 1 << fragId;
-		// If the fragment is still missing
-		if (pending->frag_need & bit) {
-			// Clear the filled bit
-			pending->frag_need &= ~bit;
-			// Copy the fragment data to the buffer
-			memcpy(pending->packet.data() + startIndex, packet.data(), packet.size());
+	PendingPacket *pending = m_received.find(seq);
+	if (pending == nullptr) {
+		// Try to create a new packet
+		pending = insert(seq, windowBudget);
+		if (pending == nullptr)
+			return false;
+		pending->frag_need = ~(fragment_bitfield_t)0 >> (FRAGMENTS_PER_BITFIELD - fragCount);
+		pending->chain.resize(fragCount);
+	} else if (pending->frag_need != 0 && fragCount > pending->chain.num_slices()) {
+		// The sender cut the message again into more fragments for a smaller packet size
+		// Start over, the fragments of the old cut don't line up with the new ones
+		pending->frag_need = ~(fragment_bitfield_t)0 >> (FRAGMENTS_PER_BITFIELD - fragCount);
+		pending->chain.clear();
+		pending->chain.resize(fragCount);
+	}
+
+	fragment_bitfield_t bit = 1 << fragId;
+	// If the fragment is still missing (and the counts agree)
+	if ((pending->frag_need & bit) && pending->chain.num_slices() == fragCount) {
+		// Keep the fragment in its slot
+		pending->frag_need &= ~bit;
+		pending->chain.set_slice(fragId, packet);
+		return pending->frag_need == 0;
+	}
+	return false;
+}
+
+void ChannelIn::decode_snapshot(seq_t seq)
+{
+	PendingPacket *pending = m_received.find(seq);
+	Packet delta = pending->chain.flatten(*fragPool);
+	pending->chain.clear();
+
+	// The baseline the sender used (0 for none)
+	NetReader reader = delta.read();
+	seq_t baseSeq;
+	if (!reader.read(baseSeq))
+		return;
+	Packet base;
+	if (baseSeq != 0) {
+		Packet *found = m_baselines.find(baseSeq);
+		if (found == nullptr)
+			return;
+		base = *found;
+	}
+
+	const char *data = delta.data() + sizeof(seq_t);
+	unsigned int dataSize = delta.size() - sizeof(seq_t);
+	unsigned int size;
+	if (!delta_decoded_size(data, dataSize, size) || size > MAX_MESSAGE_SIZE)
+		return;
+	Packet snapshot = fragPool->allocate_buffer(size);
+	if (!delta_decode(base.data(), base.size(), data, dataSize, snapshot.data()))
+		return;
+
+	m_baselines.insert(seq) = snapshot;
+	m_newest = std::max(m_newest, seq);
+}
+
+void ChannelIn::drop_until(seq_t seq)
+{
+	// Only the slots of the window can hold messages
+	seq_t count = std::min<seq_t>(seq - m_last_read, m_received.capacity());
+	for (seq_t i = 1; i <= count; i++) {
+		PendingPacket *pending = m_received.find(m_last_read + i);
+		if (pending != nullptr) {
+			pending->chain.clear();
+			m_received.remove(m_last_read + i);
 		}
 	}
+	m_last_read = seq;
 }
 
-Packet ChannelIn::receive()
+bool ChannelIn::grow(seq_t seq, unsigned int& windowBudget)
 {
-	if (m_received.empty())
-		return Packet();
-	Packet ret;
-	switch (m_type) {
-	case UNKNOWN:
-		break;
+	unsigned int capacity = m_received.capacity();
+	while (seq - m_last_read > capacity && capacity < MAX_CHANNEL_WINDOW)
+		capacity *= 2;
+	if (seq - m_last_read > capacity || capacity - m_received.capacity() > windowBudget)
+		return false;
+	windowBudget -= capacity - m_received.capacity();
+
+	SequenceBuffer<PendingPacket> received(capacity);
+	for (seq_t i = 1; i <= m_received.capacity(); i++) {
+		PendingPacket *pending = m_received.find(m_last_read + i);
+		if (pending != nullptr)
+			received.insert(m_last_read + i) = std::move(*pending);
+	}
+	m_received = std::move(received);
+	return true;
+}
+
+void ChannelIn::set_delivery(Type t)
+{
+	// Looked at once here instead of on every message
+	switch (t) {
 	case RAW:
-		// Receive all complete packets
-		for (auto& pkt : m_received) {
-			if (!pkt.frag_need && !pkt.packet.empty()) {
-				ret = pkt.packet;
-				pkt.packet = Packet();
-				break;
-			}
-		}
+		set_delivery<Raw>();
 		break;
 	case NEWEST:
-		{
-		// Receive the newest packet
-		typedef decltype(m_received) ct;
-		ct::reverse_iterator it;
-		for (it = m_received.rbegin(); it != m_received.rend(); ++it) {
-			if (!it->frag_need && !it->packet.empty() && it->seq > m_last_read) {
-				m_last_read = it->seq;
-				ret = it->packet;
-				break;
-			}
-		}
-		// Remove older packets
-		m_received.erase(m_received.begin(), it.base());
-		} break;
+		set_delivery<Newest>();
+		break;
 	case RELIABLE:
-		// Find the first non-empty packet
-		for (auto& pkt : m_received) {
-			if (!pkt.frag_need && !pkt.packet.empty()) {
-				ret = pkt.packet;
-				pkt.packet = Packet();
-				break;
-			}
-		}
-		// Remove the read packets from the front
-		while (m_received.front().packet.empty() && m_received.front().seq == m_last_read + 1) {
-			m_received.pop_front();
-			m_last_read++;
-		}
+		set_delivery<Reliable>();
 		break;
 	case SEQUENTIAL:
-		// Receive only if complete and it's the next packet in the queue
-		if (!m_received.front().frag_need && m_received.front().seq == m_last_read + 1) {
-			ret = m_received.front().packet;
-			m_received.pop_front();
-			m_last_read++;
-		}	
+		set_delivery<Sequential>();
+		break;
+	case DELTA:
+		set_delivery<Delta>();
+		break;
+	case STREAM:
+		set_delivery<Stream>();
 		break;
+	default:
+		set_delivery<Unused>();
+		break;
+	}
+}
+
+bool ChannelIn::receive_ready(PacketChain& out)
+{
+	// Receive the complete packets in the order they completed
+	while (!m_ready.empty()) {
+		PendingPacket *pending = m_received.find(m_ready.front());
+		m_ready.pop_front();
+		if (pending != nullptr) {
+			std::swap(out, pending->chain);
+			pending->chain.clear();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ChannelIn::remove_read()
+{
+	// Remove the read packets from the front
+	PendingPacket *pending;
+	while ((pending = m_received.find(m_last_read + 1)) != nullptr && !pending->frag_need && pending->chain.empty()) {
+		m_received.remove(m_last_read + 1);
+		m_last_read++;
+	}
+}
+
+bool ChannelIn::receive_newest(PacketChain& out)
+{
+	// Receive the newest packet and remove the older ones
+	if (m_newest <= m_last_read)
+		return false;
+	bool received = false;
+	PendingPacket *pending = m_received.find(m_newest);
+	if (pending != nullptr) {
+		std::swap(out, pending->chain);
+		received = true;
+	}
+	drop_until(m_newest);
+	return received;
+}
+
+bool ChannelIn::receive_snapshot(PacketChain& out)
+{
+	// Receive the newest snapshot, the rebuilt ones stay as baselines
+	if (m_newest <= m_last_read)
+		return false;
+	bool received = false;
+	Packet *snapshot = m_baselines.find(m_newest);
+	if (snapshot != nullptr) {
+		out = PacketChain(*snapshot);
+		received = true;
+	}
+	drop_until(m_newest);
+	return received;
+}
+
+bool ChannelIn::receive_next(PacketChain& out)
+{
+	// Receive only if complete and it's the next packet in the queue
+	PendingPacket *pending = m_received.find(m_last_read + 1);
+	if (pending == nullptr || pending->frag_need)
+		return false;
+	std::swap(out, pending->chain);
+	drop_until(m_last_read + 1);
+	return true;
+}
+
+Packet ChannelIn::receive()
+{
+	PacketChain chain;
+	if (!receive(chain))
+		return Packet();
+	return chain.flatten(*fragPool);
+}
+
+bool ChannelIn::receive_stream(Packet& piece, unsigned int& offset, unsigned int& size)
+{
+	// The chunks are never fragmented so receiving them doesn't copy
+	Packet chunk;
+	while (!(chunk = receive()).empty()) {
+		if (m_stream_offset == m_stream_size) {
+			// A payload starts with a chunk holding its size
+			NetReader reader = chunk.read();
+			uint32_t payloadSize;
+			if (chunk.size() != sizeof(uint32_t) || !reader.read(payloadSize))
+				continue;
+			m_stream_offset = 0;
+			m_stream_size = payloadSize;
+			if (payloadSize != 0)
+				continue;
+			piece = Packet();
+		} else {
+			piece = chunk.subpacket(0, std::min(chunk.size(), m_stream_size - m_stream_offset));
+		}
+		offset = m_stream_offset;
+		size = m_stream_size;
+		m_stream_offset += piece.size();
+		return true;
 	}
-	return ret;
+	return false;
+}
+
+bool ChannelIn::stream_update(seq_t& read)
+{
+	if (m_last_read == 0)
+		return false;
+	// Repeat the position now and then in case the last one was lost
+	if (m_last_read == m_advertised && ++m_update_ticks < STREAM_UPDATE_INTERVAL)
+		return false;
+	m_advertised = m_last_read;
+	m_update_ticks = 0;
+	read = m_last_read;
+	return true;
 }
 
 void ChannelOut::send(Packet packet)
 {
+	if (m_type == STREAM) {
+		// The size goes in a chunk of its own so the payload is sent from its buffer
+		Packet header = m_pool->allocate_buffer(sizeof(uint32_t));
+		NetWriter writer = header.write();
+		writer.write((uint32_t)packet.size());
+		m_stream.push_back(std::move(header));
+		if (packet.size() != 0)
+			m_stream.push_back(std::move(packet));
+		return;
+	}
+
 	m_seq++;
-	m_outgoing.push_back(OutgoingPacket(m_seq, std::move(packet)));
+	if (m_type != DELTA) {
+		m_outgoing.push_back(OutgoingPacket(m_seq, std::move(packet)));
+		return;
+	}
+
+	// Encode against the newest snapshot the client has (if still kept)
+	Snapshot *base = m_acked != 0 ? m_snapshots.find(m_acked) : nullptr;
+	seq_t baseSeq = base != nullptr ? m_acked : 0;
+	if (m_encode_buffer.size() < sizeof(seq_t) + delta_max_size(packet.size()))
+		m_encode_buffer.resize(sizeof(seq_t) + delta_max_size(packet.size()));
+
+	NetWriter writer(m_encode_buffer.data(), sizeof(seq_t));
+	writer.write(baseSeq);
+	unsigned int size = sizeof(seq_t) + delta_encode(
+		base != nullptr ? base->packet.data() : nullptr, base != nullptr ? base->packet.size() : 0,
+		packet.data(), packet.size(), m_encode_buffer.data() + sizeof(seq_t));
+
+	Packet delta = m_pool->allocate_buffer(size);
+	memcpy(delta.data(), m_encode_buffer.data(), size);
+	m_outgoing.push_back(OutgoingPacket(m_seq, std::move(delta)));
+
+	Snapshot& snapshot = m_snapshots.insert(m_seq);
+	snapshot.packet = std::move(packet);
+	snapshot.acked = 0;
+}
+
+void ChannelOut::resend_fragment(OutgoingPacket&& fragment, unsigned int maxSize)
+{
+	if (fragment.packet.size() <= maxSize || fragment.message.empty()) {
+		m_outgoing.push_front(std::move(fragment));
+		return;
+	}
+	RingBuffer<OutgoingPacket> fragments;
+	split_fragment(fragment, maxSize, fragments);
+	// In front of the queue, in their order
+	for (unsigned int i = fragments.size(); i > 0; i--)
+		m_outgoing.push_front(std::move(fragments[i - 1]));
+}
+
+void ChannelOut::split_queued(unsigned int maxSize)
+{
+	RingBuffer<OutgoingPacket> queued;
+	queued.swap(m_outgoing);
+	// The fragments of a message are queued together, cut each message once
+	seq_t split = 0;
+	bool any = false;
+	for (unsigned int i = 0; i < queued.size(); i++) {
+		OutgoingPacket& p = queued[i];
+		if (p.frag_count == 0 || p.packet.size() <= maxSize || p.message.empty()) {
+			m_outgoing.push_back(std::move(p));
+		} else if (!any || p.seq != split) {
+			split_fragment(p, maxSize, m_outgoing);
+			split = p.seq;
+			any = true;
+		}
+	}
+}
+
+void ChannelOut::split_fragment(const OutgoingPacket& fragment, unsigned int maxSize, RingBuffer<OutgoingPacket>& out)
+{
+	// More fragments than before so the receiver can tell the cuts apart, of even sizes
+	unsigned int size = fragment.message.size();
+	unsigned int parts = std::max<unsigned int>((size + maxSize - 1) / maxSize, fragment.frag_count + 1);
+	// Only a message close to `MAX_MESSAGE_SIZE` first cut for a size just above
+	// `MIN_PACKET_SIZE` can't take more fragments, it is lost
+	if (parts > FRAGMENTS_PER_BITFIELD)
+		return;
+	unsigned int start = 0;
+	for (unsigned int i = 0; i < parts; i++) {
+		unsigned int part = size / parts + (i < size % parts ? 1 : 0);
+		out.push_back(OutgoingPacket(fragment.seq, fragment.message.subpacket(start, part), (fragment_id_t)i, (fragment_id_t)parts, fragment.message));
+		start += part;
+	}
+}
+
+void ChannelOut::acked(seq_t seq, fragment_id_t part, fragment_id_t parts)
+{
+	if (m_type == STREAM) {
+		// Slide the window past the acknowledged chunks
+		m_unacked.remove(seq);
+		while (m_stream_base <= m_seq && !m_unacked.exists(m_stream_base))
+			m_stream_base++;
+		return;
+	}
+
+	Snapshot *snapshot = m_snapshots.find(seq);
+	if (snapshot == nullptr)
+		return;
+	snapshot->acked |= 1 << part;
+	// Usable as a baseline once every fragment got through
+	if (snapshot->acked == ~(fragment_bitfield_t)0 >> (FRAGMENTS_PER_BITFIELD - parts))
+		m_acked = std::max(m_acked, seq);
+}
+
+void ChannelOut::fill_stream(unsigned int window, unsigned int chunkSize)
+{
+	window = std::min(window, STREAM_MAX_WINDOW);
+	while (!m_stream.empty() && m_seq + 1 - m_stream_base < window && m_seq + 1 - m_stream_read <= STREAM_RECEIVE_WINDOW) {
+		// The chunks are slices of the payload, it stays alive until they are all acknowledged
+		Packet& payload = m_stream.front();
+		unsigned int size = std::min(chunkSize, payload.size() - m_stream_offset);
+		m_seq++;
+		m_outgoing.push_back(OutgoingPacket(m_seq, payload.subpacket(m_stream_offset, size)));
+		m_unacked.insert(m_seq) = 1;
+
+		m_stream_offset += size;
+		if (m_stream_offset == payload.size()) {
+			m_stream.pop_front();
+			m_stream_offset = 0;
+		}
+	}
+}
+
+void ChannelOut::stream_read(seq_t seq)
+{
+	m_stream_read = std::max(m_stream_read, seq);
+}
+
+unsigned long long ChannelOut::stream_queued() const
+{
+	unsigned long long queued = 0;
+	for (unsigned int i = 0; i < m_stream.size(); i++)
+		queued += m_stream[i].size();
+	return queued - m_stream_offset;
 }
\ No newline at end of file
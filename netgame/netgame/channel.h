@@ -1,11 +1,44 @@
 #ifndef _NETGAME_CHANNEL_H
 #define _NETGAME_CHANNEL_H
 
-#include <deque>
+#include <algorithm>
 #include <utility>
+#include <vector>
 
 #include "protocol.h"
 #include "packet.h"
+#include "sequence_buffer.h"
+#include "ring_buffer.h"
+#include "metrics.h"
+
+// Channel ids index a flat table in every connection, they must be below this
+// (keep them dense, the unused ids in between take an empty slot each)
+const unsigned int MAX_CHANNELS = 64;
+
+// Number of messages a channel can have in flight before it has to widen
+const unsigned int CHANNEL_WINDOW = 256;
+
+// Most a reliable channel's window is widened to
+const unsigned int MAX_CHANNEL_WINDOW = 4096;
+
+// Slots the receive windows of a connection may be widened by in total
+// A message past what's left is dropped, so a peer sending far ahead can't make
+// the connection allocate much more than its channels' initial windows
+const unsigned int RECEIVE_WINDOW_BUDGET = 8192;
+
+// Number of snapshots a DELTA channel keeps as baselines
+const unsigned int DELTA_HISTORY = 32;
+
+// Chunks a STREAM keeps in flight at least and at most, in between the window
+// follows the bandwidth-delay product
+const unsigned int STREAM_MIN_WINDOW = 16;
+const unsigned int STREAM_MAX_WINDOW = 4096;
+
+// Chunks a STREAM receiver buffers past what has been read (within `MAX_CHANNEL_WINDOW`)
+const unsigned int STREAM_RECEIVE_WINDOW = 4096;
+
+// Ticks between the repeats of a STREAM receiver's read position
+const unsigned int STREAM_UPDATE_INTERVAL = 16;
 
 class Channel
 {
@@ -22,6 +55,15 @@ public:
 		RELIABLE = 3,
 		// Make sure the client receives every packet in the order they are sent
 		SEQUENTIAL = 4,
+		// Receive only the newest packet, sent as a delta against the newest one
+		// the client has acknowledged (for snapshots of a state)
+		// Both ends keep the snapshots as baselines so they must not be modified
+		DELTA = 5,
+		// Payloads of any size, cut into chunks that are acknowledged one by one and
+		// read in order as they arrive (for downloads), see `ChannelIn::receive_stream()`
+		// The chunks in flight are limited by a window, give it a lower priority than
+		// the realtime channels so they keep their share
+		STREAM = 6,
 	};
 
 	Channel()
@@ -31,76 +73,367 @@ public:
 		: m_type(t)
 	{ }
 
+	Type type() const { return m_type; }
+
 	bool is_reliable() const {
-		return m_type == RELIABLE || m_type == SEQUENTIAL;
+		return m_type == RELIABLE || m_type == SEQUENTIAL || m_type == STREAM;
 	}
 
+	// Whether the sender needs to know which messages got through
+	bool wants_acks() const {
+		return m_type == DELTA || m_type == STREAM;
+	}
+
+	// Counters of the messages sent (out) or received (in), kept by the connection
+	const ChannelMetrics& metrics() const { return m_metrics; }
+
 protected:
+	friend class Connection;
+
 	Type m_type;
+	ChannelMetrics m_metrics;
 };
 class ChannelIn : public Channel
 {
 public:
+	// An unused slot (no window, nothing allocated)
 	ChannelIn(PacketPool& pool)
 		: Channel()
-		, fragPool(pool)
-	{ }
+		, m_last_read(0)
+		, m_newest(0)
+		, m_received(0)
+		, m_baselines(0)
+		, m_stream_offset(0)
+		, m_stream_size(0)
+		, m_advertised(0)
+		, m_update_ticks(0)
+		, fragPool(&pool)
+	{
+		set_delivery<Unused>();
+	}
+	// Delivers with the policy of the type (`ChannelIn::Raw`...)
 	explicit ChannelIn(PacketPool& pool, Type t)
 		: Channel(t)
-		, fragPool(pool)
-	{ }
+		, m_last_read(0)
+		, m_newest(0)
+		, m_received(t != UNKNOWN ? CHANNEL_WINDOW : 0)
+		, m_baselines(t == DELTA ? DELTA_HISTORY : 0)
+		, m_stream_offset(0)
+		, m_stream_size(0)
+		, m_advertised(0)
+		, m_update_ticks(0)
+		, fragPool(&pool)
+	{
+		set_delivery(t);
+	}
+	ChannelIn(ChannelIn&& c);
+	ChannelIn& operator=(ChannelIn c);
+
+	// Change the pool the fragmented messages are copied to by `receive()` (when the owner moves)
+	void set_pool(PacketPool& pool) { fragPool = &pool; }
 
 	struct PendingPacket
 	{
-		PendingPacket(fragment_bitfield_t frags, seq_t seq, Packet&& p);
+		PendingPacket();
 		PendingPacket(PendingPacket&& p);
 		PendingPacket& operator=(PendingPacket p);
 
 		fragment_bitfield_t frag_need;
 		seq_t seq;
-		Packet packet;
+		// The message, or its fragments as they arrived (a slice per fragment)
+		PacketChain chain;
 	};
 
 	// Add a packet to the received queue with the sequnece number `seq`
-	// Optional fragment data
-	// Returns the address of the packet if created (nullptr otherwise)
-	PendingPacket* add_packet(seq_t seq, Packet packet, fragment_bitfield_t frags=0);
+	// A reliable window widened to reach it takes the new slots from `windowBudget`
+	// (shared by the channels of a connection), the packet is dropped if it runs out
+	void add_packet(seq_t seq, const Packet& packet, unsigned int& windowBudget) { add_packet<Bound>(seq, packet, windowBudget); }
+
+	// Add a part of a fragmented message
+	// The fragments are kept as they are (no copies) until the message is received
+	void add_fragment(seq_t seq, const Packet& packet, fragment_id_t fragId, fragment_id_t fragCount, unsigned int& windowBudget)
+	{
+		add_fragment<Bound>(seq, packet, fragId, fragCount, windowBudget);
+	}
 
-	void add_fragment(seq_t seq, const Packet& packet, fragment_id_t fragId, fragment_id_t fragCount, unsigned int startIndex, message_size_t msgSize);
+	// If there is a message to receive pop it to `out` as the slices it arrived in
+	// Returns false if there is nothing to receive
+	bool receive(PacketChain& out) { return Bound::receive(*this, out); }
+
+	// The same with the delivery policy known at compile time (`ChannelIn::Raw`... the
+	// one the channel was opened with), its functions are called directly
+	template <typename Delivery>
+	void add_packet(seq_t seq, const Packet& packet, unsigned int& windowBudget)
+	{
+		if (store_packet(seq, packet, windowBudget))
+			Delivery::completed(*this, seq);
+	}
+	template <typename Delivery>
+	void add_fragment(seq_t seq, const Packet& packet, fragment_id_t fragId, fragment_id_t fragCount, unsigned int& windowBudget)
+	{
+		if (store_fragment(seq, packet, fragId, fragCount, windowBudget))
+			Delivery::completed(*this, seq);
+	}
+	template <typename Delivery>
+	bool receive(PacketChain& out) { return Delivery::receive(*this, out); }
 
 	// If there is a packet to receive pop and return it
 	// Else return an empty packet
+	// Fragmented messages are copied to one buffer, use the other overload to avoid that
 	Packet receive();
+
+	// Number of messages received and not read yet (or not complete)
+	unsigned int buffered() const { return m_received.size(); }
+
+	// STREAM: pop the next piece of the incoming payloads, in order and as soon as it arrived
+	// The piece goes at `offset` in a payload of `size` bytes (it is the last one when
+	// `offset + piece.size() == size`)
+	bool receive_stream(Packet& piece, unsigned int& offset, unsigned int& size);
+
+	// STREAM: whether to tell the sender how far the stream has been read (when it moved
+	// on and every `STREAM_UPDATE_INTERVAL` ticks), call once per tick
+	bool stream_update(seq_t& read);
+	// The delivery policies, what to do with a complete message and how to receive
+	// `TYPE` is the channel type they implement
+	struct Unused
+	{
+		static const Type TYPE = UNKNOWN;
+		static void completed(ChannelIn& /*chan*/, seq_t /*seq*/) { }
+		static bool receive(ChannelIn& /*chan*/, PacketChain& /*out*/) { return false; }
+	};
+	struct Raw
+	{
+		static const Type TYPE = RAW;
+		static void completed(ChannelIn& chan, seq_t seq) { chan.m_ready.push_back(seq); }
+		static bool receive(ChannelIn& chan, PacketChain& out) { return chan.receive_ready(out); }
+	};
+	struct Newest
+	{
+		static const Type TYPE = NEWEST;
+		static void completed(ChannelIn& chan, seq_t seq) { chan.m_newest = std::max(chan.m_newest, seq); }
+		static bool receive(ChannelIn& chan, PacketChain& out) { return chan.receive_newest(out); }
+	};
+	struct Reliable
+	{
+		static const Type TYPE = RELIABLE;
+		static void completed(ChannelIn& chan, seq_t seq) { chan.m_ready.push_back(seq); }
+		static bool receive(ChannelIn& chan, PacketChain& out)
+		{
+			bool received = chan.receive_ready(out);
+			chan.remove_read();
+			return received;
+		}
+	};
+	struct Sequential
+	{
+		static const Type TYPE = SEQUENTIAL;
+		static void completed(ChannelIn& /*chan*/, seq_t /*seq*/) { }
+		static bool receive(ChannelIn& chan, PacketChain& out) { return chan.receive_next(out); }
+	};
+	struct Delta
+	{
+		static const Type TYPE = DELTA;
+		static void completed(ChannelIn& chan, seq_t seq) { chan.decode_snapshot(seq); }
+		static bool receive(ChannelIn& chan, PacketChain& out) { return chan.receive_snapshot(out); }
+	};
+	struct Stream
+	{
+		static const Type TYPE = STREAM;
+		static void completed(ChannelIn& /*chan*/, seq_t /*seq*/) { }
+		static bool receive(ChannelIn& chan, PacketChain& out) { return chan.receive_next(out); }
+	};
+	// The policy the channel was opened with, called through the pointers it left in
+	// the channel (for code that doesn't know the layout)
+	struct Bound
+	{
+		static void completed(ChannelIn& chan, seq_t seq) { chan.m_completed(chan, seq); }
+		static bool receive(ChannelIn& chan, PacketChain& out) { return chan.m_receive(chan, out); }
+	};
+
 private:
+	friend class Connection;
+	ChannelIn(const ChannelIn&);
+
+	// Deliver with `Delivery` from now on
+	template <typename Delivery>
+	void set_delivery()
+	{
+		m_completed = &Delivery::completed;
+		m_receive = &Delivery::receive;
+	}
+	// Deliver with the policy of `t`
+	void set_delivery(Type t);
+
+	// Store a packet or a fragment, returns whether it completed its message
+	bool store_packet(seq_t seq, const Packet& packet, unsigned int& windowBudget);
+	bool store_fragment(seq_t seq, const Packet& packet, fragment_id_t fragId, fragment_id_t fragCount, unsigned int& windowBudget);
+	// Claim the slot of a new message, nullptr if it's a duplicate or out of the window
+	PendingPacket* insert(seq_t seq, unsigned int& windowBudget);
+	// Forget every message up to `seq`
+	void drop_until(seq_t seq);
+	// Widen the window to reach `seq` (reliable channels can't drop messages)
+	// Fails if it would take more than `windowBudget` new slots or `MAX_CHANNEL_WINDOW`
+	bool grow(seq_t seq, unsigned int& windowBudget);
+	// Rebuild the snapshot of a complete DELTA message
+	void decode_snapshot(seq_t seq);
+
+	// Pop the oldest complete message (RAW and RELIABLE)
+	bool receive_ready(PacketChain& out);
+	// Slide the window past the messages read in a row (RELIABLE)
+	void remove_read();
+	// Pop the newest message and drop the older ones (NEWEST)
+	bool receive_newest(PacketChain& out);
+	// Pop the newest rebuilt snapshot (DELTA)
+	bool receive_snapshot(PacketChain& out);
+	// Pop the next message in order if it's complete (SEQUENTIAL and STREAM)
+	bool receive_next(PacketChain& out);
+
+	// Every message up to this one has been read or dropped
 	seq_t m_last_read;
-	std::deque<PendingPacket> m_received;
-	PacketPool& fragPool;
+	// Newest complete message (NEWEST)
+	seq_t m_newest;
+	// Messages after `m_last_read` (a delivered message is kept with an empty packet)
+	SequenceBuffer<PendingPacket> m_received;
+	// Complete messages in the order they completed (RAW and RELIABLE)
+	RingBuffer<seq_t> m_ready;
+	// Rebuilt snapshots (DELTA)
+	SequenceBuffer<Packet> m_baselines;
+	// Bytes read of the current payload and its size (STREAM)
+	unsigned int m_stream_offset;
+	unsigned int m_stream_size;
+	// Read position last sent to the sender (STREAM)
+	seq_t m_advertised;
+	unsigned int m_update_ticks;
+	PacketPool *fragPool;
+	// The delivery policy, set when the channel is opened so receiving doesn't look at the type
+	void (*m_completed)(ChannelIn& chan, seq_t seq);
+	bool (*m_receive)(ChannelIn& chan, PacketChain& out);
 };
 class ChannelOut : public Channel
 {
 public:
-	ChannelOut()
+	ChannelOut(PacketPool& pool)
 		: Channel()
+		, m_seq(0)
+		, m_acked(0)
+		, m_snapshots(0)
+		, m_stream_offset(0)
+		, m_stream_base(1)
+		, m_stream_read(0)
+		, m_unacked(0)
+		, m_pool(&pool)
+		, m_priority(1.0f)
+		, m_accumulator(0.0f)
 	{ }
-	explicit ChannelOut(Type t)
+	explicit ChannelOut(PacketPool& pool, Type t)
 		: Channel(t)
+		, m_seq(0)
+		, m_acked(0)
+		, m_snapshots(t == DELTA ? DELTA_HISTORY : 0)
+		, m_stream_offset(0)
+		, m_stream_base(1)
+		, m_stream_read(0)
+		, m_unacked(t == STREAM ? STREAM_MAX_WINDOW : 0)
+		, m_pool(&pool)
+		, m_priority(1.0f)
+		, m_accumulator(0.0f)
 	{ }
+	ChannelOut(ChannelOut&& c);
+	ChannelOut& operator=(ChannelOut c);
+
+	// Change the pool the deltas are encoded to (when the owner moves)
+	void set_pool(PacketPool& pool) { m_pool = &pool; }
+
+	// Share of the bandwidth the channel gets when the connection can't send everything
+	// A channel with twice the priority is picked twice as often
+	void set_priority(float priority) { m_priority = priority; }
+	float priority() const { return m_priority; }
+
+	// Whether messages are waiting to be sent
+	bool pending() const { return !m_outgoing.empty(); }
+	unsigned int queued() const { return (unsigned int)m_outgoing.size(); }
 
 	struct OutgoingPacket
 	{
+		OutgoingPacket();
 		OutgoingPacket(seq_t seq, Packet&& p);
+		// A single fragment to resend, `p` is its data and `message` the whole message
+		OutgoingPacket(seq_t seq, Packet&& p, fragment_id_t fragIndex, fragment_id_t fragCount, const Packet& message);
 		OutgoingPacket(OutgoingPacket&& p);
 		OutgoingPacket& operator=(OutgoingPacket p);
 
 		seq_t seq;
 		Packet packet;
+
+		// Fragment to resend (`frag_count == 0` for a whole message)
+		fragment_id_t frag_index;
+		fragment_id_t frag_count;
+		// The message the fragment was cut from, to cut it again if the packet size goes down
+		Packet message;
 	};
 
+	// Queue a message (STREAM: a payload of any size, it is cut into chunks by `fill_stream()`)
 	void send(Packet packet);
+
+	// A part of the message `seq` has been acknowledged (if `wants_acks()`)
+	void acked(seq_t seq, fragment_id_t part, fragment_id_t parts);
+
+	// STREAM: cut the queued payloads into chunks of at most `chunkSize` bytes while
+	// fewer than `window` chunks are unacknowledged and the receiver has room for them
+	void fill_stream(unsigned int window, unsigned int chunkSize);
+
+	// STREAM: the receiver has read every chunk up to `seq`
+	void stream_read(seq_t seq);
+
+	// STREAM: bytes queued and not sent yet (without the chunks in flight)
+	unsigned long long stream_queued() const;
 private:
 	friend class Connection;
-	std::vector<OutgoingPacket> m_outgoing;
+	ChannelOut(const ChannelOut&);
+
+	// Queue the fragment of a lost message to be resent first
+	// If it's larger than `maxSize` the whole message is cut again into more fragments
+	// than before (the receiver starts over when the count grows)
+	void resend_fragment(OutgoingPacket&& fragment, unsigned int maxSize);
+	// Cut again the fragments waiting to be resent that are larger than `maxSize`
+	void split_queued(unsigned int maxSize);
+	// Append the fragments of `fragment`'s message cut again for `maxSize` to `out`
+	static void split_fragment(const OutgoingPacket& fragment, unsigned int maxSize, RingBuffer<OutgoingPacket>& out);
+
+	// A sent snapshot and the fragments of it the client has acknowledged (DELTA)
+	struct Snapshot
+	{
+		Snapshot()
+			: acked(0)
+		{ }
+
+		Packet packet;
+		fragment_bitfield_t acked;
+	};
+
+	// Sent in order (resent messages go in front), what didn't fit the budget stays for the next tick
+	RingBuffer<OutgoingPacket> m_outgoing;
 	seq_t m_seq;
+
+	// Newest snapshot the client has whole (DELTA)
+	seq_t m_acked;
+	SequenceBuffer<Snapshot> m_snapshots;
+	std::vector<char> m_encode_buffer;
+
+	// Payloads not cut into chunks yet, each behind a chunk with its size (STREAM)
+	RingBuffer<Packet> m_stream;
+	// Bytes of the front payload already in chunks
+	unsigned int m_stream_offset;
+	// Oldest unacknowledged chunk and the receiver's read position
+	seq_t m_stream_base;
+	seq_t m_stream_read;
+	// The chunks in flight that haven't been acknowledged
+	SequenceBuffer<char> m_unacked;
+	PacketPool *m_pool;
+
+	float m_priority;
+	// Priority gained while waiting to be sent, the highest channel is sent from first
+	float m_accumulator;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1240 @@
+#include "checks.h"
+
+#include <netlib/address.h>
+#include <netlib/socket.h>
+
+#include "protocol.h"
+#include "packet.h"
+#include "transport.h"
+#include "connection.h"
+#include "connection_store.h"
+#include "timer_wheel.h"
+#include "sequence_buffer.h"
+#include "ring_buffer.h"
+#include "bitstream.h"
+#include "compress.h"
+#include "delta.h"
+#include "handshake.h"
+#include "mtu.h"
+#include "link_emulator.h"
+#include "spsc_queue.h"
+#include "event_loop.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+static std::ostream *check_out = nullptr;
+static unsigned int check_count = 0;
+static unsigned int check_failures = 0;
+
+// Count a check and print it if it failed, returns `ok` so a loop can stop at its first failure
+static bool check(bool ok, const char *group, const std::string& what)
+{
+	check_count++;
+	if (!ok) {
+		*check_out << "FAILED " << group << ": " << what << std::endl;
+		check_failures++;
+	}
+	return ok;
+}
+
+// Addresses 10.x.y.z:port made from an index
+static Address check_address(unsigned int index)
+{
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short)(1024 + index % 50000));
+	addr.sin_addr.s_addr = htonl((10u << 24) | index / 50000);
+	return Address(reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+}
+
+// Keeps what was sent to hand it to a connection
+class CaptureTransport : public Transport
+{
+public:
+	virtual unsigned int receive(PacketPool& /*pool*/, Datagram * /*out*/, unsigned int /*count*/) { return 0; }
+	virtual void send(const Address& /*addr*/, const Packet& packet)
+	{
+		m_stats.send_datagrams++;
+		sent.push_back(packet);
+	}
+
+	// Process the kept datagrams with `conn`
+	void deliver(Connection& conn, net_time now)
+	{
+		for (auto& packet : sent)
+			conn.process_packet(packet, now);
+		sent.clear();
+	}
+
+	std::vector<Packet> sent;
+};
+
+#ifdef __linux__
+// Datagrams sent at a socket nobody reads, enough to go well over the queue limit
+const unsigned int SEND_QUEUE_CHECK_DATAGRAMS = 3 * SEND_QUEUE_LIMIT;
+
+// A batched transport whose socket stays full keeps only the newest datagrams
+static void check_send_queue()
+{
+	const char *group = "transport";
+	sockaddr_un name;
+	memset(&name, 0, sizeof(name));
+	name.sun_family = AF_UNIX;
+	std::ostringstream path;
+	path << "netgame-checks-" << getpid();
+	memcpy(name.sun_path + 1, path.str().data(), path.str().size());
+	socklen_t size = (socklen_t)(offsetof(sockaddr_un, sun_path) + 1 + path.str().size());
+	int rx = socket(AF_UNIX, SOCK_DGRAM, 0);
+	int tx = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (!check(rx >= 0 && tx >= 0 && bind(rx, reinterpret_cast<sockaddr*>(&name), size) == 0 && fcntl(tx, F_SETFL, O_NONBLOCK) == 0, group, "a local socket pair is set up")) {
+		close(rx);
+		close(tx);
+		return;
+	}
+
+	BatchTransport transport(tx, IO_BATCH_SIZE);
+	PacketPool pool(MAX_PACKET_SIZE);
+	Address to(reinterpret_cast<const sockaddr*>(&name), size);
+	bool bounded = true;
+	for (uint32_t i = 0; i < SEND_QUEUE_CHECK_DATAGRAMS; i++) {
+		memcpy(pool.nextData(), &i, sizeof(i));
+		transport.send(to, pool.allocate(sizeof(i)));
+		transport.flush();
+		bounded = bounded && transport.queued() <= SEND_QUEUE_LIMIT;
+		pool.trim();
+	}
+	const TransportStats& stats = transport.stats();
+	check(bounded && transport.queued() == SEND_QUEUE_LIMIT && stats.send_dropped > 0
+		&& stats.send_datagrams + stats.send_dropped + transport.queued() == SEND_QUEUE_CHECK_DATAGRAMS, group, "the queue of a full socket stops growing and counts the drops");
+
+	// Drain the socket, what was kept goes out in order and ends with the newest
+	uint32_t last = 0;
+	unsigned int received = 0;
+	bool ordered = true;
+	for (unsigned int spins = 0; spins < 1000000 && received < stats.send_datagrams + transport.queued(); spins++) {
+		uint32_t value;
+		if (recv(rx, &value, sizeof(value), MSG_DONTWAIT) == sizeof(value)) {
+			ordered = ordered && (received == 0 || value > last);
+			last = value;
+			received++;
+		} else {
+			transport.flush();
+		}
+	}
+	check(ordered && transport.queued() == 0 && last == SEND_QUEUE_CHECK_DATAGRAMS - 1, group, "the oldest datagrams are the ones dropped");
+	close(rx);
+	close(tx);
+}
+#endif
+
+// Reliable windows widen to reach messages far ahead only within the budget of the connection
+static void check_receive_window()
+{
+	const char *group = "window";
+	PacketPool pool(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+	ChannelIn a(pool, Channel::RELIABLE), b(pool, Channel::RELIABLE), c(pool, Channel::RELIABLE);
+	Packet message = pool.allocate_buffer(8);
+	unsigned int budget = RECEIVE_WINDOW_BUDGET;
+
+	a.add_packet(MAX_CHANNEL_WINDOW + 1, message, budget);
+	check(a.buffered() == 0 && a.metrics().messages_dropped == 1 && budget == RECEIVE_WINDOW_BUDGET, group, "a message past the largest window is dropped");
+
+	a.add_packet(MAX_CHANNEL_WINDOW, message, budget);
+	b.add_packet(MAX_CHANNEL_WINDOW, message, budget);
+	unsigned int left = RECEIVE_WINDOW_BUDGET - 2 * (MAX_CHANNEL_WINDOW - CHANNEL_WINDOW);
+	check(a.buffered() == 1 && b.buffered() == 1 && budget == left, group, "widening takes the new slots from the budget");
+
+	seq_t far = CHANNEL_WINDOW;
+	while (far - CHANNEL_WINDOW <= left)
+		far *= 2;
+	c.add_packet(far, message, budget);
+	check(c.buffered() == 0 && c.metrics().messages_dropped == 1 && budget == left, group, "a message the budget can't reach is dropped");
+	c.add_packet(CHANNEL_WINDOW, message, budget);
+	check(c.buffered() == 1 && budget == left, group, "the initial window needs no budget");
+
+	PacketChain out;
+	check(a.receive(out) && out.size() == message.size() && !a.receive(out), group, "the message of a widened window is received");
+}
+
+static void check_sequence_buffer()
+{
+	const char *group = "sequence_buffer";
+	SequenceBuffer<int> none(0);
+	none.remove(0);
+	check(none.capacity() == 0 && none.size() == 0 && !none.exists(0) && !none.exists(1), group, "capacity 0 holds nothing");
+	check(SequenceBuffer<int>(1).capacity() == 2 && SequenceBuffer<int>(5).capacity() == 8
+		&& SequenceBuffer<int>(8).capacity() == 8, group, "capacity is rounded up to a power of two");
+
+	const unsigned int capacity = 8;
+	SequenceBuffer<int> buffer(capacity);
+	bool empty = true;
+	for (seq_t seq = 0; seq < 4 * capacity; seq++)
+		empty = empty && !buffer.exists(seq) && !buffer.exists(UINT32_MAX - seq);
+	check(empty && buffer.size() == 0, group, "an empty slot matches no sequence");
+
+	// Across the wraparound only the newest `capacity` sequences are kept
+	seq_t first = UINT32_MAX - 20, last = 20;
+	bool kept = true;
+	for (seq_t seq = first; seq != last + 1 && kept; seq++) {
+		buffer.insert(seq) = (int)seq;
+		for (seq_t back = 0; back < 2 * capacity; back++) {
+			const int *entry = buffer.find(seq - back);
+			if (back < capacity && back <= seq - first)
+				kept = kept && entry != nullptr && *entry == (int)(seq - back);
+			else
+				kept = kept && entry == nullptr;
+		}
+	}
+	check(kept && buffer.size() == capacity, group, "newer sequences replace older ones across the wraparound");
+
+	buffer.remove(last - capacity);
+	check(buffer.size() == capacity, group, "removing a replaced sequence changes nothing");
+	buffer.remove(last);
+	check(buffer.size() == capacity - 1 && !buffer.exists(last) && buffer.exists(last - 1), group, "removing frees only its slot");
+	buffer.insert(last + capacity) = 1;
+	check(buffer.size() == capacity && buffer.exists(last + capacity) && !buffer.exists(last), group, "a freed slot is claimed again");
+
+	SequenceBuffer<int> moved(std::move(buffer));
+	check(moved.size() == capacity && moved.find(last - 1) != nullptr && *moved.find(last - 1) == (int)(last - 1), group, "moving keeps the entries");
+	moved.clear();
+	check(moved.size() == 0 && !moved.exists(last - 1) && !moved.exists(last + capacity), group, "clear empties every slot");
+}
+
+// Random pushes and pops of the ring buffer check
+const unsigned int RING_CHECK_OPERATIONS = 20000;
+
+static void check_ring_buffer()
+{
+	const char *group = "ring_buffer";
+	RingBuffer<unsigned int> ring;
+	check(ring.empty() && ring.capacity() == 0, group, "an unused ring allocates nothing");
+
+	// Pushes at both ends outnumber the pops at first so the ring wraps and grows
+	std::deque<unsigned int> reference;
+	std::mt19937 rng(99);
+	bool same = true;
+	for (unsigned int i = 0; i < RING_CHECK_OPERATIONS && same; i++) {
+		unsigned int op = rng() % 8;
+		if (op < 2) {
+			ring.push_front(i);
+			reference.push_front(i);
+		} else if (op < 4 + (i < RING_CHECK_OPERATIONS / 2 ? 1 : 0)) {
+			ring.push_back(i);
+			reference.push_back(i);
+		} else if (!reference.empty()) {
+			same = ring.front() == reference.front();
+			ring.pop_front();
+			reference.pop_front();
+		}
+		same = same && ring.size() == reference.size();
+		for (unsigned int j = 0; j < reference.size() && same && i % 64 == 0; j++)
+			same = ring[j] == reference[j];
+	}
+	check(same && ring.capacity() >= ring.size() && (ring.capacity() & (ring.capacity() - 1)) == 0, group, "entries come out in order across wraps and growth");
+
+	unsigned int capacity = ring.capacity();
+	ring.clear();
+	for (unsigned int i = 0; i < capacity; i++)
+		ring.push_back(i);
+	check(ring.capacity() == capacity && ring.front() == 0 && ring[capacity - 1] == capacity - 1, group, "a drained ring is filled again without growing");
+
+	RingBuffer<unsigned int> moved(std::move(ring));
+	check(moved.size() == capacity && ring.empty() && ring.capacity() == 0, group, "moving takes the ring");
+}
+
+// Arrivals per type of the delivery check
+const unsigned int DELIVERY_CHECK_MESSAGES = 2000;
+
+// The messages `Delivery` receives from `Delivery::TYPE` channels fed `arrivals`, through
+// the pointers bound to the channel and statically, as the sequences they carry
+template <typename Delivery>
+static bool same_delivery(const std::vector<seq_t>& arrivals, PacketPool& pool)
+{
+	ChannelIn bound(pool, Delivery::TYPE), direct(pool, Delivery::TYPE);
+	unsigned int boundBudget = RECEIVE_WINDOW_BUDGET, directBudget = RECEIVE_WINDOW_BUDGET;
+	std::vector<seq_t> viaBound, viaDirect;
+	PacketChain out;
+	for (auto seq : arrivals) {
+		Packet message = pool.allocate_buffer(sizeof(seq));
+		memcpy(message.data(), &seq, sizeof(seq));
+		bound.add_packet(seq, message, boundBudget);
+		direct.add_packet<Delivery>(seq, message, directBudget);
+		while (bound.receive(out))
+			viaBound.push_back(*reinterpret_cast<const seq_t*>(out.slice(0).data()));
+		while (direct.receive<Delivery>(out))
+			viaDirect.push_back(*reinterpret_cast<const seq_t*>(out.slice(0).data()));
+	}
+	return !viaBound.empty() && viaBound == viaDirect;
+}
+
+// A delivery policy that counts the messages it completes
+struct CountingDelivery : ChannelIn::Reliable
+{
+	static unsigned int& count()
+	{
+		static unsigned int n = 0;
+		return n;
+	}
+	static void completed(ChannelIn& chan, seq_t seq)
+	{
+		count()++;
+		ChannelIn::Reliable::completed(chan, seq);
+	}
+};
+
+// The policy bound when a channel is opened is the one that delivers
+static void check_delivery()
+{
+	const char *group = "delivery";
+	PacketPool pool(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+	PacketChain out;
+	ChannelIn unused(pool);
+	check(!unused.receive(out) && unused.buffered() == 0, group, "an unused slot receives nothing");
+
+	// Every message, some repeated and each swapped with one up to 16 places later
+	std::mt19937 rng(7);
+	std::vector<seq_t> arrivals;
+	for (seq_t seq = 1; seq <= DELIVERY_CHECK_MESSAGES; seq++) {
+		arrivals.push_back(seq);
+		if (rng() % 10 == 0)
+			arrivals.push_back(seq);
+	}
+	for (size_t i = 0; i + 16 < arrivals.size(); i++)
+		std::swap(arrivals[i], arrivals[i + rng() % 16]);
+	check(same_delivery<ChannelIn::Raw>(arrivals, pool) && same_delivery<ChannelIn::Newest>(arrivals, pool)
+		&& same_delivery<ChannelIn::Reliable>(arrivals, pool) && same_delivery<ChannelIn::Sequential>(arrivals, pool),
+		group, "bound and static delivery receive the same messages");
+
+	// A channel opened with a `ChannelDef` delivers with its policy
+	typedef ChannelDef<3, CountingDelivery> CountedChannel;
+	net_time now;
+	Connection a(Address::inet_any(), 3, now), b(Address::inet_any(), 3, now);
+	a.add_channel<CountedChannel>();
+	b.add_channel<CountedChannel>();
+	CaptureTransport toA, toB;
+	const unsigned int sent = 5;
+	for (unsigned int i = 0; i < sent; i++)
+		a.send(CountedChannel::ID, pool.allocate_buffer(16));
+	unsigned int received = 0;
+	for (unsigned int tick = 0; tick < 20; tick++) {
+		a.send_outgoing(toB, now);
+		toB.deliver(b, now);
+		b.send_outgoing(toA, now);
+		toA.deliver(a, now);
+		while (b.receive<CountedChannel>(out))
+			received++;
+		now += a.send_interval();
+	}
+	check(received == sent && CountingDelivery::count() == sent, group, "a channel opened with a ChannelDef completes messages with its policy");
+}
+
+// Snapshots encoded per delta check
+const unsigned int DELTA_CHECK_ROUNDS = 1000;
+
+static void check_delta()
+{
+	const char *group = "delta";
+	std::mt19937 rng(1337);
+	static const double changeRates[] = { 0.0, 0.01, 0.1, 1.0 };
+	std::uniform_real_distribution<double> pick(0.0, 1.0);
+
+	bool same = true, truncated = true;
+	for (unsigned int round = 0; round < DELTA_CHECK_ROUNDS && same; round++) {
+		std::vector<char> base(rng() % 300);
+		for (auto& c : base)
+			c = (char)rng();
+		// Shorter, longer or as long as the baseline, some bytes changed
+		std::vector<char> data(rng() % 300);
+		double rate = changeRates[rng() % 4];
+		for (unsigned int i = 0; i < data.size(); i++)
+			data[i] = i < base.size() && pick(rng) >= rate ? base[i] : (char)rng();
+		// Ending with a change, the last run can't be cut off cleanly
+		bool endsChanged = !data.empty() && rng() % 2 == 0;
+		if (endsChanged && data.size() <= base.size())
+			data.back() = (char)(base[data.size() - 1] + 1);
+
+		unsigned int size = (unsigned int)data.size();
+		std::vector<char> delta(delta_max_size(size));
+		unsigned int deltaSize = delta_encode(base.data(), (unsigned int)base.size(), data.data(), size, &delta[0]);
+		unsigned int decodedSize = 0;
+		std::vector<char> out(size + 1);
+		same = deltaSize <= delta_max_size(size)
+			&& delta_decoded_size(&delta[0], deltaSize, decodedSize) && decodedSize == size
+			&& delta_decode(base.data(), (unsigned int)base.size(), &delta[0], deltaSize, &out[0])
+			&& std::equal(data.begin(), data.end(), out.begin());
+		if (endsChanged)
+			truncated = truncated && !delta_decode(base.data(), (unsigned int)base.size(), &delta[0], deltaSize - 1, &out[0]);
+	}
+	check(same, group, "snapshots round trip against baselines of every size");
+	check(truncated, group, "a delta cut in its last run is rejected");
+
+	std::vector<char> snapshot(200, 'x');
+	std::vector<char> delta(delta_max_size((unsigned int)snapshot.size()));
+	check(delta_encode(snapshot.data(), (unsigned int)snapshot.size(), snapshot.data(), (unsigned int)snapshot.size(), &delta[0]) <= 2, group, "an unchanged snapshot encodes as its size");
+	unsigned int deltaSize = delta_encode(nullptr, 0, snapshot.data(), (unsigned int)snapshot.size(), &delta[0]);
+	std::vector<char> out(snapshot.size());
+	check(delta_decode(nullptr, 0, &delta[0], deltaSize, &out[0]) && out == snapshot, group, "a snapshot without a baseline round trips");
+	unsigned int size;
+	check(!delta_decoded_size(&delta[0], 0, size), group, "an empty delta is rejected");
+}
+
+// Streams of random values written and read back per bitstream round
+const unsigned int BITSTREAM_ROUNDS = 200;
+const unsigned int BITSTREAM_VALUES = 100;
+
+enum BitValueKind
+{
+	BIT_VALUE_BITS,
+	BIT_VALUE_BOUNDED,
+	BIT_VALUE_VARINT,
+	BIT_VALUE_SIGNED,
+	BIT_VALUE_FLOAT,
+	BIT_VALUE_BYTES,
+	BIT_VALUE_KINDS,
+};
+
+// Range and resolution of the quantized floats
+const float BITSTREAM_FLOAT_MIN = -100.0f;
+const float BITSTREAM_FLOAT_MAX = 100.0f;
+const float BITSTREAM_FLOAT_RESOLUTION = 0.01f;
+
+// A value of a bitstream round and how it's written
+struct BitValue
+{
+	unsigned int kind;
+	uint32_t value;
+	// Width of the bits, size of the bytes
+	unsigned int size;
+	uint32_t min, max;
+	float real;
+	char bytes[16];
+};
+
+static BitValue random_bit_value(std::mt19937& rng)
+{
+	BitValue v;
+	v.kind = rng() % BIT_VALUE_KINDS;
+	switch (v.kind) {
+	case BIT_VALUE_BITS:
+		v.size = rng() % 33;
+		v.value = rng();
+		if (v.size < 32)
+			v.value &= (1u << v.size) - 1;
+		break;
+	case BIT_VALUE_BOUNDED:
+		v.min = rng() % 1000;
+		v.max = v.min + rng() % 100000;
+		v.value = v.min + rng() % (v.max - v.min + 1);
+		break;
+	case BIT_VALUE_VARINT:
+	case BIT_VALUE_SIGNED:
+	{
+		// Every length of the encoding
+		unsigned int shift = rng() % 32;
+		v.value = rng() >> shift;
+		if (v.kind == BIT_VALUE_SIGNED && rng() % 2 == 0)
+			v.value = (uint32_t)-(int32_t)(v.value >> 1);
+		break;
+	}
+	case BIT_VALUE_FLOAT:
+		v.real = std::uniform_real_distribution<float>(BITSTREAM_FLOAT_MIN, BITSTREAM_FLOAT_MAX)(rng);
+		break;
+	case BIT_VALUE_BYTES:
+		v.size = rng() % sizeof(v.bytes);
+		for (unsigned int i = 0; i < v.size; i++)
+			v.bytes[i] = (char)rng();
+		break;
+	}
+	return v;
+}
+
+static void write_bit_value(BitWriter& writer, const BitValue& v)
+{
+	switch (v.kind) {
+	case BIT_VALUE_BITS:
+		writer.write_bits(v.value, v.size);
+		break;
+	case BIT_VALUE_BOUNDED:
+		writer.write_bounded(v.value, v.min, v.max);
+		break;
+	case BIT_VALUE_VARINT:
+		writer.write_varint(v.value);
+		break;
+	case BIT_VALUE_SIGNED:
+		writer.write_signed_varint((int32_t)v.value);
+		break;
+	case BIT_VALUE_FLOAT:
+		writer.write_float(v.real, BITSTREAM_FLOAT_MIN, BITSTREAM_FLOAT_MAX, BITSTREAM_FLOAT_RESOLUTION);
+		break;
+	case BIT_VALUE_BYTES:
+		writer.write_bytes(v.bytes, v.size);
+		break;
+	}
+}
+
+// Whether the next value read is `v`
+static bool read_bit_value(BitReader& reader, const BitValue& v)
+{
+	uint32_t value;
+	int32_t signedValue;
+	float real;
+	char bytes[sizeof(v.bytes)];
+	switch (v.kind) {
+	case BIT_VALUE_BITS:
+		return reader.read_bits(value, v.size) && value == v.value;
+	case BIT_VALUE_BOUNDED:
+		return reader.read_bounded(value, v.min, v.max) && value == v.value;
+	case BIT_VALUE_VARINT:
+		return reader.read_varint(value) && value == v.value;
+	case BIT_VALUE_SIGNED:
+		return reader.read_signed_varint(signedValue) && signedValue == (int32_t)v.value;
+	case BIT_VALUE_FLOAT:
+		// Within half a step (and the rounding of the floats)
+		return reader.read_float(real, BITSTREAM_FLOAT_MIN, BITSTREAM_FLOAT_MAX, BITSTREAM_FLOAT_RESOLUTION)
+			&& std::fabs(real - v.real) <= BITSTREAM_FLOAT_RESOLUTION * 0.51f;
+	case BIT_VALUE_BYTES:
+		return reader.read_bytes(bytes, v.size) && memcmp(bytes, v.bytes, v.size) == 0;
+	}
+	return false;
+}
+
+static void check_bitstream()
+{
+	const char *group = "bitstream";
+	std::mt19937 rng(1337);
+	std::vector<char> buffer(BITSTREAM_VALUES * (sizeof(BitValue::bytes) + 1));
+	for (unsigned int round = 0; round < BITSTREAM_ROUNDS; round++) {
+		std::vector<BitValue> values;
+		BitWriter writer(&buffer[0], (unsigned int)buffer.size());
+		for (unsigned int i = 0; i < BITSTREAM_VALUES; i++) {
+			values.push_back(random_bit_value(rng));
+			write_bit_value(writer, values.back());
+		}
+		if (!check(!writer.overflowed(), group, "random values fit"))
+			break;
+
+		BitReader reader(&buffer[0], writer.bytes_written());
+		bool same = true;
+		for (unsigned int i = 0; i < values.size() && same; i++)
+			same = read_bit_value(reader, values[i]);
+		uint32_t rest;
+		if (!check(same, group, "random values read back as written")
+			|| !check(reader.bits_left() < 8 && !reader.read_bits(rest, 8), group, "reading past the end fails"))
+			break;
+	}
+
+	// Extremes
+	char data[24];
+	BitWriter writer(data, sizeof(data));
+	writer.write_varint(UINT32_MAX);
+	writer.write_signed_varint(INT32_MIN);
+	writer.write_signed_varint(INT32_MAX);
+	writer.write_bounded(7, 7, 7);
+	writer.write_float(1000.0f, BITSTREAM_FLOAT_MIN, BITSTREAM_FLOAT_MAX, BITSTREAM_FLOAT_RESOLUTION);
+	check(!writer.overflowed() && writer.bytes_written() == 15 + 2, group, "extreme values take the expected size");
+	BitReader reader(data, writer.bytes_written());
+	uint32_t value = 0, bounded = 0;
+	int32_t low = 0, high = 0;
+	float clamped = 0.0f;
+	check(reader.read_varint(value) && value == UINT32_MAX
+		&& reader.read_signed_varint(low) && low == INT32_MIN
+		&& reader.read_signed_varint(high) && high == INT32_MAX
+		&& reader.read_bounded(bounded, 7, 7) && bounded == 7
+		&& reader.read_float(clamped, BITSTREAM_FLOAT_MIN, BITSTREAM_FLOAT_MAX, BITSTREAM_FLOAT_RESOLUTION)
+		&& std::fabs(clamped - BITSTREAM_FLOAT_MAX) <= BITSTREAM_FLOAT_RESOLUTION, group, "extreme values read back (floats clamped)");
+
+	// A write that doesn't fit sets the flag and the ones after it are dropped
+	BitWriter full(data, 4);
+	full.write_bits(UINT32_MAX, 32);
+	check(!full.overflowed(), group, "a write filling the buffer fits");
+	full.write_bool(true);
+	full.write_bits(0, 0);
+	check(full.overflowed() && full.bytes_written() == 4, group, "a write past the capacity overflows");
+	BitWriter unaligned(data, 4);
+	unaligned.write_bits(1, 3);
+	unaligned.write_bytes(data + 8, 4);
+	check(unaligned.overflowed(), group, "bytes that don't fit after aligning overflow");
+
+	// Out of range or truncated input is rejected
+	BitWriter corrupt(data, sizeof(data));
+	corrupt.write_bits(7, 3);
+	corrupt.align();
+	corrupt.write_bits(0x80, 8);
+	BitReader corruptReader(data, 1);
+	check(!corruptReader.read_bounded(value, 0, 5), group, "a bounded value above its maximum is rejected");
+	BitReader varintReader(data + 1, 1);
+	check(!varintReader.read_varint(value), group, "a truncated varint is rejected");
+	check(bits_required(0) == 0 && bits_required(1) == 1 && bits_required(255) == 8 && bits_required(256) == 9
+		&& bits_required(UINT32_MAX) == 32, group, "bits_required");
+}
+
+// A packet replayed long after it was sent, when its short sequence fields wrapped
+static void check_replay()
+{
+	const char *group = "connection";
+	net_time now;
+	Connection a(Address::inet_any(), 1, now), b(Address::inet_any(), 1, now);
+	CaptureTransport toA, toB;
+	Packet old;
+	for (unsigned int tick = 0; tick < 200; tick++) {
+		a.send_outgoing(toB, now);
+		if (old.empty() && !toB.sent.empty())
+			old = toB.sent[0];
+		toB.deliver(b, now);
+		b.send_outgoing(toA, now);
+		toA.deliver(a, now);
+		now += a.send_interval();
+	}
+	check(!old.empty() && !b.process_packet(old, now), group, "a replayed old packet is rejected");
+
+	// A reliable message in a packet whose body can't be read must not be acked,
+	// so the sender resends it
+	Connection c(Address::inet_any(), 2, now), d(Address::inet_any(), 2, now);
+	c.add_channel(1, Channel::RELIABLE);
+	d.add_channel(1, Channel::RELIABLE);
+	PacketPool pool(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+	Packet message = pool.allocate_buffer(100);
+	memset(message.data(), 7, message.size());
+	c.send(1, message);
+	c.send_outgoing(toB, now);
+	bool truncated = toB.sent.size() == 1 && !d.process_packet(toB.sent[0].subpacket(0, toB.sent[0].size() - 1), now);
+	check(truncated && d.metrics().rejected == 1, group, "a packet with a truncated body is rejected");
+	toB.sent.clear();
+	unsigned int received = 0;
+	for (unsigned int tick = 0; tick < 200; tick++) {
+		d.send_outgoing(toA, now);
+		toA.deliver(c, now);
+		c.send_outgoing(toB, now);
+		toB.deliver(d, now);
+		Packet p;
+		while (!(p = d.get_channel_in_by_id(1)->receive()).empty())
+			received += p.size() == message.size() && p.data()[0] == 7;
+		now += c.send_interval();
+	}
+	check(received == 1, group, "the message of a rejected packet is resent");
+}
+
+// Inputs per kind of the compression check
+const unsigned int LZ_CHECK_ROUNDS = 100;
+
+// Whether `data` compresses and decompresses back to itself
+static bool lz_round_trip(const std::vector<char>& data, const CompressionDictionary *dict, unsigned int& compressedSize)
+{
+	unsigned int size = (unsigned int)data.size();
+	std::vector<char> compressed(lz_max_size(size));
+	std::vector<char> decompressed(size + 1);
+	compressedSize = lz_compress(data.data(), size, &compressed[0], (unsigned int)compressed.size(), dict);
+	unsigned int outSize = 0;
+	if (compressedSize == 0 || !lz_decompress(&compressed[0], compressedSize, &decompressed[0], (unsigned int)decompressed.size(), dict, outSize))
+		return false;
+	if (outSize != size || !std::equal(data.begin(), data.end(), decompressed.begin()))
+		return false;
+
+	// One byte short of either side fails instead of writing past it
+	if (lz_compress(data.data(), size, &compressed[0], compressedSize - 1, dict) != 0)
+		return false;
+	return size == 0 || !lz_decompress(&compressed[0], compressedSize, &decompressed[0], size - 1, dict, outSize);
+}
+
+static void check_compression()
+{
+	const char *group = "compression";
+	std::mt19937 rng(1337);
+	std::vector<char> common(2048);
+	for (auto& c : common)
+		c = (char)rng();
+	CompressionDictionary dict(common.data(), (unsigned int)common.size());
+
+	unsigned int compressedSize;
+	std::vector<char> empty;
+	check(lz_round_trip(empty, nullptr, compressedSize), group, "empty input round trip");
+
+	bool random = true, repetitive = true, run = true, referenced = true;
+	for (unsigned int round = 0; round < LZ_CHECK_ROUNDS; round++) {
+		unsigned int size = 1 + rng() % MAX_PACKET_SIZE;
+		std::vector<char> data(size);
+
+		for (auto& c : data)
+			c = (char)rng();
+		random = random && lz_round_trip(data, nullptr, compressedSize) && lz_round_trip(data, &dict, compressedSize);
+
+		// A few symbols in a short period, matches overlap what they produce
+		unsigned int period = 1 + rng() % 16;
+		for (unsigned int i = 0; i < size; i++)
+			data[i] = (char)('a' + (i % period) % 4);
+		repetitive = repetitive && lz_round_trip(data, nullptr, compressedSize) && (size < 64 || compressedSize < size / 2);
+
+		std::fill(data.begin(), data.end(), (char)rng());
+		run = run && lz_round_trip(data, nullptr, compressedSize) && (size < 64 || compressedSize < size / 8);
+
+		// Pieces of the dictionary between random bytes
+		for (unsigned int i = 0; i < size;) {
+			unsigned int piece = std::min(size - i, 8 + (unsigned int)(rng() % 64));
+			unsigned int from = rng() % (common.size() - piece);
+			memcpy(&data[i], &common[from], piece);
+			i += piece;
+			if (i < size)
+				data[i++] = (char)rng();
+		}
+		referenced = referenced && lz_round_trip(data, &dict, compressedSize) && (size < 64 || compressedSize < size / 2);
+	}
+	check(random, group, "random input round trip");
+	check(repetitive, group, "repetitive input round trip");
+	check(run, group, "single byte run round trip");
+	check(referenced, group, "input from the dictionary round trip");
+
+	// Truncated input fails or decodes to a prefix (the empty sequence ending a stream
+	// can be cut off), damaged input fails or decodes to something that fits
+	std::vector<char> data(600);
+	for (unsigned int i = 0; i < data.size(); i++)
+		data[i] = (char)(i % 7 == 0 ? rng() : 'x');
+	std::vector<char> compressed(lz_max_size((unsigned int)data.size()));
+	unsigned int size = lz_compress(data.data(), (unsigned int)data.size(), &compressed[0], (unsigned int)compressed.size(), &dict);
+	std::vector<char> out(data.size());
+	unsigned int outSize;
+	bool bounded = size != 0;
+	for (unsigned int cut = 0; cut < size; cut++) {
+		if (lz_decompress(&compressed[0], cut, &out[0], (unsigned int)out.size(), &dict, outSize))
+			bounded = bounded && outSize <= data.size() && std::equal(out.begin(), out.begin() + outSize, data.begin());
+	}
+	for (unsigned int round = 0; round < LZ_CHECK_ROUNDS * 10; round++) {
+		std::vector<char> damaged(compressed.begin(), compressed.begin() + size);
+		damaged[rng() % size] ^= (char)(1 + rng() % 255);
+		if (lz_decompress(&damaged[0], size, &out[0], (unsigned int)out.size(), &dict, outSize))
+			bounded = bounded && outSize <= out.size();
+		for (auto& c : damaged)
+			c = (char)rng();
+		if (lz_decompress(&damaged[0], size, &out[0], (unsigned int)out.size(), nullptr, outSize))
+			bounded = bounded && outSize <= out.size();
+	}
+	check(bounded, group, "truncated and damaged input stays in bounds");
+
+	// A literal and a match reaching 5 bytes back, before the start of the output
+	const char farMatch[] = { 0x10, 'a', 0x05, 0x00 };
+	check(!lz_decompress(farMatch, sizeof(farMatch), &out[0], (unsigned int)out.size(), nullptr, outSize), group, "a match before the output is rejected");
+}
+
+// Probe the path sizes of the MTU check with `probe_size()` until the search ends
+// `lossy` also loses the first attempt of every size that fits
+static bool mtu_search(unsigned int pathSize, bool lossy, net_time now, PathMtu& mtu)
+{
+	unsigned int previous = mtu.packet_size();
+	bool lostOnce = false;
+	for (unsigned int probes = 0; probes < 100; probes++) {
+		unsigned int size = mtu.probe_size(now);
+		if (size == 0)
+			return mtu.done();
+		mtu.probe_sent();
+		if (size > pathSize || (lossy && !lostOnce)) {
+			mtu.probe_lost(size, now);
+			lostOnce = size <= pathSize;
+		} else {
+			mtu.probe_acked(size, now);
+			lostOnce = false;
+		}
+		// Never above the path, never back down
+		if (mtu.packet_size() > std::max(pathSize, (unsigned int)MIN_PACKET_SIZE) || mtu.packet_size() < previous)
+			return false;
+		previous = mtu.packet_size();
+	}
+	return false;
+}
+
+static void check_path_mtu()
+{
+	const char *group = "mtu";
+	static const unsigned int paths[] = { 300, MIN_PACKET_SIZE, 600, 1000, 1200, 1400, MAX_PACKET_SIZE - 1, MAX_PACKET_SIZE, 9000 };
+	net_time now = net_time(std::chrono::hours(1000));
+	for (auto path : paths) {
+		for (int lossy = 0; lossy < 2; lossy++) {
+			PathMtu mtu;
+			unsigned int expected = std::min(std::max(path, MIN_PACKET_SIZE), MAX_PACKET_SIZE);
+			std::ostringstream what;
+			what << "the search settles within a step below a path of " << path << (lossy ? " bytes with losses" : " bytes");
+			check(mtu_search(path, lossy != 0, now, mtu) && mtu.packet_size() <= expected && expected - mtu.packet_size() < MTU_SEARCH_STEP, group, what.str());
+		}
+	}
+
+	// A new search after the raise interval finds a path that got larger
+	PathMtu mtu;
+	mtu_search(1000, false, now, mtu);
+	unsigned int size = mtu.packet_size();
+	check(mtu.probe_size(now + std::chrono::seconds(1)) == 0, group, "no probes after the search ended");
+	net_time later = now + std::chrono::hours(1);
+	check(mtu_search(MAX_PACKET_SIZE, false, later, mtu) && mtu.packet_size() == MAX_PACKET_SIZE && size < MAX_PACKET_SIZE, group, "a larger path is found after the raise interval");
+
+	PathMtu off;
+	off.set_max(MIN_PACKET_SIZE);
+	check(off.probe_size(now) == 0 && off.packet_size() == MIN_PACKET_SIZE, group, "MIN_PACKET_SIZE turns the discovery off");
+	PathMtu capped;
+	capped.set_max(1000);
+	check(mtu_search(MAX_PACKET_SIZE, false, now, capped) && capped.packet_size() == 1000, group, "the search stops at the maximum set");
+
+	// Large packets lost in a row mean the path shrank, an ack of one as large in between doesn't
+	PathMtu shrinking;
+	mtu_search(MAX_PACKET_SIZE, false, now, shrinking);
+	bool fellBack = false;
+	for (unsigned int i = 0; i + 1 < MTU_BLACK_HOLE_LOSSES; i++)
+		fellBack = shrinking.packet_lost(MAX_PACKET_SIZE, now) || fellBack;
+	shrinking.packet_acked(MAX_PACKET_SIZE);
+	for (unsigned int i = 0; i + 1 < MTU_BLACK_HOLE_LOSSES; i++)
+		fellBack = shrinking.packet_lost(MAX_PACKET_SIZE, now) || fellBack;
+	for (unsigned int i = 0; i < 2 * MTU_BLACK_HOLE_LOSSES; i++)
+		fellBack = shrinking.packet_lost(MIN_PACKET_SIZE, now) || fellBack;
+	check(!fellBack && shrinking.packet_size() == MAX_PACKET_SIZE, group, "scattered losses and small packets lost keep the size");
+	shrinking.packet_acked(MIN_PACKET_SIZE);
+	fellBack = shrinking.packet_lost(MAX_PACKET_SIZE, now);
+	check(fellBack && shrinking.packet_size() == MIN_PACKET_SIZE && shrinking.probe_size(now) == MAX_PACKET_SIZE, group, "a run of large packets lost falls back and searches again");
+	check(mtu_search(1000, false, now, shrinking) && shrinking.packet_size() <= 1000 && 1000 - shrinking.packet_size() < MTU_SEARCH_STEP, group, "the new search settles below the smaller path");
+}
+
+static bool verify_cookie(const CookieGenerator& cookies, const Packet& cookie, const Address& addr, net_time now, magic_t& magic)
+{
+	NetReader reader = cookie.read();
+	return cookies.verify(reader, addr, now, magic);
+}
+
+static void check_cookies()
+{
+	const char *group = "handshake";
+
+	// Test vectors of the SipHash paper's reference code: key 00..0f, messages 00, 01, ...
+	const uint64_t key[2] = { 0x0706050403020100ull, 0x0f0e0d0c0b0a0908ull };
+	unsigned char message[15];
+	for (unsigned int i = 0; i < sizeof(message); i++)
+		message[i] = (unsigned char)i;
+	check(siphash(key, message, 0) == 0x726fdb47dd0e0e31ull && siphash(key, message, 8) == 0x93f5f5799a932462ull
+		&& siphash(key, message, 15) == 0xa129ca6149be45e5ull, group, "siphash matches the reference vectors");
+
+	CookieGenerator cookies;
+	PacketPool pool(MAX_PACKET_SIZE);
+	Address addr = check_address(1);
+	net_time issued = net_time(std::chrono::hours(1000));
+	Packet cookie = pool.allocate_buffer(sizeof(uint32_t) + sizeof(uint64_t));
+	NetWriter writer(cookie.data(), cookie.size());
+	cookies.issue(writer, addr, issued);
+
+	magic_t magic = 0, again = 0, other = 0;
+	check(verify_cookie(cookies, cookie, addr, issued, magic) && !is_handshake(magic), group, "a cookie verifies for its address");
+	check(verify_cookie(cookies, cookie, addr, issued + std::chrono::seconds(COOKIE_LIFETIME - 1), again) && again == magic, group, "every copy of a cookie opens the same connection");
+	check(!verify_cookie(cookies, cookie, addr, issued + std::chrono::seconds(COOKIE_LIFETIME), other), group, "an expired cookie is rejected");
+	check(!verify_cookie(cookies, cookie, addr, issued - std::chrono::seconds(1), other), group, "a cookie from the future is rejected");
+	check(!verify_cookie(cookies, cookie, check_address(2), issued, other), group, "a cookie for another address is rejected");
+	check(!verify_cookie(cookies, cookie.subpacket(0, cookie.size() - 1), addr, issued, other), group, "a truncated cookie is rejected");
+
+	bool tampered = true;
+	for (unsigned int i = 0; i < cookie.size(); i++) {
+		Packet copy = pool.allocate_buffer(cookie.size());
+		memcpy(copy.data(), cookie.data(), cookie.size());
+		copy.data()[i] ^= 1;
+		// Changing the time by a second keeps it within the lifetime, only the hash can catch it
+		tampered = tampered && !verify_cookie(cookies, copy, addr, issued + std::chrono::seconds(2), other);
+	}
+	check(tampered, group, "a cookie with any bit flipped is rejected");
+}
+
+// Messages sent over the emulated link and virtual seconds the link checks run for
+const unsigned int LINK_CHECK_MESSAGES = 1000;
+const unsigned int LINK_CHECK_SECONDS = 60;
+
+// Every how many messages a fragmented one is sent, and its size
+const unsigned int LINK_CHECK_LARGE_INTERVAL = 50;
+const unsigned int LINK_CHECK_LARGE_SIZE = 3000;
+
+// What a run over the emulated link did
+struct LinkCheckResult
+{
+	LinkCheckResult()
+		: received(0)
+		, intact(true)
+		, shrunk_from(0)
+		, packet_size(0)
+	{ }
+
+	LinkStats stats[2];
+	unsigned int received;
+	// Every message arrived once with its contents (and in order where it must)
+	bool intact;
+	// Packet size the sender had when the link's MTU went down
+	unsigned int shrunk_from;
+	// Packet size the sender ended with
+	unsigned int packet_size;
+};
+
+// Send `LINK_CHECK_MESSAGES` messages of varied sizes (some fragmented) from one end to
+// the other over a link that loses, reorders and duplicates datagrams
+// The link carries datagrams of up to `linkMtu` bytes (0 for any size), down to
+// `shrinkMtu` once half the messages are sent if it isn't 0
+static LinkCheckResult check_link_run(uint32_t seed, Channel::Type type, bool compress, unsigned int linkMtu, unsigned int shrinkMtu)
+{
+	LinkEmulator link(seed);
+	LinkConditions conditions;
+	conditions.latency = std::chrono::milliseconds(30);
+	conditions.jitter = std::chrono::milliseconds(5);
+	conditions.loss = 0.05;
+	conditions.burst_enter = 0.01;
+	conditions.burst_exit = 0.3;
+	conditions.burst_loss = 0.7;
+	conditions.reorder = 0.05;
+	conditions.reorder_delay = std::chrono::milliseconds(20);
+	conditions.duplicate = 0.02;
+	conditions.mtu = linkMtu;
+	link.set_conditions(conditions);
+
+	Connection sender(link.address(1), 1, link.now());
+	Connection receiver(link.address(0), 1, link.now());
+	sender.add_channel(1, type);
+	receiver.add_channel(1, type);
+	sender.set_compression(compress);
+	receiver.set_compression(compress);
+	PacketPool pool(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE);
+
+	LinkCheckResult result;
+	std::vector<bool> seen(LINK_CHECK_MESSAGES);
+	uint32_t sent = 0;
+	link.run(sender, receiver, link.now() + std::chrono::seconds(LINK_CHECK_SECONDS), [&](unsigned int side, net_time /*now*/) {
+		if (side == 0) {
+			if (shrinkMtu != 0 && sent == LINK_CHECK_MESSAGES / 2 && result.shrunk_from == 0) {
+				conditions.mtu = shrinkMtu;
+				link.set_conditions(conditions);
+				result.shrunk_from = sender.mtu().packet_size();
+			}
+			for (unsigned int i = 0; i < 5 && sent < LINK_CHECK_MESSAGES; i++, sent++) {
+				unsigned int size = sent % LINK_CHECK_LARGE_INTERVAL == 0 ? LINK_CHECK_LARGE_SIZE : 4 + sent * 37 % 200;
+				Packet p = pool.allocate_buffer(size);
+				memcpy(p.data(), &sent, sizeof(sent));
+				for (unsigned int j = sizeof(sent); j < size; j++)
+					p.data()[j] = (char)(sent + j);
+				sender.send(1, p);
+			}
+			return;
+		}
+		Packet p;
+		while (!(p = receiver.get_channel_in_by_id(1)->receive()).empty()) {
+			uint32_t id;
+			if (p.size() < sizeof(id)) {
+				result.intact = false;
+				continue;
+			}
+			memcpy(&id, p.data(), sizeof(id));
+			bool valid = id < LINK_CHECK_MESSAGES && !seen[id]
+				&& p.size() == (id % LINK_CHECK_LARGE_INTERVAL == 0 ? LINK_CHECK_LARGE_SIZE : 4 + id * 37 % 200)
+				&& (type != Channel::SEQUENTIAL || id == result.received);
+			for (unsigned int j = sizeof(id); j < p.size() && valid; j++)
+				valid = p.data()[j] == (char)(id + j);
+			if (valid)
+				seen[id] = true;
+			result.intact = result.intact && valid;
+			result.received++;
+		}
+	});
+	result.stats[0] = link.stats(0);
+	result.stats[1] = link.stats(1);
+	result.packet_size = sender.mtu().packet_size();
+	return result;
+}
+
+static bool same_link_stats(const LinkStats& a, const LinkStats& b)
+{
+	return a.sent == b.sent && a.delivered == b.delivered && a.lost == b.lost && a.queue_drops == b.queue_drops
+		&& a.mtu_drops == b.mtu_drops && a.duplicated == b.duplicated && a.reordered == b.reordered
+		&& a.bytes_delivered == b.bytes_delivered;
+}
+
+
+static void check_link()
+{
+	const char *group = "link";
+	static const Channel::Type types[] = { Channel::RELIABLE, Channel::SEQUENTIAL };
+	for (auto type : types) {
+		for (int compress = 0; compress < 2; compress++) {
+			LinkCheckResult result = check_link_run(7, type, compress != 0, 0, 0);
+			std::ostringstream what;
+			what << (type == Channel::RELIABLE ? "reliable" : "sequential") << (compress ? " compressed" : "")
+				<< " messages arrive intact over a lossy link (" << result.received << "/" << LINK_CHECK_MESSAGES << ")";
+			check(result.intact && result.received == LINK_CHECK_MESSAGES && result.stats[0].lost > 0 && result.stats[0].duplicated > 0, group, what.str());
+		}
+	}
+
+	LinkCheckResult first = check_link_run(11, Channel::RELIABLE, false, 0, 0);
+	LinkCheckResult second = check_link_run(11, Channel::RELIABLE, false, 0, 0);
+	check(first.received == second.received && same_link_stats(first.stats[0], second.stats[0])
+		&& same_link_stats(first.stats[1], second.stats[1]), group, "a seed replays a run exactly");
+
+	// The sender settles below a narrow path, then falls back and cuts its fragments
+	// again when the path shrinks in the middle of the run
+	const unsigned int narrowMtu = 1200;
+	const unsigned int shrunkMtu = 1000;
+	for (int sequential = 0; sequential < 2; sequential++) {
+		Channel::Type type = sequential ? Channel::SEQUENTIAL : Channel::RELIABLE;
+		LinkCheckResult narrow = check_link_run(13, type, false, narrowMtu, 0);
+		std::ostringstream what;
+		what << (sequential ? "sequential" : "reliable") << " messages arrive over a " << narrowMtu
+			<< " byte path, sent in packets of " << narrow.packet_size;
+		check(narrow.intact && narrow.received == LINK_CHECK_MESSAGES && narrow.stats[0].mtu_drops > 0
+			&& narrow.packet_size <= narrowMtu && narrowMtu - narrow.packet_size < MTU_SEARCH_STEP, group, what.str());
+
+		LinkCheckResult shrunk = check_link_run(17, type, false, 0, shrunkMtu);
+		std::ostringstream shrunkWhat;
+		shrunkWhat << (sequential ? "sequential" : "reliable") << " messages arrive when the path shrinks to " << shrunkMtu
+			<< " bytes, packets of " << shrunk.shrunk_from << " then " << shrunk.packet_size;
+		check(shrunk.intact && shrunk.received == LINK_CHECK_MESSAGES && shrunk.shrunk_from > shrunkMtu
+			&& shrunk.packet_size <= shrunkMtu && shrunkMtu - shrunk.packet_size < MTU_SEARCH_STEP, group, shrunkWhat.str());
+	}
+}
+
+// Random adds and removes of the connection store check, over this many addresses
+const unsigned int STORE_CHECK_OPERATIONS = 20000;
+const unsigned int STORE_CHECK_ADDRESSES = 4000;
+
+static void check_connection_store()
+{
+	const char *group = "connection_store";
+	ConnectionStore store;
+	// Address index -> handle, what the store should hold
+	std::map<unsigned int, ConnectionHandle> reference;
+	std::vector<ConnectionHandle> removed;
+	std::mt19937 rng(1337);
+	net_time start;
+
+	// Present addresses are removed a third of the time, so the table grows and
+	// deletions keep shifting the probe sequences back
+	bool found = true;
+	for (unsigned int i = 0; i < STORE_CHECK_OPERATIONS && found; i++) {
+		unsigned int index = rng() % STORE_CHECK_ADDRESSES;
+		auto it = reference.find(index);
+		if (it == reference.end()) {
+			Address addr = check_address(index);
+			reference[index] = store.add(addr, Connection(addr, index, start), start + std::chrono::milliseconds(index));
+		} else if (rng() % 3 == 0) {
+			store.remove(it->second);
+			removed.push_back(it->second);
+			reference.erase(it);
+		}
+
+		unsigned int lookup = rng() % STORE_CHECK_ADDRESSES;
+		const Connection *conn = store.get(store.find(check_address(lookup)));
+		found = reference.count(lookup) ? conn != nullptr && conn->magic() == lookup : conn == nullptr;
+	}
+	check(found && store.size() == reference.size(), group, "lookups match the added and removed addresses");
+
+	bool all = true;
+	for (auto& entry : reference) {
+		ConnectionHandle h = store.find(check_address(entry.first));
+		all = all && h.index == entry.second.index && h.generation == entry.second.generation
+			&& address_equal(store.address(h), check_address(entry.first));
+	}
+	check(all, group, "every remaining address is found with its handle");
+	bool stale = true;
+	for (auto& h : removed)
+		stale = stale && store.get(h) == nullptr;
+	check(stale, group, "the handles of removed connections stay invalid after their slots are reused");
+
+	size_t visited = 0;
+	store.for_each([&](ConnectionHandle /*h*/, Connection& conn) {
+		visited += reference.count(conn.magic()) != 0;
+	});
+	check(visited == reference.size(), group, "for_each visits every connection once");
+
+	// Deadlines are the index in milliseconds
+	const unsigned int cutoff = STORE_CHECK_ADDRESSES / 2;
+	size_t due = 0;
+	for (auto& entry : reference)
+		due += entry.first <= cutoff;
+	std::vector<ConnectionHandle> out;
+	store.collect_due(start + std::chrono::milliseconds(cutoff), out);
+	bool valid = out.size() == due;
+	for (auto& h : out)
+		valid = valid && store.get(h) != nullptr && store.get(h)->magic() <= cutoff;
+	check(valid, group, "collect_due finds exactly the due connections");
+	check(!reference.empty() && store.next_deadline() == start + std::chrono::milliseconds(reference.begin()->first), group, "next_deadline is the earliest deadline");
+	store.collect_silent(start, out);
+	bool none = out.empty();
+	store.collect_silent(start + std::chrono::milliseconds(1), out);
+	check(none && out.size() == reference.size(), group, "collect_silent finds the connections silent since the cutoff");
+
+	for (auto& entry : reference)
+		store.remove(entry.second);
+	check(store.size() == 0 && store.next_deadline() == net_time::max() && !store.get(store.find(check_address(reference.begin()->first))), group, "removing everything empties the store");
+}
+
+// Items of the timer wheel check, due over a few revolutions of its wheel, which is
+// advanced in uneven steps
+const unsigned int WHEEL_CHECK_ITEMS = 5000;
+const unsigned int WHEEL_CHECK_SLOTS = 256;
+const unsigned int WHEEL_CHECK_SPAN = 1000;
+const unsigned int WHEEL_CHECK_RESCHEDULED = 100;
+
+static void check_timer_wheel()
+{
+	const char *group = "timer_wheel";
+	TimerWheel<unsigned int> wheel(WHEEL_CHECK_SLOTS);
+	// Ticks are counted from when the wheel was made, just before `start`, so whole
+	// milliseconds from `start` fall on the same tick
+	net_time start = net_clock::now();
+	std::mt19937 rng(4242);
+	// Item -> deadline in milliseconds from `start`, what is still scheduled
+	std::map<unsigned int, unsigned int> pending;
+	for (unsigned int i = 0; i < WHEEL_CHECK_ITEMS; i++) {
+		pending[i] = 1 + rng() % WHEEL_CHECK_SPAN;
+		wheel.schedule(start + std::chrono::milliseconds(pending[i]), i);
+	}
+	check(wheel.size() == WHEEL_CHECK_ITEMS, group, "every scheduled item is counted");
+
+	// The first items due are scheduled again from the callback, the way the shards reschedule connections
+	bool onTime = true, once = true, early = true;
+	unsigned int rescheduled = 0;
+	unsigned int now = 0;
+	while (now <= 2 * WHEEL_CHECK_SPAN) {
+		unsigned int previous = now;
+		now += 1 + rng() % 7;
+		wheel.advance(start + std::chrono::milliseconds(now), [&](unsigned int item, net_time deadline) {
+			auto it = pending.find(item);
+			if (it == pending.end()) {
+				once = false;
+				return;
+			}
+			// The deadline given back is rounded down to the tick
+			net_time exact = start + std::chrono::milliseconds(it->second);
+			onTime = onTime && it->second > previous && it->second <= now && deadline <= exact && deadline > exact - std::chrono::milliseconds(1);
+			pending.erase(it);
+			if (rescheduled < WHEEL_CHECK_RESCHEDULED) {
+				unsigned int id = WHEEL_CHECK_ITEMS + rescheduled++;
+				pending[id] = now + 1 + rng() % WHEEL_CHECK_SPAN;
+				wheel.schedule(start + std::chrono::milliseconds(pending[id]), id);
+			}
+		});
+
+		unsigned int first = UINT32_MAX;
+		for (auto& entry : pending)
+			first = std::min(first, entry.second);
+		early = early && wheel.size() == pending.size() && (pending.empty() || wheel.next_deadline() <= start + std::chrono::milliseconds(first));
+	}
+	check(onTime && once, group, "items fire once, at the first advance past their deadline");
+	check(rescheduled == WHEEL_CHECK_RESCHEDULED && pending.empty() && wheel.size() == 0, group, "items scheduled while firing fire too");
+	check(early, group, "next_deadline is never later than the earliest item");
+
+	// A jump over many revolutions fires everything, even what was scheduled in the past
+	wheel.schedule(start, 0);
+	wheel.schedule(start + std::chrono::milliseconds(100 * WHEEL_CHECK_SPAN), 1);
+	unsigned int fired = 0;
+	wheel.advance(start + std::chrono::milliseconds(200 * WHEEL_CHECK_SPAN), [&](unsigned int /*item*/, net_time /*deadline*/) {
+		fired++;
+	});
+	check(fired == 2 && wheel.size() == 0, group, "a long jump fires every item due");
+}
+
+#ifdef __linux__
+// Items handed over per run and the longest burst pushed at once
+const unsigned int HANDOFF_CHECK_ITEMS = 200000;
+const unsigned int HANDOFF_CHECK_BURST = 8;
+
+// Longer than any real handoff takes, so a wait that runs out means a lost wakeup
+const std::chrono::seconds HANDOFF_CHECK_TIMEOUT(1);
+
+// One thread pushes bursts while the other drains and sleeps whenever the queue is empty,
+// the way the shards and the send thread hand datagrams over
+static void check_queue_handoff()
+{
+	const char *group = "handoff";
+	SpscQueue<uint32_t> queue(64);
+	EventLoop loop;
+	unsigned int notifications = 0;
+
+	std::thread producer([&]() {
+		std::mt19937 rng(24);
+		for (uint32_t i = 0; i < HANDOFF_CHECK_ITEMS;) {
+			unsigned int burst = 1 + rng() % HANDOFF_CHECK_BURST;
+			for (; burst > 0 && i < HANDOFF_CHECK_ITEMS; burst--) {
+				uint32_t *slot;
+				while ((slot = queue.push_slot()) == nullptr)
+					std::this_thread::yield();
+				*slot = i++;
+				if (queue.push() == 1) {
+					notifications++;
+					loop.notify();
+				}
+			}
+			// Leave the consumer time to drain and go to sleep now and then
+			if (rng() % 4 == 0)
+				std::this_thread::sleep_for(std::chrono::microseconds(rng() % 50));
+		}
+	});
+
+	uint32_t next = 0;
+	unsigned int outOfOrder = 0;
+	unsigned int sleeps = 0;
+	unsigned int timeouts = 0;
+	while (next < HANDOFF_CHECK_ITEMS) {
+		uint32_t *item;
+		while ((item = queue.front()) != nullptr) {
+			outOfOrder += *item != next;
+			next++;
+			queue.pop();
+		}
+		// After a lost wakeup only poll, so a failure doesn't take a second per item
+		if (next < HANDOFF_CHECK_ITEMS && queue.idle()) {
+			if (timeouts == 0) {
+				sleeps++;
+				timeouts += !loop.wait_until(net_clock::now() + HANDOFF_CHECK_TIMEOUT);
+			} else {
+				std::this_thread::yield();
+			}
+		}
+	}
+	producer.join();
+
+	std::ostringstream what;
+	what << timeouts << " of " << sleeps << " sleeps ran out waiting for a push";
+	check(timeouts == 0, group, what.str());
+	check(next == HANDOFF_CHECK_ITEMS && outOfOrder == 0, group, "every item arrives once and in order");
+	check(sleeps > 0 && notifications > 0, group, "the consumer went to sleep and was woken up");
+}
+#endif
+
+unsigned int run_checks(std::ostream& out)
+{
+	check_out = &out;
+	check_count = 0;
+	check_failures = 0;
+
+#ifdef __linux__
+	check_send_queue();
+#endif
+	check_receive_window();
+	check_sequence_buffer();
+	check_ring_buffer();
+	check_delivery();
+	check_delta();
+	check_bitstream();
+	check_replay();
+	check_compression();
+	check_path_mtu();
+	check_cookies();
+	check_link();
+	check_connection_store();
+	check_timer_wheel();
+#ifdef __linux__
+	check_queue_handoff();
+#endif
+
+	out << "checks: " << check_count - check_failures << " passed, " << check_failures << " failed" << std::endl;
+	return check_failures;
+}
\ No newline at end of file
@@ -0,0 +1,12 @@
+#ifndef _NETGAME_CHECKS_H
+#define _NETGAME_CHECKS_H
+
+#include <ostream>
+
+// Deterministic checks of the building blocks of the protocol and of whole
+// connections talking over the link emulator, each a group of round trips and edge cases
+// Every random input comes from a fixed seed, so a failure repeats on every run
+// Prints a line per failed check and a summary to `out`, returns the number of failures
+unsigned int run_checks(std::ostream& out);
+
+#endif
\ No newline at end of file
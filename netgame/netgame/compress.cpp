@@ -0,0 +1,361 @@
+#include "compress.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
+
+// Length of the substrings counted when training a dictionary
+const unsigned int DICTIONARY_KMER_SIZE = 8;
+
+// Size of the sample segments a dictionary is made of
+const unsigned int DICTIONARY_SEGMENT_SIZE = 64;
+
+static inline uint32_t read32(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned int lz_hash(const char *p)
+{
+	return (read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+CompressionDictionary::CompressionDictionary()
+{
+}
+
+CompressionDictionary::CompressionDictionary(const char *data, unsigned int size)
+	: m_table(LZ_HASH_SIZE, 0)
+{
+	if (size > MAX_DICTIONARY_SIZE) {
+		data += size - MAX_DICTIONARY_SIZE;
+		size = MAX_DICTIONARY_SIZE;
+	}
+	m_data.assign(data, data + size);
+
+	// Later positions win, they are closer to the input
+	for (unsigned int i = 0; i + LZ_MIN_MATCH <= size; i++)
+		m_table[lz_hash(data + i)] = (uint16_t)(i + 1);
+}
+
+// A sample segment and how many common substrings it holds
+struct DictionarySegment
+{
+	DictionarySegment(unsigned int sample, unsigned int start, unsigned int size, unsigned long long score)
+		: sample(sample)
+		, start(start)
+		, size(size)
+		, score(score)
+	{ }
+
+	bool operator<(const DictionarySegment& rhs) const { return score < rhs.score; }
+
+	unsigned int sample;
+	unsigned int start;
+	unsigned int size;
+	unsigned long long score;
+};
+
+static uint64_t read_kmer(const char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+CompressionDictionary CompressionDictionary::train(const std::vector<Packet>& samples, unsigned int size)
+{
+	size = std::min(size, MAX_DICTIONARY_SIZE);
+
+	// Count every substring
+	std::unordered_map<uint64_t, unsigned int> counts;
+	for (auto& sample : samples) {
+		for (unsigned int i = 0; i + DICTIONARY_KMER_SIZE <= sample.size(); i++)
+			counts[read_kmer(sample.data() + i)]++;
+	}
+
+	auto score = [&](const DictionarySegment& s) -> unsigned long long {
+		const char *data = samples[s.sample].data() + s.start;
+		unsigned long long total = 0;
+		for (unsigned int i = 0; i + DICTIONARY_KMER_SIZE <= s.size; i++) {
+			auto it = counts.find(read_kmer(data + i));
+			// Substrings seen once are not worth keeping
+			if (it->second > 1)
+				total += it->second;
+		}
+		return total;
+	};
+
+	// Segments at half segment steps, the best ones are taken greedily and the
+	// substrings they cover stop counting for the others (rescored when they come up)
+	std::priority_queue<DictionarySegment> queue;
+	for (unsigned int s = 0; s < samples.size(); s++) {
+		unsigned int sampleSize = samples[s].size();
+		if (sampleSize < DICTIONARY_KMER_SIZE)
+			continue;
+		for (unsigned int start = 0; start == 0 || start + DICTIONARY_SEGMENT_SIZE <= sampleSize; start += DICTIONARY_SEGMENT_SIZE / 2) {
+			DictionarySegment segment(s, start, std::min(DICTIONARY_SEGMENT_SIZE, sampleSize - start), 0);
+			segment.score = score(segment);
+			if (segment.score > 0)
+				queue.push(segment);
+		}
+	}
+
+	std::vector<DictionarySegment> picked;
+	unsigned int total = 0;
+	while (!queue.empty() && total < size) {
+		DictionarySegment segment = queue.top();
+		queue.pop();
+		unsigned long long current = score(segment);
+		if (current == 0)
+			continue;
+		if (current < segment.score) {
+			segment.score = current;
+			queue.push(segment);
+			continue;
+		}
+
+		const char *data = samples[segment.sample].data() + segment.start;
+		for (unsigned int i = 0; i + DICTIONARY_KMER_SIZE <= segment.size; i++)
+			counts[read_kmer(data + i)] = 0;
+		segment.size = std::min(segment.size, size - total);
+		picked.push_back(segment);
+		total += segment.size;
+	}
+
+	// The best segments last, closest to the input
+	std::vector<char> data;
+	data.reserve(total);
+	for (auto it = picked.rbegin(); it != picked.rend(); ++it) {
+		const char *segment = samples[it->sample].data() + it->start;
+		data.insert(data.end(), segment, segment + it->size);
+	}
+	return data.empty() ? CompressionDictionary() : CompressionDictionary(&data[0], (unsigned int)data.size());
+}
+
+// Write a length that didn't fit its token nibble
+static bool write_length(char *&out, char *end, unsigned int length)
+{
+	for (; length >= 255; length -= 255) {
+		if (out == end)
+			return false;
+		*out++ = (char)255;
+	}
+	if (out == end)
+		return false;
+	*out++ = (char)length;
+	return true;
+}
+
+static bool read_length(const char *&in, const char *end, unsigned int& length)
+{
+	unsigned char byte;
+	do {
+		if (in == end)
+			return false;
+		byte = (unsigned char)*in++;
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+// Write the sequence of the literals from `literals` and a match (if `matchLength`)
+static bool write_sequence(char *&out, char *end, const char *literals, unsigned int literalCount, unsigned int offset, unsigned int matchLength)
+{
+	if (out == end)
+		return false;
+	char *token = out++;
+	unsigned int matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+	*token = (char)((std::min(literalCount, 15u) << 4) | std::min(matchCode, 15u));
+
+	if (literalCount >= 15 && !write_length(out, end, literalCount - 15))
+		return false;
+	if ((unsigned int)(end - out) < literalCount)
+		return false;
+	if (literalCount > 0)
+		memcpy(out, literals, literalCount);
+	out += literalCount;
+
+	if (matchLength == 0)
+		return true;
+	if (end - out < 2)
+		return false;
+	*out++ = (char)(offset & 0xff);
+	*out++ = (char)(offset >> 8);
+	return matchCode < 15 || write_length(out, end, matchCode - 15);
+}
+
+unsigned int lz_compress(const char *in, unsigned int size, char *out, unsigned int capacity, const CompressionDictionary *dict)
+{
+	// Positions count from the start of the dictionary, the input follows it
+	uint16_t table[LZ_HASH_SIZE];
+	const char *dictData = nullptr;
+	unsigned int base = 0;
+	if (dict != nullptr && dict->size() > 0) {
+		memcpy(table, &dict->m_table[0], sizeof(table));
+		dictData = dict->data();
+		base = dict->size();
+	} else {
+		memset(table, 0, sizeof(table));
+	}
+	// The positions must fit the table
+	if (base + size >= 0xffff)
+		return 0;
+
+	char *op = out;
+	char *end = out + capacity;
+	unsigned int anchor = 0;
+	unsigned int i = 0;
+	while (i + LZ_MIN_MATCH <= size) {
+		unsigned int h = lz_hash(in + i);
+		unsigned int candidate = table[h];
+		table[h] = (uint16_t)(base + i + 1);
+
+		if (candidate != 0) {
+			unsigned int pos = candidate - 1;
+			const char *match = pos < base ? dictData + pos : in + pos - base;
+			// Dictionary matches stop at its end
+			unsigned int limit = pos < base ? std::min(base - pos, size - i) : size - i;
+			if (limit >= LZ_MIN_MATCH && read32(match) == read32(in + i)) {
+				unsigned int length = LZ_MIN_MATCH;
+				while (length < limit && match[length] == in[i + length])
+					length++;
+				if (!write_sequence(op, end, in + anchor, i - anchor, base + i - pos, length))
+					return 0;
+				i += length;
+				anchor = i;
+				continue;
+			}
+		}
+		i++;
+	}
+
+	if (!write_sequence(op, end, in + anchor, size - anchor, 0, 0))
+		return 0;
+	return (unsigned int)(op - out);
+}
+
+bool lz_decompress(const char *in, unsigned int size, char *out, unsigned int capacity, const CompressionDictionary *dict, unsigned int& outSize)
+{
+	const char *dictData = dict != nullptr ? dict->data() : nullptr;
+	unsigned int dictSize = dict != nullptr ? dict->size() : 0;
+
+	const char *ip = in;
+	const char *inEnd = in + size;
+	unsigned int op = 0;
+	while (ip != inEnd) {
+		unsigned int token = (unsigned char)*ip++;
+
+		unsigned int literals = token >> 4;
+		if (literals == 15 && !read_length(ip, inEnd, literals))
+			return false;
+		if ((unsigned int)(inEnd - ip) < literals || capacity - op < literals)
+			return false;
+		memcpy(out + op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		// The last sequence has no match
+		if (ip == inEnd)
+			break;
+
+		if (inEnd - ip < 2)
+			return false;
+		unsigned int offset = (unsigned char)ip[0] | ((unsigned int)(unsigned char)ip[1] << 8);
+		ip += 2;
+		unsigned int length = token & 15;
+		if (length == 15 && !read_length(ip, inEnd, length))
+			return false;
+		length += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > op + dictSize || capacity - op < length)
+			return false;
+		// Byte by byte, the match may overlap the bytes it produces
+		for (unsigned int i = 0; i < length; i++, op++) {
+			if (offset > op)
+				out[op] = dictData[dictSize + op - offset];
+			else
+				out[op] = out[op - offset];
+		}
+	}
+
+	outSize = op;
+	return true;
+}
+
+AdaptiveCompressor::AdaptiveCompressor()
+	: m_enabled(false)
+	, m_dict(nullptr)
+	, m_skip(0)
+	, m_window_datagrams(0)
+	, m_window_in(0)
+	, m_window_out(0)
+	, m_window_ns(0)
+{
+}
+
+void AdaptiveCompressor::set_enabled(bool enabled, const CompressionDictionary *dict)
+{
+	m_enabled = enabled;
+	m_dict = dict;
+	m_skip = 0;
+	m_window_datagrams = 0;
+	m_window_in = m_window_out = m_window_ns = 0;
+}
+
+unsigned int AdaptiveCompressor::compress(const char *in, unsigned int size, char *out, unsigned int capacity)
+{
+	if (m_buffer.size() < lz_max_size(size))
+		m_buffer.resize(lz_max_size(size));
+
+	auto begin = std::chrono::high_resolution_clock::now();
+	unsigned int compressed = lz_compress(in, size, &m_buffer[0], std::min(capacity, size), m_dict);
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - begin).count();
+
+	// Sent as it is if not smaller
+	if (compressed == 0 || compressed >= size)
+		compressed = 0;
+
+	m_stats.datagrams++;
+	m_stats.bytes_in += size;
+	m_stats.bytes_out += compressed ? compressed : size;
+	m_stats.nanoseconds += ns;
+	m_window_in += size;
+	m_window_out += compressed ? compressed : size;
+	m_window_ns += ns;
+	if (++m_window_datagrams == COMPRESSION_WINDOW)
+		evaluate();
+
+	if (compressed == 0)
+		return 0;
+	m_stats.compressed++;
+	memcpy(out, &m_buffer[0], compressed);
+	return compressed;
+}
+
+bool AdaptiveCompressor::decompress(const char *in, unsigned int size, char *out, unsigned int capacity, unsigned int& outSize) const
+{
+	return lz_decompress(in, size, out, capacity, m_dict, outSize);
+}
+
+void AdaptiveCompressor::skipped()
+{
+	if (m_skip > 0)
+		m_skip--;
+}
+
+void AdaptiveCompressor::evaluate()
+{
+	unsigned long long saved = m_window_in - m_window_out;
+	if (saved * 100 < m_window_in * COMPRESSION_MIN_SAVING_PERCENT
+	 || m_window_ns > saved * COMPRESSION_MAX_NS_PER_SAVED_BYTE) {
+		m_skip = COMPRESSION_RETRY_DATAGRAMS;
+		m_stats.disabled++;
+	}
+	m_window_datagrams = 0;
+	m_window_in = m_window_out = m_window_ns = 0;
+}
\ No newline at end of file
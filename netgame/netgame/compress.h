@@ -0,0 +1,146 @@
+#ifndef _NETGAME_COMPRESS_H
+#define _NETGAME_COMPRESS_H
+
+#include <cstdint>
+#include <vector>
+
+#include "packet.h"
+
+// LZ77 codec for datagram bodies (LZ4 style sequences)
+// Every sequence is a token (4 bits literal count, 4 bits match length - 4), the
+// literals and a 2 byte offset back into the output (or into the dictionary before it)
+// The last sequence has only literals
+
+// Shortest match worth a sequence
+const unsigned int LZ_MIN_MATCH = 4;
+
+// Bits of the match finder hash
+const unsigned int LZ_HASH_BITS = 11;
+const unsigned int LZ_HASH_SIZE = 1 << LZ_HASH_BITS;
+
+// Largest dictionary, matches reach at most 65535 bytes back
+const unsigned int MAX_DICTIONARY_SIZE = 32768;
+
+// Upper bound for the compressed size of `size` bytes
+inline unsigned int lz_max_size(unsigned int size)
+{
+	return size + size / 255 + 16;
+}
+
+// Bytes the compressor can reference without sending them (eg. common message
+// layouts), both ends must use the same one
+class CompressionDictionary
+{
+public:
+	CompressionDictionary();
+	// The last `MAX_DICTIONARY_SIZE` bytes of `data` are used
+	CompressionDictionary(const char *data, unsigned int size);
+
+	// Build a dictionary of at most `size` bytes from payloads captured from the traffic
+	// Picks the segments of the samples with the most common substrings
+	static CompressionDictionary train(const std::vector<Packet>& samples, unsigned int size);
+
+	const char *data() const { return m_data.empty() ? nullptr : &m_data[0]; }
+	unsigned int size() const { return (unsigned int)m_data.size(); }
+
+private:
+	friend unsigned int lz_compress(const char *in, unsigned int size, char *out, unsigned int capacity, const CompressionDictionary *dict);
+
+	std::vector<char> m_data;
+	// Match finder table with the dictionary positions (+1, 0 is empty)
+	std::vector<uint16_t> m_table;
+};
+
+// Compress `in` to `out`, returns the compressed size or 0 if it doesn't fit `capacity`
+unsigned int lz_compress(const char *in, unsigned int size, char *out, unsigned int capacity, const CompressionDictionary *dict);
+
+// Decompress `in` to `out`, fails if the result doesn't fit `capacity`
+bool lz_decompress(const char *in, unsigned int size, char *out, unsigned int capacity, const CompressionDictionary *dict, unsigned int& outSize);
+
+// Counters of an `AdaptiveCompressor`
+struct CompressionStats
+{
+	CompressionStats()
+		: datagrams(0)
+		, compressed(0)
+		, bytes_in(0)
+		, bytes_out(0)
+		, nanoseconds(0)
+		, disabled(0)
+	{ }
+
+	// Compressed size / original size of the datagrams that were tried
+	double ratio() const { return bytes_in ? (double)bytes_out / bytes_in : 1.0; }
+
+	// Datagrams tried and those sent compressed
+	unsigned long long datagrams;
+	unsigned long long compressed;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	// Time spent compressing
+	unsigned long long nanoseconds;
+	// Times compression was turned off for not paying off
+	unsigned long long disabled;
+};
+
+// Datagrams between checks whether the compression pays off
+const unsigned int COMPRESSION_WINDOW = 64;
+
+// Compression is turned off if it saves less than this share of the bytes (in percent)
+const unsigned int COMPRESSION_MIN_SAVING_PERCENT = 5;
+
+// or if every saved byte costs more than this much compression time
+const unsigned int COMPRESSION_MAX_NS_PER_SAVED_BYTE = 100;
+
+// Datagrams sent uncompressed before trying again
+const unsigned int COMPRESSION_RETRY_DATAGRAMS = 1024;
+
+// Bodies smaller than this are never compressed
+const unsigned int COMPRESSION_MIN_SIZE = 32;
+
+// Compresses datagrams while it pays for its CPU time
+// Turns itself off for a while when the traffic doesn't compress well enough
+class AdaptiveCompressor
+{
+public:
+	AdaptiveCompressor();
+
+	// `dict` may be null, else it must outlive the compressor
+	void set_enabled(bool enabled, const CompressionDictionary *dict);
+	bool enabled() const { return m_enabled; }
+
+	// Whether the next datagram should be compressed
+	bool active() const { return m_enabled && m_skip == 0; }
+
+	// Compress `in` to `out` if it makes it smaller (else count a datagram sent as it is)
+	// Returns the compressed size or 0 if `in` should be sent as it is
+	unsigned int compress(const char *in, unsigned int size, char *out, unsigned int capacity);
+
+	bool decompress(const char *in, unsigned int size, char *out, unsigned int capacity, unsigned int& outSize) const;
+
+	// Count a datagram sent uncompressed without trying (while off or too small)
+	void skipped();
+
+	const CompressionStats& stats() const { return m_stats; }
+
+private:
+	// Decide whether to stay on at the end of a window
+	void evaluate();
+
+	bool m_enabled;
+	const CompressionDictionary *m_dict;
+	// Datagrams left to send uncompressed before trying again
+	unsigned int m_skip;
+
+	CompressionStats m_stats;
+	// Counters of the current window
+	unsigned int m_window_datagrams;
+	unsigned long long m_window_in;
+	unsigned long long m_window_out;
+	unsigned long long m_window_ns;
+
+	// The compressed body before it's known to be smaller
+	std::vector<char> m_buffer;
+};
+
+#endif
\ No newline at end of file
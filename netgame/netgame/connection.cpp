@@ -1,174 +1,517 @@
 #include "connection.h"
 #include "packet.h"
+#include "packer.h"
 
 #include <utility>
 #include <algorithm>
-#include <netlib/serialization.h>
+#include <cstring>
 
-Connection::Connection(const Address& addr, magic_t magic)
+#include "util.h"
+
+// The header flags are the first bits after the magic number
+static const unsigned int FLAGS_BYTE = sizeof(magic_t);
+static const char COMPRESSED_FLAG = 1;
+static const char PROBE_FLAG = 2;
+
+// Sequence numbers are sent truncated to the low bits of one of these widths
+// The receiver takes the sequence closest to one it knows the sender is near of
+static const unsigned int SEQ_WIDTHS[] = { 8, 16, 32 };
+static const unsigned int NUM_SEQ_WIDTHS = sizeof(SEQ_WIDTHS) / sizeof(SEQ_WIDTHS[0]);
+
+// Write `seq`, at most `distance` away from the receiver's reference
+static void write_seq(BitWriter& w, seq_t seq, seq_t distance)
+{
+	unsigned int width = 0;
+	// Use a quarter of the range to leave room for reordered packets
+	while (width < NUM_SEQ_WIDTHS - 1 && distance >= 1u << (SEQ_WIDTHS[width] - 2))
+		width++;
+	w.write_bounded(width, 0, NUM_SEQ_WIDTHS - 1);
+	w.write_bits(seq, SEQ_WIDTHS[width]);
+}
+
+// Read a sequence written by `write_seq()` for a receiver at `reference`
+// The sender picks the width so the sequence is less than a quarter of the range
+// ahead of the reference, one further ahead is a packet delayed so long its low bits
+// wrapped around: fails rather than take it for a future one
+static bool read_seq(BitReader& r, seq_t reference, seq_t& seq)
+{
+	uint32_t width, bits;
+	if (!r.read_bounded(width, 0, NUM_SEQ_WIDTHS - 1) || !r.read_bits(bits, SEQ_WIDTHS[width]))
+		return false;
+	if (SEQ_WIDTHS[width] == 32) {
+		seq = bits;
+		return true;
+	}
+
+	int64_t range = 1ll << SEQ_WIDTHS[width];
+	int64_t ref = reference;
+	int64_t value = (ref & ~(range - 1)) | bits;
+	if (value + range / 2 < ref && value + range <= UINT32_MAX)
+		value += range;
+	else if (value > ref + range / 2 && value >= range)
+		value -= range;
+	if (value >= ref + range / 4)
+		return false;
+	seq = (seq_t)value;
+	return true;
+}
+
+const seq_t *MessageHeaderContext::last_seq(channel_id_t chan) const
+{
+	for (auto& s : m_seqs) {
+		if (s.first == chan)
+			return &s.second;
+	}
+	return nullptr;
+}
+
+void MessageHeaderContext::add(channel_id_t chan, seq_t seq)
+{
+	m_prev_chan = chan;
+	for (auto& s : m_seqs) {
+		if (s.first == chan) {
+			s.second = seq;
+			return;
+		}
+	}
+	m_seqs.push_back(std::make_pair(chan, seq));
+}
+
+Connection::Connection(const Address& addr, magic_t magic, net_time now)
 	: m_magic(magic)
 	, m_address(addr)
-	, m_sequence(0)
+	, m_last_received(now)
+	, m_window_budget(RECEIVE_WINDOW_BUDGET)
+	, m_sequence(1)
+	, m_send_interval(std::chrono::duration_cast<net_duration>(std::chrono::seconds(1)) / DEFAULT_SEND_RATE)
 	, m_out_ack(0)
 	, m_out_ack_bits(0)
-	, m_packet_pool(MAX_PACKET_SIZE)
-#ifdef _DEBUG
-	, m_DEBUG_packet_loss(0.0f)
-#endif
+	, m_sent(SENT_PACKETS_WINDOW)
+	, m_sent_oldest(1)
+	, m_header_size(0)
+	, m_gather_size(0)
+	, m_remote_ack(0)
+	, m_ack_base(0)
+	, m_last_sample(0)
+	, m_packet_pool(MAX_PACKET_SIZE, MAX_MESSAGE_SIZE)
 {
+	m_rtt.set_granularity(m_send_interval);
+
 	// Create control channels
-	m_channels_in[0].reset(new ChannelIn(Channel::SEQUENTIAL));
-	m_channels_out[0].reset(new ChannelOut(Channel::SEQUENTIAL));
+	add_channel(0, Channel::SEQUENTIAL);
 }
 
 // = default
 Connection::Connection(Connection&& c)
 	: m_magic(c.m_magic)
 	, m_address(std::move(c.m_address))
+	, m_last_received(c.m_last_received)
 	, m_channels_in(std::move(c.m_channels_in))
 	, m_channels_out(std::move(c.m_channels_out))
+	, m_window_budget(c.m_window_budget)
 	, m_sequence(c.m_sequence)
+	, m_send_interval(c.m_send_interval)
 	, m_out_ack(c.m_out_ack)
 	, m_out_ack_bits(c.m_out_ack_bits)
-	, m_sent(std::move(m_sent))
-	, m_packet_pool(std::move(m_packet_pool))
+	, m_sent(std::move(c.m_sent))
+	, m_sent_oldest(c.m_sent_oldest)
+	, m_sent_messages(std::move(c.m_sent_messages))
+	, m_header(std::move(c.m_header))
+	, m_header_size(c.m_header_size)
+	, m_gather(std::move(c.m_gather))
+	, m_gather_size(c.m_gather_size)
+	, m_remote_ack(c.m_remote_ack)
+	, m_ack_base(c.m_ack_base)
+	, m_rtt(c.m_rtt)
+	, m_bandwidth(c.m_bandwidth)
+	, m_mtu(c.m_mtu)
+	, m_compressor(std::move(c.m_compressor))
+	, m_compress_buffer(std::move(c.m_compress_buffer))
+	, m_metrics(std::move(c.m_metrics))
+	, m_last_sample(c.m_last_sample)
+	, m_publisher(std::move(c.m_publisher))
+	, m_packet_pool(std::move(c.m_packet_pool))
 {
+	// The channels allocate from the pool of the owning connection
+	for (auto& chan : m_channels_in)
+		chan.set_pool(m_packet_pool);
+	for (auto& chan : m_channels_out)
+		chan.set_pool(m_packet_pool);
 }
 
 Connection& Connection::operator=(Connection c)
 {
 	std::swap(m_magic, c.m_magic);
 	std::swap(m_address, c.m_address);
+	std::swap(m_last_received, c.m_last_received);
 	m_channels_in.swap(c.m_channels_in);
 	m_channels_out.swap(c.m_channels_out);
+	std::swap(m_window_budget, c.m_window_budget);
 	std::swap(m_sequence, c.m_sequence);
+	std::swap(m_send_interval, c.m_send_interval);
 	std::swap(m_out_ack, c.m_out_ack);
 	std::swap(m_out_ack_bits, c.m_out_ack_bits);
-	m_sent.swap(c.m_sent);
+	std::swap(m_sent, c.m_sent);
+	std::swap(m_sent_oldest, c.m_sent_oldest);
+	m_sent_messages.swap(c.m_sent_messages);
+	m_header.swap(c.m_header);
+	std::swap(m_header_size, c.m_header_size);
+	m_gather.swap(c.m_gather);
+	std::swap(m_gather_size, c.m_gather_size);
+	std::swap(m_remote_ack, c.m_remote_ack);
+	std::swap(m_ack_base, c.m_ack_base);
+	std::swap(m_rtt, c.m_rtt);
+	std::swap(m_bandwidth, c.m_bandwidth);
+	std::swap(m_mtu, c.m_mtu);
+	std::swap(m_compressor, c.m_compressor);
+	m_compress_buffer.swap(c.m_compress_buffer);
+	std::swap(m_metrics, c.m_metrics);
+	std::swap(m_last_sample, c.m_last_sample);
+	m_publisher.swap(c.m_publisher);
 	std::swap(m_packet_pool, c.m_packet_pool);
 
+	for (auto& chan : m_channels_in)
+		chan.set_pool(m_packet_pool);
+	for (auto& chan : m_channels_out)
+		chan.set_pool(m_packet_pool);
+	for (auto& chan : c.m_channels_in)
+		chan.set_pool(c.m_packet_pool);
+	for (auto& chan : c.m_channels_out)
+		chan.set_pool(c.m_packet_pool);
+
 	return *this;
 }
 
-bool Connection::process_packet(const Packet& packet)
+bool Connection::process_packet(const Packet& packet, net_time now)
 {
-	// Ignore the packet if simulating packet loss
-#ifdef _DEBUG
-	if ((float)rand() / RAND_MAX < m_DEBUG_packet_loss)
-		return false;
-#endif
+	m_metrics.datagrams_received++;
+	m_metrics.bytes_received += packet.size();
 
-	NetReader reader = packet.read();
+	BitReader reader(packet.data(), packet.size());
 	magic_t magic;
 
 	// Do not process packets that don't start with the magic number
-	if (!reader.read(magic))
+	if (!reader.read_bits(magic, sizeof(magic_t) * CHAR_BIT) || magic != m_magic) {
+		m_metrics.rejected++;
 		return false;
-	if (magic != m_magic)
+	}
+
+	bool compressed, probe;
+	if (!reader.read_bool(compressed) || !reader.read_bool(probe)) {
+		m_metrics.rejected++;
 		return false;
+	}
 
+	// The sequence is near the next one we expect, the ack near the newest one we have
 	seq_t remote_seq;
 	seq_t ack;
-	ack_bitfield_t ack_bitfield;
-
-	if (!reader.read(remote_seq)
-	 || !reader.read(ack)
-	 || !reader.read(ack_bitfield))
+	ack_bitfield_t ack_bitfield = ~0u;
+	bool allAcked;
+
+	// A packet delayed long enough for the short sequences to wrap around decodes
+	// ahead of where the sender can be, or acknowledges packets we never sent
+	if (!read_seq(reader, m_out_ack + 1, remote_seq)
+	 || !read_seq(reader, m_remote_ack, ack)
+	 || ack >= m_sequence
+	 || !reader.read_bool(allAcked)
+	 || (!allAcked && !reader.read_bits(ack_bitfield, ACKS_PER_BITFIELD))) {
+		m_metrics.rejected++;
 		return false;
+	}
 
-	// Remove acknowledged packets from the re-send list
-	for (int i = 0; i < ACKS_PER_BITFIELD + 1; i++) {
-		if ((ack_bitfield & 1) == 0 && i != 0)
-			continue;
-
-		auto it = m_sent.find(ack);
-		if (it != m_sent.end())
-			m_sent.erase(it);
-
-		ack--;
-		if (i != 0)
-			ack_bitfield >>= 1;
+	// Read the body before acknowledging anything, the sender never resends what
+	// we ack so a body we can't parse has to look lost to it (a probe only carries padding)
+	Packet body = packet;
+	unsigned int offset = reader.byte_position();
+	if (!probe && compressed) {
+		// The messages reference the decompressed copy
+		Packet buffer = m_packet_pool.allocate_buffer(MAX_PACKET_SIZE);
+		unsigned int size;
+		if (!m_compressor.decompress(packet.data() + offset, packet.size() - offset, buffer.data(), buffer.size(), size)) {
+			m_metrics.rejected++;
+			return false;
+		}
+		body = buffer.subpacket(0, size);
+		offset = 0;
+	}
+	if (!probe && !read_messages(body, offset, false)) {
+		m_metrics.rejected++;
+		return false;
 	}
+	m_last_received = now;
 
-	// Update the outgoing ack
+	// Update the outgoing ack, drop duplicates
 	if (remote_seq > m_out_ack) {
-		m_out_ack_bits <<= remote_seq - m_out_ack;
-		m_out_ack_bits |= 1 << (remote_seq - m_out_ack - 1);
+		seq_t shift = remote_seq - m_out_ack;
+		m_out_ack_bits = shift < ACKS_PER_BITFIELD ? m_out_ack_bits << shift : 0;
+		if (m_out_ack != 0 && shift <= ACKS_PER_BITFIELD)
+			m_out_ack_bits |= 1u << (shift - 1);
 		m_out_ack = remote_seq;
+	} else if (remote_seq < m_out_ack && m_out_ack - remote_seq <= ACKS_PER_BITFIELD) {
+		ack_bitfield_t bit = 1u << (m_out_ack - remote_seq - 1);
+		if (m_out_ack_bits & bit) {
+			m_metrics.duplicates++;
+			return false;
+		}
+		m_out_ack_bits |= bit;
 	} else {
-		m_out_ack_bits |= 1 << (m_out_ack - remote_seq - 1);
+		// Already received (or too old to tell)
+		m_metrics.duplicates++;
+		return false;
 	}
 
+	// Remove acknowledged packets from the re-send list
+	// Only the newest ack is timed, the older ones may have waited for a lost ack
+	if (ack > m_remote_ack) {
+		m_remote_ack = ack;
+		ack_packet(ack, now, true);
+	}
+	while (ack_bitfield != 0) {
+		unsigned int i = lowest_bit(ack_bitfield);
+		ack_bitfield &= ack_bitfield - 1;
+		ack_packet(ack - 1 - i, now, false);
+	}
+
+	// Packets enough older than the newest ack still not acknowledged are lost
+	for (; m_sent_oldest + LOSS_ACK_THRESHOLD <= m_remote_ack; m_sent_oldest++)
+		resend_packet(m_sent_oldest, now);
+
+	if (!probe)
+		read_messages(body, offset, true);
 	return true;
 }
 
-struct SendPacket
+bool Connection::read_messages(const Packet& packet, unsigned int offset, bool deliver)
 {
-	SendPacket(channel_id_t ch, ChannelOut::OutgoingPacket&& p)
-		: chan(ch)
-		, seq(p.seq)
-		, packet(std::move(p.packet))
-	{
+	BitReader reader(packet.data() + offset, packet.size() - offset);
+	MessageHeaderContext context;
+
+	// The messages go on to the end of the packet
+	while (reader.bits_left() > 0) {
+		bool fragmented, sameChannel;
+		uint32_t parts = 1;
+		uint32_t part = 0;
+		uint32_t chan, seq, size;
+
+		if (!reader.read_bool(fragmented) || !reader.read_bool(sameChannel))
+			return false;
+		if (fragmented && (!reader.read_bits(parts, FRAGMENT_ID_BITS) || !reader.read_bits(part, FRAGMENT_ID_BITS)))
+			return false;
+		if (fragmented)
+			parts++;
+		if (part >= parts)
+			return false;
+
+		if (sameChannel) {
+			if (context.empty())
+				return false;
+			chan = context.prev_channel();
+		} else if (!reader.read_varint(chan) || chan > USHRT_MAX) {
+			return false;
+		}
+
+		const seq_t *last = context.last_seq((channel_id_t)chan);
+		if (last != nullptr) {
+			int32_t delta;
+			if (!reader.read_signed_varint(delta))
+				return false;
+			seq = *last + delta;
+		} else if (!reader.read_varint(seq)) {
+			return false;
+		}
+		context.add((channel_id_t)chan, seq);
+
+		if (!reader.read_varint(size))
+			return false;
+		unsigned int start = reader.byte_position();
+		if (!reader.skip_bytes(size))
+			return false;
+		if (!deliver)
+			continue;
+		Packet data = packet.subpacket(offset + start, size);
+
+		// An empty STREAM message is how far the other end has read our stream
+		if (size == 0) {
+			ChannelOut *out = get_channel_out_by_id((channel_id_t)chan);
+			if (out != nullptr && out->type() == Channel::STREAM) {
+				out->stream_read(seq);
+				continue;
+			}
+		}
+
+		ChannelIn *channel = get_channel_in_by_id((channel_id_t)chan);
+		if (channel == nullptr)
+			continue;
+		channel->m_metrics.messages_received++;
+		channel->m_metrics.bytes_received += size;
+		if (parts > 1)
+			m_metrics.fragments_received++;
+
+		if (parts == 1) {
+			channel->add_packet(seq, data, m_window_budget);
+		} else {
+			// The fragments reference the datagram, the start offset is implied by their order
+			channel->add_fragment(seq, data, (fragment_id_t)part, (fragment_id_t)parts, m_window_budget);
+		}
 	}
-	SendPacket(SendPacket&& p)
-		: seq(p.seq)
-		, packet(std::move(p.packet))
-		, chan(p.chan)
-	{
+	return true;
+}
+
+void Connection::ack_packet(seq_t seq, net_time now, bool sample)
+{
+	SentPacket *sent = m_sent.find(seq);
+	if (sent == nullptr)
+		return;
+	// Every packet is sent once (resent messages go to new packets) so the sample is never ambiguous
+	if (sample) {
+		net_duration rtt = now - sent->time;
+		m_rtt.add_sample(rtt);
+		if (m_metrics.rtt.count != 0)
+			m_metrics.jitter.add(std::chrono::duration_cast<std::chrono::microseconds>(rtt > m_last_sample ? rtt - m_last_sample : m_last_sample - rtt).count());
+		m_metrics.rtt.add(std::chrono::duration_cast<std::chrono::microseconds>(rtt).count());
+		m_last_sample = rtt;
 	}
-	SendPacket& operator=(SendPacket p)
-	{
-		seq = p.seq;
-		std::swap(packet, p.packet);
-		chan = p.chan;
-		return *this;
+	if (sent->ack > m_ack_base)
+		m_ack_base = sent->ack;
+	if (sent->probe)
+		m_mtu.probe_acked(sent->size, now);
+	else
+		m_mtu.packet_acked(sent->size);
+	m_bandwidth.on_acked(sent->size, now, m_rtt.srtt());
+	for (auto& msg : sent->messages) {
+		if (!msg.wants_ack)
+			continue;
+		ChannelOut *channel = get_channel_out_by_id(msg.chan);
+		if (channel != nullptr)
+			channel->acked(msg.seq, msg.part, msg.parts);
 	}
+	sent->messages.clear();
+	m_sent.remove(seq);
+}
 
-	bool operator <(unsigned int u) const {
-		return packet.size() < u;
-	}
+bool Connection::resend_packet(seq_t seq, net_time now)
+{
+	SentPacket *sent = m_sent.find(seq);
+	if (sent == nullptr)
+		return false;
 
-	seq_t seq;
-	Packet packet;
-	channel_id_t chan;
-};
+	// A lost probe says nothing about congestion
+	if (sent->probe) {
+		m_mtu.probe_lost(sent->size, now);
+		m_sent.remove(seq);
+		return false;
+	}
+	m_bandwidth.on_lost(now, m_rtt.srtt());
+	m_metrics.packets_lost++;
+
+	// If the size fell back the fragments queued to be resent may not fit anymore
+	bool fellBack = m_mtu.packet_lost(sent->size, now);
+	unsigned int fragmentSize = max_fragment_size(m_mtu.packet_size());
+	if (fellBack) {
+		for (auto& chan : m_channels_out)
+			chan.split_queued(fragmentSize);
+	}
 
-inline bool can_fit_any(unsigned int offset)
-{
-	// Can fit at least one byte
-	return offset + MSG_HEADER_SIZE < MAX_PACKET_SIZE - 1;
+	for (auto& msg : sent->messages) {
+		ChannelOut *channel = get_channel_out_by_id(msg.chan);
+		if (channel == nullptr || !msg.reliable)
+			continue;
+		channel->m_metrics.messages_resent++;
+		if (msg.parts > 1) {
+			channel->resend_fragment(ChannelOut::OutgoingPacket(msg.seq, std::move(msg.packet), msg.part, msg.parts, msg.message), fragmentSize);
+		} else {
+			channel->m_outgoing.push_front(ChannelOut::OutgoingPacket(msg.seq, std::move(msg.packet)));
+		}
+	}
+	sent->messages.clear();
+	m_sent.remove(seq);
+	return true;
 }
 
-inline unsigned int fragment_count(unsigned int offset, unsigned int size)
+void Connection::schedule_messages(Packer& packer)
 {
-	return (size - (MAX_PACKET_SIZE - MSG_HEADER_SIZE - offset)) / MAX_UNFRAGMENTED_MESSAGE_SIZE + 1;
+	// Keep enough stream chunks in flight to fill the path for two round trips
+	double rtt = std::chrono::duration<double>(m_rtt.has_sample() ? m_rtt.srtt() : m_rtt.rto()).count();
+	double window = std::min<double>(m_bandwidth.rate() * rtt * 2 / m_mtu.packet_size(), STREAM_MAX_WINDOW);
+	unsigned int chunkSize = max_single_packet_message_size(m_mtu.packet_size());
+	for (auto& chan : m_channels_out) {
+		if (chan.type() == Channel::STREAM)
+			chan.fill_stream(std::max((unsigned int)window, STREAM_MIN_WINDOW), chunkSize);
+	}
+	// Tell the other end how far its streams have been read (tiny, outside the budget)
+	for (size_t id = 0; id < m_channels_in.size(); id++) {
+		seq_t read;
+		if (m_channels_in[id].type() == Channel::STREAM && m_channels_in[id].stream_update(read))
+			packer.add(SendPacket((channel_id_t)id, false, false, ChannelOut::OutgoingPacket(read, Packet())));
+	}
+
+	// Channels with messages waiting gain their priority every tick, the others start over
+	for (auto& channel : m_channels_out) {
+		if (channel.pending())
+			channel.m_accumulator += channel.m_priority;
+		else
+			channel.m_accumulator = 0.0f;
+	}
+
+	// Take the messages one by one from the channel with the highest accumulator,
+	// every message costs its channel priority so the others get their turn
+	// (the last message may overdraw the budget, the next ticks pay it back)
+	long long budget = m_bandwidth.available();
+	while (budget > 0) {
+		channel_id_t id = 0;
+		ChannelOut *best = nullptr;
+		for (size_t i = 0; i < m_channels_out.size(); i++) {
+			ChannelOut *channel = &m_channels_out[i];
+			if (channel->pending() && (best == nullptr || channel->m_accumulator > best->m_accumulator)) {
+				id = (channel_id_t)i;
+				best = channel;
+			}
+		}
+		if (best == nullptr)
+			break;
+
+		SendPacket p(id, best->is_reliable(), best->wants_acks(), std::move(best->m_outgoing.front()));
+		best->m_outgoing.pop_front();
+		best->m_metrics.messages_sent++;
+		best->m_metrics.bytes_sent += p.packet.size();
+		// A full datagram costs one tick of priority
+		unsigned int cost = p.wire_size() + MSG_HEADER_SIZE;
+		budget -= cost;
+		best->m_accumulator -= (float)cost / m_mtu.packet_size();
+		packer.add(std::move(p));
+	}
 }
 
-void Connection::send_outgoing(Socket& socket)
+void Connection::send_outgoing(Transport& transport, net_time now)
 {
-	// Collect all packets to send
-	std::vector<SendPacket> send_reliable;
-	std::vector<SendPacket> send_unreliable;
-	for (auto& chan : m_channels_out)
-	{
-		auto& src = chan.second->m_outgoing;
-		auto& dst = chan.second->is_reliable() ? send_reliable : send_unreliable;
-		for (auto& packet : src) {
-			dst.push_back(SendPacket(chan.first, std::move(packet)));
+	// Resend the packets that have not been acknowledged in time
+	// (the oldest packets are first so stop at the first one still in time)
+	bool timedOut = false;
+	for (; m_sent_oldest != m_sequence; m_sent_oldest++) {
+		SentPacket *sent = m_sent.find(m_sent_oldest);
+		if (sent == nullptr)
+			continue;
+		if (now - sent->time < m_rtt.rto())
+			break;
+		if (resend_packet(m_sent_oldest, now)) {
+			m_metrics.timeouts++;
+			timedOut = true;
 		}
-		src.clear();
 	}
+	if (timedOut)
+		m_rtt.backoff();
 
-	// Sort by size (descending)
-	std::sort(send_reliable.begin(), send_reliable.end(),
-		[](const ChannelOut::OutgoingPacket& a,
-		   const ChannelOut::OutgoingPacket& b) {
-			   return a.packet.size() > b.packet.size();
-	});
+	// Pick the messages to send within the budget
+	// Unreliable packets are packed the same way, they are just never resent
+	m_bandwidth.refill(now, m_send_interval);
+	unsigned int packetSize = m_mtu.packet_size();
+	Packer packer(packetSize);
+	schedule_messages(packer);
 
-	NetWriter writer(m_packet_pool.nextData(), MAX_PACKET_SIZE);
+	BitWriter writer(m_packet_pool.nextData(), packetSize);
 
 	add_packet_header(writer);
+	bool sent = false;
 
 	// Packet fill algorithm
 	// P := largest packet
@@ -187,101 +530,297 @@ void Connection::send_outgoing(Socket& socket)
 	//        else
 	//          P := largest packet
 
-	std::vector<SendPacket>::iterator P;
-
-	P = send_reliable.begin();
-	while (!send_reliable.empty()) {
-		unsigned int fragc = fragment_count(writer.write_amount(), P->packet.size());
-		unsigned int start = 0;
-		for (unsigned int i = 0; i < fragc - 1; i++) {
-			start += add_packet(writer, P->chan, P->packet, start, fragc);
-			send_packet(writer);
-		}
-		add_packet(writer, P->chan, P->packet, start, fragc);
-		send_reliable.erase(P);
-
-		auto pos = writer.write_amount();
-		while (can_fit_any(pos)) {
-			auto it = std::find_if(send_reliable.begin(), send_reliable.end(),
-				[=](const SendPacket& p) {
-					return fragment_count(pos, p.packet.size()) == 1;
-			});
-			if (it != send_reliable.end()) {
-				add_packet(writer, it->chan, it->packet, 0, 1);
-				send_reliable.erase(it);
-			} else {
-				break;
+	SendPacket P, Q;
+	bool haveP = packer.take_largest(P);
+	while (haveP) {
+		if (P.is_fragment()) {
+			// A resent fragment always starts a packet and fits it whole
+			add_packet(writer, P, 0, P.frag_index, P.frag_count);
+		} else {
+			unsigned int fragc = fragment_count(packet_size(writer), P.packet.size(), packetSize);
+			unsigned int start = 0;
+			for (unsigned int i = 0; i < fragc - 1; i++) {
+				start += add_packet(writer, P, start, i, fragc);
+				send_packet(writer, transport, now);
 			}
-			pos = writer.write_amount();
+			add_packet(writer, P, start, fragc - 1, fragc);
 		}
 
-		if (can_fit_any(pos)) {
-			auto it = std::find_if(send_reliable.begin(), send_reliable.end(),
-				[=](const SendPacket& p) {
-					return fragment_count(pos, p.packet.size()) < fragment_count(0, p.packet.size());
-			});
-			if (it != send_reliable.end()) {
-				P = it;
-				continue;
-			}
+		auto pos = packet_size(writer);
+		while (can_fit_any(pos, packetSize) && packer.take_fitting(pos, Q)) {
+			if (Q.is_fragment())
+				add_packet(writer, Q, 0, Q.frag_index, Q.frag_count);
+			else
+				add_packet(writer, Q, 0, 0, 1);
+			pos = packet_size(writer);
 		}
 
-		send_packet(writer);
-		P = send_reliable.begin();
+		if (can_fit_any(pos, packetSize) && packer.take_less_fragmented(pos, P))
+			continue;
+
+		send_packet(writer, transport, now);
+		sent = true;
+		haveP = packer.take_largest(P);
 	}
 
-	for (auto it = m_sent.begin(); it != m_sent.end();)
-	{
-		if (m_sequence - it->first > 30)
-			it = m_sent.erase(it);
+	// Always send at least one packet to carry the acks
+	if (!sent)
+		send_packet(writer, transport, now);
+
+	// Look for a larger packet size once the remote answers
+	unsigned int probe = m_mtu.probe_size(now);
+	if (probe != 0 && m_remote_ack != 0 && m_bandwidth.available() > 0)
+		send_probe(transport, probe, now);
+
+	m_packet_pool.trim();
+
+	if (m_publisher && m_publisher->wanted())
+		m_publisher->publish(metrics());
+}
+
+unsigned int Connection::add_packet(BitWriter& w, const SendPacket& m, unsigned int start, unsigned int part, unsigned int parts)
+{
+	unsigned int header = parts > 1 ? FRAG_MSG_HEADER_SIZE : MSG_HEADER_SIZE;
+	unsigned int size = std::min(m.packet.size() - start, m_mtu.packet_size() - header - packet_size(w));
+	// The packet header may be shorter than `HEADER_SIZE` now but not when the fragment is resent
+	if (parts > 1)
+		size = std::min(size, max_fragment_size(m_mtu.packet_size()));
+
+	w.write_bool(parts > 1);
+	w.write_bool(!m_header.empty() && m_header.prev_channel() == m.chan);
+	if (parts > 1) {
+		w.write_bits(parts - 1, FRAGMENT_ID_BITS);
+		w.write_bits(part, FRAGMENT_ID_BITS);
+	}
+	if (m_header.empty() || m_header.prev_channel() != m.chan)
+		w.write_varint(m.chan);
+	const seq_t *last = m_header.last_seq(m.chan);
+	if (last != nullptr)
+		w.write_signed_varint((int32_t)(m.seq - *last));
+	else
+		w.write_varint(m.seq);
+	m_header.add(m.chan, m.seq);
+	w.write_varint(size);
+	w.align();
+
+	m_metrics.payload_bytes += size;
+	if (parts > 1)
+		m_metrics.fragments_sent++;
+
+	if (size >= GATHER_MIN_SIZE) {
+		m_gather.push_back(GatherSlice(w.bytes_written(), m.packet.subpacket(start, size)));
+		m_gather_size += size;
+	} else if (size != 0) {
+		w.write_bytes(m.packet.data() + start, size);
+	}
+
+	// Remember the reliable data to resend it if the packet is lost
+	if (m.reliable) {
+		if (parts > 1)
+			m_sent_messages.push_back(SentMessage(m.chan, m.seq, true, m.wants_ack, m.packet.subpacket(start, size), part, parts, m.is_fragment() ? m.message : m.packet));
 		else
-			++it;
+			m_sent_messages.push_back(SentMessage(m.chan, m.seq, true, m.wants_ack, m.packet, 0, 1, Packet()));
+	} else if (m.wants_ack) {
+		m_sent_messages.push_back(SentMessage(m.chan, m.seq, false, true, Packet(), part, parts, Packet()));
+	}
+
+	return size;
+}
+
+void Connection::send_packet(BitWriter& w, Transport& transport, net_time now)
+{
+	unsigned int size = w.bytes_written();
+	// Compress the messages (a probe has only padding, which must keep its size)
+	if (m_compressor.active() && !m_header.empty() && packet_size(w) - m_header_size >= COMPRESSION_MIN_SIZE)
+		size = compress_packet(w);
+	else
+		m_compressor.skipped();
+
+	Packet packet = m_packet_pool.allocate(size);
+	unsigned int datagramSize = size + m_gather_size;
+	m_bandwidth.spend(datagramSize);
+	m_metrics.datagrams_sent++;
+	m_metrics.bytes_sent += datagramSize;
+
+	if (m_gather.empty()) {
+		transport.send(m_address, packet);
+	} else {
+		// Interleave the written headers with the gathered payloads
+		m_datagram.clear();
+		unsigned int offset = 0;
+		for (auto& slice : m_gather) {
+			m_datagram.append(packet.subpacket(offset, slice.offset - offset));
+			m_datagram.append(slice.packet);
+			offset = slice.offset;
+		}
+		if (offset < packet.size())
+			m_datagram.append(packet.subpacket(offset, packet.size() - offset));
+		transport.send_gather(m_address, m_datagram);
+		m_datagram.clear();
 	}
+	m_gather.clear();
+	m_gather_size = 0;
 
-	Packet packet = m_packet_pool.allocate(writer.write_amount());
+	// A packet still unacknowledged after a whole window is lost
+	if (m_sequence - m_sent_oldest >= m_sent.capacity()) {
+		resend_packet(m_sequence - m_sent.capacity(), now);
+		m_sent_oldest = m_sequence - m_sent.capacity() + 1;
+	}
 
-	// Don't send the packet if simulating packet loss
-#ifdef _DEBUG
-	if ((float)rand() / RAND_MAX >= m_DEBUG_packet_loss)
-#endif
-	socket.send_to(m_address, packet.data(), packet.size());
+	SentPacket& sent = m_sent.insert(m_sequence);
+	sent.time = now;
+	sent.ack = m_out_ack;
+	sent.size = datagramSize;
+	sent.probe = false;
+	sent.messages.swap(m_sent_messages);
+	m_sent_messages.clear();
+	m_sequence++;
+
+	// Start the next packet
+	w = BitWriter(m_packet_pool.nextData(), m_mtu.packet_size());
+	add_packet_header(w);
+}
 
-	m_sent[m_sequence] = SentPacket(packet, m_sequence);
+void Connection::send_probe(Transport& transport, unsigned int size, net_time now)
+{
+	// A packet without messages padded to `size`, its ack tells that the size got through
+	BitWriter w(m_packet_pool.nextData(), size);
+	add_packet_header(w);
+	m_packet_pool.nextData()[FLAGS_BYTE] |= PROBE_FLAG;
+	w.pad(size);
+	send_packet(w, transport, now);
+
+	m_sent.find(m_sequence - 1)->probe = true;
+	m_mtu.probe_sent();
+	m_metrics.probes_sent++;
 }
 
-void Connection::add_packet_header(NetWriter& w)
+unsigned int Connection::compress_packet(const BitWriter& w)
 {
-	w.write(m_magic);
-	w.write(m_sequence);
-	w.write(m_out_ack);
-	w.write(m_out_ack_bits);
+	char *data = m_packet_pool.nextData();
+	unsigned int written = w.bytes_written();
+
+	// Copy the body to one buffer with the gathered payloads between the written headers
+	char *body = &m_compress_buffer[0];
+	unsigned int size = 0;
+	unsigned int offset = m_header_size;
+	for (auto& slice : m_gather) {
+		memcpy(body + size, data + offset, slice.offset - offset);
+		size += slice.offset - offset;
+		memcpy(body + size, slice.packet.data(), slice.packet.size());
+		size += slice.packet.size();
+		offset = slice.offset;
+	}
+	memcpy(body + size, data + offset, written - offset);
+	size += written - offset;
+
+	unsigned int compressed = m_compressor.compress(body, size, data + m_header_size, m_mtu.packet_size() - m_header_size);
+	if (compressed == 0)
+		return written;
+
+	// The gathered payloads are part of the compressed body now
+	data[FLAGS_BYTE] |= COMPRESSED_FLAG;
+	m_gather.clear();
+	m_gather_size = 0;
+	return m_header_size + compressed;
 }
 
-ChannelIn *Connection::get_channel_in_by_id(channel_id_t id) const
+void Connection::set_compression(bool enabled, const CompressionDictionary *dictionary)
 {
-	auto it = m_channels_in.find(id);
-	if (it == m_channels_in.end())
-		return nullptr;
-	return it->second.get();
+	m_compressor.set_enabled(enabled, dictionary);
+	m_compress_buffer.resize(MAX_PACKET_SIZE);
 }
 
-ChannelOut *Connection::get_channel_out_by_id(channel_id_t id) const
+void Connection::set_send_rate(unsigned int hz)
 {
-	auto it = m_channels_out.find(id);
-	if (it == m_channels_out.end())
-		return nullptr;
-	return it->second.get();
+	m_send_interval = std::chrono::duration_cast<net_duration>(std::chrono::seconds(1)) / std::max(hz, 1u);
+	// The other end acks once per tick too (assuming it runs at the same rate)
+	m_rtt.set_granularity(m_send_interval);
 }
 
-#include <cstdio>
-void Connection::DEBUG_print_status()
+void Connection::add_packet_header(BitWriter& w)
 {
-	printf("%4d %4d %8d %8d ", m_packet_pool.numPages(), m_sent.size(), m_sequence, m_out_ack);
-	for (int i = 0; i < ACKS_PER_BITFIELD; i++) {
-		if (m_out_ack_bits & (1 << i))
-			putchar('#');
-		else
-			putchar(' ');
+	w.write_bits(m_magic, sizeof(magic_t) * CHAR_BIT);
+	// Compressed and probe flags, set on the written packet
+	w.write_bool(false);
+	w.write_bool(false);
+	// The remote has received at least `m_remote_ack` and knows at least `m_ack_base`
+	write_seq(w, m_sequence, m_sequence - m_remote_ack);
+	write_seq(w, m_out_ack, m_out_ack - m_ack_base);
+	w.write_bool(m_out_ack_bits == ~0u);
+	if (m_out_ack_bits != ~0u)
+		w.write_bits(m_out_ack_bits, ACKS_PER_BITFIELD);
+	w.align();
+	m_header_size = w.bytes_written();
+	m_header.clear();
+}
+
+bool Connection::add_channel(channel_id_t id, Channel::Type type, float priority)
+{
+	if (id >= MAX_CHANNELS)
+		return false;
+	// Fill the ids in between with unused slots
+	while (m_channels_in.size() <= id) {
+		m_channels_in.push_back(ChannelIn(m_packet_pool));
+		m_channels_out.push_back(ChannelOut(m_packet_pool));
+	}
+	m_channels_in[id] = ChannelIn(m_packet_pool, type);
+	m_channels_out[id] = ChannelOut(m_packet_pool, type);
+	m_channels_out[id].set_priority(priority);
+	return true;
+}
+
+void Connection::set_max_packet_size(unsigned int size)
+{
+	m_mtu.set_max(size);
+}
+
+void Connection::set_bandwidth(unsigned int bytesPerSecond)
+{
+	m_bandwidth.set_limit(bytesPerSecond);
+}
+
+bool Connection::send(channel_id_t id, const Packet& message)
+{
+	ChannelOut *channel = get_channel_out_by_id(id);
+	if (channel == nullptr)
+		return false;
+	channel->send(message);
+	return true;
+}
+
+ConnectionMetrics Connection::metrics() const
+{
+	ConnectionMetrics m = m_metrics;
+	m.srtt_us = std::chrono::duration_cast<std::chrono::microseconds>(m_rtt.srtt()).count();
+	m.rto_us = std::chrono::duration_cast<std::chrono::microseconds>(m_rtt.rto()).count();
+	m.bandwidth = m_bandwidth.rate();
+	m.packet_size = m_mtu.packet_size();
+	m.packets_in_flight = m_sent.size();
+	m.pool_pages = m_packet_pool.numPages();
+	m.compression = m_compressor.stats();
+
+	// The channels are opened in both directions, merge the two halves
+	for (size_t id = 0; id < m_channels_out.size(); id++) {
+		const ChannelOut& out = m_channels_out[id];
+		const ChannelIn& in = m_channels_in[id];
+		if (out.type() == Channel::UNKNOWN)
+			continue;
+		ChannelMetrics c = out.m_metrics;
+		c.id = (channel_id_t)id;
+		c.queued = out.queued();
+		c.messages_received = in.m_metrics.messages_received;
+		c.bytes_received = in.m_metrics.bytes_received;
+		c.messages_dropped = in.m_metrics.messages_dropped;
+		c.buffered = in.buffered();
+		m.channels.push_back(c);
 	}
-	printf("\n");
+	return m;
+}
+
+std::shared_ptr<MetricsPublisher> Connection::metrics_publisher()
+{
+	if (!m_publisher)
+		m_publisher.reset(new MetricsPublisher());
+	return m_publisher;
 }
\ No newline at end of file
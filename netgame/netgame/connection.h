@@ -7,69 +7,308 @@
 #include "protocol.h"
 #include "channel.h"
 #include "packet.h"
+#include "transport.h"
+#include "timing.h"
+#include "rtt.h"
+#include "bandwidth.h"
+#include "mtu.h"
+#include "sequence_buffer.h"
+#include "bitstream.h"
+#include "compress.h"
+#include "metrics.h"
 
-#include <map>
+#include <memory>
+#include <vector>
+
+// A channel of a layout known at compile time, eg.
+//   typedef ChannelDef<1, ChannelIn::Reliable> ChatChannel;
+//   conn.add_channel<ChatChannel>();
+//   conn.receive<ChatChannel>(message);
+// The id indexes the channel table and the delivery policy is called directly, the
+// messages that arrive go through the policy the channel was opened with
+template <channel_id_t Id, typename Delivery>
+struct ChannelDef
+{
+	static const channel_id_t ID = Id;
+	typedef Delivery delivery;
+};
+
+// A reliable message (or a fragment of one) sent in a packet, kept to resend if the packet is lost
+// Unreliable messages of channels that want acks are kept only to report the ack
+struct SentMessage
+{
+	SentMessage(channel_id_t ch, seq_t s, bool reliable, bool wantsAck, const Packet& p, fragment_id_t part, fragment_id_t parts, const Packet& message)
+		: chan(ch)
+		, seq(s)
+		, reliable(reliable)
+		, wants_ack(wantsAck)
+		, packet(p)
+		, part(part)
+		, parts(parts)
+		, message(message)
+	{
+	}
+
+	channel_id_t chan;
+	seq_t seq;
+	bool reliable;
+	// The channel is told when it gets through
+	bool wants_ack;
+	// The whole message, or only the fragment's data if `parts > 1` (empty if not reliable)
+	Packet packet;
+	fragment_id_t part;
+	fragment_id_t parts;
+	// The whole message a reliable fragment was cut from, to cut it again for a smaller packet size
+	Packet message;
+};
 
 class SentPacket
 {
 public:
 	SentPacket()
-	{
-	}
-	SentPacket(Packet p, seq_t s)
-		: packet(p)
-		, seq(s)
+		: size(0)
+		, probe(false)
+		, ack(0)
 	{
 	}
 
-	Packet packet;
-	seq_t seq;
+	net_time time;
+	// Datagram size (for the bandwidth estimate)
+	unsigned int size;
+	// Padded to see if the size gets through, carries no messages
+	bool probe;
+	// The ack the packet carried, the remote has seen at least this one once the packet is acknowledged
+	seq_t ack;
+	std::vector<SentMessage> messages;
 };
 
-class Packet;
+// Sent packets are declared lost when a packet this much newer has been acknowledged
+const unsigned int LOSS_ACK_THRESHOLD = 3;
+
+// Number of sent packets tracked for acks, older ones are treated as lost
+const unsigned int SENT_PACKETS_WINDOW = 256;
+
+// Message payloads at least this large are gathered from the message instead of copied to the datagram
+// (below this a copy is cheaper than the extra slice)
+const unsigned int GATHER_MIN_SIZE = 256;
+
+// What the message headers of a packet are encoded against, rebuilt the same way by the receiver
+// A message on the channel of the previous message doesn't repeat the channel and
+// the sequence of a channel already in the packet is sent as a delta
+class MessageHeaderContext
+{
+public:
+	MessageHeaderContext()
+		: m_prev_chan(0)
+	{ }
+
+	void clear() { m_seqs.clear(); }
+
+	bool empty() const { return m_seqs.empty(); }
+	// Channel of the previous message
+	channel_id_t prev_channel() const { return m_prev_chan; }
+	// Last sequence of `chan` in the packet or nullptr
+	const seq_t *last_seq(channel_id_t chan) const;
+
+	void add(channel_id_t chan, seq_t seq);
+
+	void swap(MessageHeaderContext& c) { std::swap(m_prev_chan, c.m_prev_chan); m_seqs.swap(c.m_seqs); }
+
+private:
+	channel_id_t m_prev_chan;
+	// A packet has messages of a few channels, a search is faster than a map
+	std::vector<std::pair<channel_id_t, seq_t>> m_seqs;
+};
+
+struct SendPacket;
+class Packer;
 class Connection
 {
 public:
-	Connection() { }
-	Connection(const Address& addr, magic_t magic);
+	Connection()
+		: m_sent(SENT_PACKETS_WINDOW)
+	{ }
+	// `now` counts as the time the last packet was received (see `last_received()`)
+	Connection(const Address& addr, magic_t magic, net_time now = net_time());
 	Connection(Connection&& c);
-	Connection& Connection::operator=(Connection c);
+	Connection& operator=(Connection c);
 
 	// Call with every packet received with the associated socket
-	bool process_packet(const Packet& packet);
+	bool process_packet(const Packet& packet, net_time now);
+
+	const Address& address() const { return m_address; }
+	magic_t magic() const { return m_magic; }
 
-	// Send packets (should be called with a fixed rate eg. 33 times a second)
-	void send_outgoing(Socket& socket);
+	// When the last packet was accepted, to drop the connections that went silent
+	net_time last_received() const { return m_last_received; }
 
-	ChannelIn* get_channel_in_by_id(channel_id_t id) const;
-	ChannelOut* get_channel_out_by_id(channel_id_t id) const;
+	// Send packets (should be called every `send_interval()`)
+	// The datagrams may be queued in `transport` until it's flushed
+	void send_outgoing(Transport& transport, net_time now);
 
-#ifdef _DEBUG
-	void DEBUG_print_status();
-	float m_DEBUG_packet_loss;
-#endif
+	// How many times a second `send_outgoing` should be called
+	// eg. 60 for active players and 5 for spectators
+	void set_send_rate(unsigned int hz);
+	net_duration send_interval() const { return m_send_interval; }
+
+	// Open a channel in both directions (the other end must open the same channels)
+	// `priority` is the share of the bandwidth it gets (see `ChannelOut::set_priority()`)
+	// The channels are stored in place in tables indexed by id (below `MAX_CHANNELS`),
+	// opening one may move the others: get their pointers once the layout is complete
+	// Returns false if the id is too large
+	bool add_channel(channel_id_t id, Channel::Type type, float priority = 1.0f);
+	template <typename Def>
+	bool add_channel(float priority = 1.0f)
+	{
+		if (!add_channel(Def::ID, Def::delivery::TYPE, priority))
+			return false;
+		ChannelIn& chan = m_channels_in[Def::ID];
+		chan.set_delivery<typename Def::delivery>();
+		return true;
+	}
+
+	ChannelIn* get_channel_in_by_id(channel_id_t id)
+	{
+		return id < m_channels_in.size() && m_channels_in[id].type() != Channel::UNKNOWN ? &m_channels_in[id] : nullptr;
+	}
+	const ChannelIn* get_channel_in_by_id(channel_id_t id) const
+	{
+		return id < m_channels_in.size() && m_channels_in[id].type() != Channel::UNKNOWN ? &m_channels_in[id] : nullptr;
+	}
+	ChannelOut* get_channel_out_by_id(channel_id_t id)
+	{
+		return id < m_channels_out.size() && m_channels_out[id].type() != Channel::UNKNOWN ? &m_channels_out[id] : nullptr;
+	}
+	const ChannelOut* get_channel_out_by_id(channel_id_t id) const
+	{
+		return id < m_channels_out.size() && m_channels_out[id].type() != Channel::UNKNOWN ? &m_channels_out[id] : nullptr;
+	}
+
+	// Receive from a channel of a `ChannelDef` (it must have been opened with it)
+	template <typename Def>
+	bool receive(PacketChain& out)
+	{
+		return Def::ID < m_channels_in.size() && Def::delivery::receive(m_channels_in[Def::ID], out);
+	}
+
+	// Queue a message on the channel `id`, false if there is no such channel
+	// The connection keeps a reference to the buffer instead of a copy, so one packet
+	// can be queued on many connections (it must not be modified afterwards)
+	bool send(channel_id_t id, const Packet& message);
+
+	const RttEstimator& rtt() const { return m_rtt; }
+
+	// Bytes per second to send at most, `BANDWIDTH_ESTIMATE` (the default) to follow
+	// the acks and losses or `BANDWIDTH_UNLIMITED`
+	// Messages over the budget wait in their channel for the next ticks
+	void set_bandwidth(unsigned int bytesPerSecond);
+	const BandwidthBudget& bandwidth() const { return m_bandwidth; }
+
+	// Largest packet size to look for (`MAX_PACKET_SIZE` by default), the connection
+	// starts at `MIN_PACKET_SIZE` and probes the path for larger sizes
+	// `MIN_PACKET_SIZE` turns the discovery off
+	void set_max_packet_size(unsigned int size);
+	const PathMtu& mtu() const { return m_mtu; }
+
+	// Compress the datagrams while it pays off (the other end must use the same dictionary)
+	// `dictionary` may be null, else it must outlive the connection
+	void set_compression(bool enabled, const CompressionDictionary *dictionary = nullptr);
+	const CompressionStats& compression_stats() const { return m_compressor.stats(); }
+
+	// Counters and gauges of the connection and its channels (on the owning thread)
+	ConnectionMetrics metrics() const;
+
+	// The metrics for other threads, republished by `send_outgoing()` after a snapshot is taken
+	// Create it on the owning thread, it can be kept after the connection is gone
+	std::shared_ptr<MetricsPublisher> metrics_publisher();
 
 private:
 	Connection(const Connection&);
 
-	void add_packet_header(NetWriter& w);
-	unsigned int add_packet(NetWriter& w, channel_id_t ch, const Packet& p, unsigned int start, unsigned int parts);
-	void send_packet(NetWriter& w);
+	void add_packet_header(BitWriter& w);
+	unsigned int add_packet(BitWriter& w, const SendPacket& m, unsigned int start, unsigned int part, unsigned int parts);
+	void send_packet(BitWriter& w, Transport& transport, net_time now);
+	// Size of the packet being built including the gathered payloads
+	unsigned int packet_size(const BitWriter& w) const { return w.bytes_written() + m_gather_size; }
+	// Move the messages to send this tick from the channels to `packer`
+	void schedule_messages(Packer& packer);
+	// Compress the body of the packet being built in place, returns the size to send
+	unsigned int compress_packet(const BitWriter& w);
+
+	// Parse the messages of a received packet (the first one at `offset`), returns false if
+	// they are malformed. They are only handed to the channels if `deliver`, so the
+	// packet can be checked before it's acknowledged
+	bool read_messages(const Packet& packet, unsigned int offset, bool deliver);
+
+	// Handle the acknowledgement of a sent packet
+	void ack_packet(seq_t seq, net_time now, bool sample);
+	// Queue the reliable messages of a lost packet to be sent again
+	// Returns false if it wasn't in flight or was a probe
+	bool resend_packet(seq_t seq, net_time now);
+	// Send a padded packet to see if packets of `size` get through
+	void send_probe(Transport& transport, unsigned int size, net_time now);
 
 	magic_t m_magic;
 
 	Address m_address;
+	net_time m_last_received;
 
-	std::map<channel_id_t, std::unique_ptr<ChannelIn>> m_channels_in;
-	std::map<channel_id_t, std::unique_ptr<ChannelOut>> m_channels_out;
+	// Indexed by channel id, the unused ids are `Channel::UNKNOWN`
+	std::vector<ChannelIn> m_channels_in;
+	std::vector<ChannelOut> m_channels_out;
+	// Slots the receive windows may still be widened by
+	unsigned int m_window_budget;
 
 	seq_t m_sequence;
 
+	net_duration m_send_interval;
+
 	seq_t m_out_ack;
 	ack_bitfield_t m_out_ack_bits;
 
-	std::map<seq_t, SentPacket> m_sent;
-	
+	SequenceBuffer<SentPacket> m_sent;
+	// Oldest sequence that may still be in `m_sent`
+	seq_t m_sent_oldest;
+	// Reliable messages written to the packet being built
+	std::vector<SentMessage> m_sent_messages;
+	// Message headers written to the packet being built
+	MessageHeaderContext m_header;
+	// Size of the packet header (the body starts after it)
+	unsigned int m_header_size;
+
+	// A payload to send from the message's own buffer after `offset` bytes of the written packet
+	struct GatherSlice
+	{
+		GatherSlice(unsigned int offset, const Packet& p)
+			: offset(offset)
+			, packet(p)
+		{ }
+
+		unsigned int offset;
+		Packet packet;
+	};
+	// Payloads of the packet being built that are not copied to it
+	std::vector<GatherSlice> m_gather;
+	unsigned int m_gather_size;
+	// Reused to assemble the gathered datagrams
+	PacketChain m_datagram;
+	// Newest sequence acknowledged by the remote
+	seq_t m_remote_ack;
+	// Oldest ack the remote may consider its newest (our acks are sent relative to it)
+	seq_t m_ack_base;
+	RttEstimator m_rtt;
+	BandwidthBudget m_bandwidth;
+	PathMtu m_mtu;
+
+	AdaptiveCompressor m_compressor;
+	// The body to compress with the gathered payloads copied in
+	std::vector<char> m_compress_buffer;
+
+	ConnectionMetrics m_metrics;
+	// Previous round-trip sample (for the jitter)
+	net_duration m_last_sample;
+	std::shared_ptr<MetricsPublisher> m_publisher;
+
 	PacketPool m_packet_pool;
 };
 
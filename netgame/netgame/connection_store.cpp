@@ -0,0 +1,175 @@
+#include "connection_store.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "transport.h"
+
+// Starting size of the address table
+const size_t STORE_INITIAL_BUCKETS = 64;
+
+// Deadline and receive time of a free slot, never due nor silent
+const net_duration::rep FREE_SLOT_TIME = std::numeric_limits<net_duration::rep>::max();
+
+ConnectionStore::ConnectionStore()
+	: m_count(0)
+{
+	Bucket empty = { 0, EMPTY };
+	m_table.assign(STORE_INITIAL_BUCKETS, empty);
+}
+
+ConnectionHandle ConnectionStore::add(const Address& addr, Connection&& conn, net_time deadline)
+{
+	if ((m_count + 1) * 2 > m_table.size())
+		grow_table();
+
+	uint32_t index;
+	if (!m_free.empty()) {
+		index = m_free.back();
+		m_free.pop_back();
+	} else {
+		index = (uint32_t)m_connections.size();
+		m_deadline.push_back(FREE_SLOT_TIME);
+		m_last_received.push_back(FREE_SLOT_TIME);
+		m_last_sent.push_back(0);
+		m_generations.push_back(0);
+		m_connections.push_back(std::unique_ptr<Connection>());
+		m_addresses.push_back(Address());
+	}
+
+	m_deadline[index] = deadline.time_since_epoch().count();
+	m_last_received[index] = conn.last_received().time_since_epoch().count();
+	m_last_sent[index] = 0;
+	m_connections[index].reset(new Connection(std::move(conn)));
+	m_addresses[index] = addr;
+	m_count++;
+
+	uint32_t hash = (uint32_t)address_hash(addr);
+	Bucket& bucket = m_table[find_bucket(addr, hash)];
+	bucket.hash = hash;
+	bucket.index = index;
+	return ConnectionHandle(index, m_generations[index]);
+}
+
+void ConnectionStore::remove(ConnectionHandle h)
+{
+	if (get(h) == nullptr)
+		return;
+
+	// Backward shift deletion: move up the entries that probed past the freed bucket
+	size_t mask = m_table.size() - 1;
+	size_t hole = find_bucket(m_addresses[h.index], (uint32_t)address_hash(m_addresses[h.index]));
+	size_t next = hole;
+	while (true) {
+		next = (next + 1) & mask;
+		if (m_table[next].index == EMPTY)
+			break;
+		size_t home = m_table[next].hash & mask;
+		// Movable if its home isn't in (hole, next] (cyclically)
+		bool between = hole < next ? (home > hole && home <= next) : (home > hole || home <= next);
+		if (!between) {
+			m_table[hole] = m_table[next];
+			hole = next;
+		}
+	}
+	m_table[hole].index = EMPTY;
+
+	m_connections[h.index].reset();
+	m_addresses[h.index] = Address();
+	m_deadline[h.index] = FREE_SLOT_TIME;
+	m_last_received[h.index] = FREE_SLOT_TIME;
+	m_generations[h.index]++;
+	m_free.push_back(h.index);
+	m_count--;
+}
+
+ConnectionHandle ConnectionStore::find(const Address& addr) const
+{
+	const Bucket& bucket = m_table[find_bucket(addr, (uint32_t)address_hash(addr))];
+	if (bucket.index == EMPTY)
+		return ConnectionHandle();
+	return ConnectionHandle(bucket.index, m_generations[bucket.index]);
+}
+
+Connection* ConnectionStore::get(ConnectionHandle h)
+{
+	if (h.index >= m_connections.size() || m_generations[h.index] != h.generation)
+		return nullptr;
+	return m_connections[h.index].get();
+}
+
+const Connection* ConnectionStore::get(ConnectionHandle h) const
+{
+	if (h.index >= m_connections.size() || m_generations[h.index] != h.generation)
+		return nullptr;
+	return m_connections[h.index].get();
+}
+
+void ConnectionStore::collect_due(net_time now, std::vector<ConnectionHandle>& out) const
+{
+	// Branch-free pass over the deadlines, then the handles of the few due slots
+	net_duration::rep t = now.time_since_epoch().count();
+	size_t n = m_deadline.size();
+	m_scratch.resize(n);
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		m_scratch[count] = (uint32_t)i;
+		count += m_deadline[i] <= t;
+	}
+	out.clear();
+	for (size_t i = 0; i < count; i++)
+		out.push_back(ConnectionHandle(m_scratch[i], m_generations[m_scratch[i]]));
+}
+
+void ConnectionStore::collect_silent(net_time cutoff, std::vector<ConnectionHandle>& out) const
+{
+	net_duration::rep t = cutoff.time_since_epoch().count();
+	size_t n = m_last_received.size();
+	m_scratch.resize(n);
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		m_scratch[count] = (uint32_t)i;
+		count += m_last_received[i] < t;
+	}
+	out.clear();
+	for (size_t i = 0; i < count; i++)
+		out.push_back(ConnectionHandle(m_scratch[i], m_generations[m_scratch[i]]));
+}
+
+net_time ConnectionStore::next_deadline() const
+{
+	net_duration::rep next = FREE_SLOT_TIME;
+	for (size_t i = 0; i < m_deadline.size(); i++)
+		next = std::min(next, m_deadline[i]);
+	return next == FREE_SLOT_TIME ? net_time::max() : to_time(next);
+}
+
+size_t ConnectionStore::find_bucket(const Address& addr, uint32_t hash) const
+{
+	size_t mask = m_table.size() - 1;
+	size_t i = hash & mask;
+	while (m_table[i].index != EMPTY) {
+		if (m_table[i].hash == hash && address_equal(m_addresses[m_table[i].index], addr))
+			return i;
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+void ConnectionStore::grow_table()
+{
+	std::vector<Bucket> old;
+	old.swap(m_table);
+	Bucket empty = { 0, EMPTY };
+	m_table.assign(old.size() * 2, empty);
+
+	size_t mask = m_table.size() - 1;
+	for (auto& bucket : old) {
+		if (bucket.index == EMPTY)
+			continue;
+		size_t i = bucket.hash & mask;
+		while (m_table[i].index != EMPTY)
+			i = (i + 1) & mask;
+		m_table[i] = bucket;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,133 @@
+#ifndef _NETGAME_CONNECTION_STORE_H
+#define _NETGAME_CONNECTION_STORE_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <netlib/address.h>
+
+#include "connection.h"
+#include "timing.h"
+
+// A connection of a `ConnectionStore`, stays valid while the connection is in the
+// store (a removed connection's slot is reused with a new generation)
+struct ConnectionHandle
+{
+	ConnectionHandle()
+		: index(UINT32_MAX)
+		, generation(0)
+	{ }
+	ConnectionHandle(uint32_t index, uint32_t generation)
+		: index(index)
+		, generation(generation)
+	{ }
+
+	uint32_t index;
+	uint32_t generation;
+};
+
+// The connections of a server by address
+// What is kept for every connection (send deadlines, last receive and send times)
+// is in flat arrays indexed by slot, so a pass over thousands of connections (eg. the
+// timeout scan of the tick loop) reads a few contiguous arrays instead of touching
+// every connection
+// The connections themselves (channels, pools) are kept out of line and only
+// touched when they are due, addresses are found with an open-addressing hash table
+class ConnectionStore
+{
+public:
+	ConnectionStore();
+
+	// Add a connection for `addr` (which must not be in the store), due to send at `deadline`
+	ConnectionHandle add(const Address& addr, Connection&& conn, net_time deadline);
+	void remove(ConnectionHandle h);
+
+	// The connection of `addr`, an invalid handle if there is none
+	ConnectionHandle find(const Address& addr) const;
+
+	// The connection of a handle, null if it was removed
+	Connection* get(ConnectionHandle h);
+	const Connection* get(ConnectionHandle h) const;
+
+	const Address& address(ConnectionHandle h) const { return m_addresses[h.index]; }
+
+	// Record that a packet was accepted / packets were sent and when to send next
+	void received(ConnectionHandle h, net_time now) { m_last_received[h.index] = now.time_since_epoch().count(); }
+	void sent(ConnectionHandle h, net_time now, net_time next)
+	{
+		m_last_sent[h.index] = now.time_since_epoch().count();
+		m_deadline[h.index] = next.time_since_epoch().count();
+	}
+
+	net_time deadline(ConnectionHandle h) const { return to_time(m_deadline[h.index]); }
+	net_time last_received(ConnectionHandle h) const { return to_time(m_last_received[h.index]); }
+	net_time last_sent(ConnectionHandle h) const { return to_time(m_last_sent[h.index]); }
+
+	// Replace `out` with the connections due to send at `now`
+	void collect_due(net_time now, std::vector<ConnectionHandle>& out) const;
+
+	// Replace `out` with the connections that received nothing since `cutoff`
+	void collect_silent(net_time cutoff, std::vector<ConnectionHandle>& out) const;
+
+	// The earliest send deadline (`net_time::max()` if there are no connections)
+	net_time next_deadline() const;
+
+	// Call `f(ConnectionHandle, Connection&)` for every connection
+	template <typename F>
+	void for_each(F f)
+	{
+		for (uint32_t i = 0; i < m_connections.size(); i++) {
+			if (m_connections[i])
+				f(ConnectionHandle(i, m_generations[i]), *m_connections[i]);
+		}
+	}
+	template <typename F>
+	void for_each(F f) const
+	{
+		for (uint32_t i = 0; i < m_connections.size(); i++) {
+			if (m_connections[i])
+				f(ConnectionHandle(i, m_generations[i]), static_cast<const Connection&>(*m_connections[i]));
+		}
+	}
+
+	size_t size() const { return m_count; }
+
+private:
+	ConnectionStore(const ConnectionStore&);
+
+	// A slot of the address table, `index` is `EMPTY` if it's free
+	struct Bucket
+	{
+		uint32_t hash;
+		uint32_t index;
+	};
+
+	static const uint32_t EMPTY = UINT32_MAX;
+
+	static net_time to_time(net_duration::rep t) { return net_time(net_duration(t)); }
+
+	// Bucket of `addr`, or the empty bucket it would go in
+	size_t find_bucket(const Address& addr, uint32_t hash) const;
+	void grow_table();
+
+	// Hot state, indexed by slot (free slots never come due or go silent)
+	std::vector<net_duration::rep> m_deadline;
+	std::vector<net_duration::rep> m_last_received;
+	std::vector<net_duration::rep> m_last_sent;
+	std::vector<uint32_t> m_generations;
+
+	// Cold state
+	std::vector<std::unique_ptr<Connection>> m_connections;
+	std::vector<Address> m_addresses;
+	std::vector<uint32_t> m_free;
+	size_t m_count;
+
+	// Linear probing with a power of two size, at most half full
+	std::vector<Bucket> m_table;
+
+	// Indices found by the scans
+	mutable std::vector<uint32_t> m_scratch;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include "delta.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Unchanged runs shorter than this are sent as changed (cheaper than a new run)
+const unsigned int DELTA_MIN_RUN = 4;
+
+static char *write_varint(char *out, unsigned int value)
+{
+	while (value >= 0x80) {
+		*out++ = (char)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (char)value;
+	return out;
+}
+
+static bool read_varint(const char *&in, const char *end, unsigned int& value)
+{
+	value = 0;
+	for (unsigned int shift = 0; shift < 35 && in != end; shift += 7) {
+		unsigned char byte = (unsigned char)*in++;
+		value |= (unsigned int)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+unsigned int delta_encode(const char *base, unsigned int baseSize, const char *data, unsigned int size, char *out)
+{
+	char *p = write_varint(out, size);
+	unsigned int i = 0;
+	while (i < size) {
+		// Unchanged run
+		unsigned int changed = i;
+		while (changed < size && changed < baseSize && data[changed] == base[changed])
+			changed++;
+		if (changed == size)
+			break;
+
+		// Changed run, ends where a long enough unchanged run starts
+		unsigned int j, run = 0;
+		for (j = changed; j < size; j++) {
+			if (j < baseSize && data[j] == base[j]) {
+				if (++run == DELTA_MIN_RUN)
+					break;
+			} else {
+				run = 0;
+			}
+		}
+		unsigned int end = (j < size ? j + 1 : size) - run;
+
+		p = write_varint(p, changed - i);
+		p = write_varint(p, end - changed);
+		memcpy(p, data + changed, end - changed);
+		p += end - changed;
+		i = end;
+	}
+	return (unsigned int)(p - out);
+}
+
+bool delta_decoded_size(const char *delta, unsigned int deltaSize, unsigned int& size)
+{
+	return read_varint(delta, delta + deltaSize, size);
+}
+
+bool delta_decode(const char *base, unsigned int baseSize, const char *delta, unsigned int deltaSize, char *out)
+{
+	const char *p = delta;
+	const char *end = delta + deltaSize;
+	unsigned int size;
+	if (!read_varint(p, end, size))
+		return false;
+
+	// Start from the baseline
+	unsigned int copy = std::min(baseSize, size);
+	if (copy > 0)
+		memcpy(out, base, copy);
+	memset(out + copy, 0, size - copy);
+
+	unsigned int pos = 0;
+	while (p != end) {
+		unsigned int same, changed;
+		if (!read_varint(p, end, same) || !read_varint(p, end, changed))
+			return false;
+		if (same > size - pos || changed > size - pos - same || changed > (unsigned int)(end - p))
+			return false;
+		pos += same;
+		memcpy(out + pos, p, changed);
+		p += changed;
+		pos += changed;
+	}
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,25 @@
+#ifndef _NETGAME_DELTA_H
+#define _NETGAME_DELTA_H
+
+// Byte-wise delta of a snapshot against a baseline
+// Encoded as the snapshot size followed by (unchanged bytes, changed bytes, the
+// changed bytes) runs, all counts as varints. Bytes past the end of the baseline
+// count as changed, anything after the last run is unchanged
+
+// Upper bound for the encoded size of a `size` byte snapshot
+inline unsigned int delta_max_size(unsigned int size)
+{
+	return 2 * size + 16;
+}
+
+// Encode `data` against `base` to `out` (must have `delta_max_size(size)` bytes)
+// Returns the encoded size
+unsigned int delta_encode(const char *base, unsigned int baseSize, const char *data, unsigned int size, char *out);
+
+// Read the size of the snapshot encoded in `delta`
+bool delta_decoded_size(const char *delta, unsigned int deltaSize, unsigned int& size);
+
+// Rebuild the snapshot to `out` (must have room for `delta_decoded_size()` bytes)
+bool delta_decode(const char *base, unsigned int baseSize, const char *delta, unsigned int deltaSize, char *out);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,93 @@
+#include "event_loop.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+
+EventLoop::EventLoop()
+	: m_epoll(epoll_create1(0))
+	, m_event(eventfd(0, EFD_NONBLOCK))
+{
+	watch(m_event);
+}
+
+EventLoop::~EventLoop()
+{
+	close(m_event);
+	close(m_epoll);
+}
+
+bool EventLoop::watch(int fd)
+{
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool EventLoop::wait_until(net_time deadline)
+{
+	net_time now = net_clock::now();
+	int timeout = 0;
+	if (deadline > now) {
+		// Round up so we don't wake up just before the deadline
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+		timeout = (int)std::min<long long>((us + 999) / 1000, 1000 * 60);
+	}
+
+	epoll_event events[16];
+	int n = epoll_wait(m_epoll, events, 16, timeout);
+	for (int i = 0; i < n; i++) {
+		if (events[i].data.fd == m_event) {
+			uint64_t value;
+			if (read(m_event, &value, sizeof(value)) < 0) { }
+		}
+	}
+	return n > 0;
+}
+
+void EventLoop::notify()
+{
+	uint64_t one = 1;
+	if (write(m_event, &one, sizeof(one)) < 0) { }
+}
+
+#else
+
+// Longest nap when the platform can't wake up on readiness
+const std::chrono::milliseconds EVENT_LOOP_NAP(1);
+
+EventLoop::EventLoop()
+{
+}
+
+EventLoop::~EventLoop()
+{
+}
+
+bool EventLoop::watch(int fd)
+{
+	return false;
+}
+
+bool EventLoop::wait_until(net_time deadline)
+{
+	net_time now = net_clock::now();
+	if (deadline > now)
+		std::this_thread::sleep_for(std::min<net_duration>(deadline - now, EVENT_LOOP_NAP));
+	return false;
+}
+
+void EventLoop::notify()
+{
+}
+
+#endif
\ No newline at end of file
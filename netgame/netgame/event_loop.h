@@ -0,0 +1,33 @@
+#ifndef _NETGAME_EVENT_LOOP_H
+#define _NETGAME_EVENT_LOOP_H
+
+#include "timing.h"
+
+// Sleeps until a watched socket is readable, `notify()` is called or a deadline passes
+// Uses epoll on Linux, elsewhere it naps in short slices
+class EventLoop
+{
+public:
+	EventLoop();
+	~EventLoop();
+
+	// Wake up when `fd` becomes readable
+	bool watch(int fd);
+
+	// Wait until woken up or `deadline`
+	// Returns true if woken by readiness or a notification
+	bool wait_until(net_time deadline);
+
+	// Wake up a `wait_until()` in progress (or the next one), callable from any thread
+	void notify();
+
+private:
+	EventLoop(const EventLoop&);
+
+#ifdef __linux__
+	int m_epoll;
+	int m_event;
+#endif
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "handshake.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+// Most address bytes that go in a cookie (the size of a `sockaddr_storage`)
+const unsigned int COOKIE_ADDRESS_SIZE = 128;
+
+// What a hash is for, so the cookie doesn't give away the magic number
+const unsigned char COOKIE_PURPOSE_MAC = 0;
+const unsigned char COOKIE_PURPOSE_MAGIC = 1;
+
+static inline uint64_t rotl(uint64_t x, int b)
+{
+	return (x << b) | (x >> (64 - b));
+}
+
+static inline void sip_round(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+{
+	v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+	v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+	v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+	v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+uint64_t siphash(const uint64_t key[2], const unsigned char *data, unsigned int size)
+{
+	uint64_t v0 = key[0] ^ 0x736f6d6570736575ull;
+	uint64_t v1 = key[1] ^ 0x646f72616e646f6dull;
+	uint64_t v2 = key[0] ^ 0x6c7967656e657261ull;
+	uint64_t v3 = key[1] ^ 0x7465646279746573ull;
+
+	// Whole little-endian words, then the tail with the length in the top byte
+	unsigned int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t m = 0;
+		for (unsigned int j = 0; j < 8; j++)
+			m |= (uint64_t)data[i + j] << (8 * j);
+		v3 ^= m;
+		sip_round(v0, v1, v2, v3);
+		sip_round(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	uint64_t last = (uint64_t)size << 56;
+	for (unsigned int j = 0; i + j < size; j++)
+		last |= (uint64_t)data[i + j] << (8 * j);
+	v3 ^= last;
+	sip_round(v0, v1, v2, v3);
+	sip_round(v0, v1, v2, v3);
+	v0 ^= last;
+
+	v2 ^= 0xff;
+	for (int r = 0; r < 4; r++)
+		sip_round(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint32_t cookie_time(net_time now)
+{
+	return (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+}
+
+CookieGenerator::CookieGenerator()
+{
+	std::random_device random;
+	for (int i = 0; i < 2; i++)
+		m_key[i] = (uint64_t)random() << 32 | random();
+}
+
+uint64_t CookieGenerator::hash(const Address& addr, uint32_t time, unsigned char purpose) const
+{
+	unsigned char data[COOKIE_ADDRESS_SIZE + sizeof(uint32_t) + 1];
+	unsigned int addrSize = std::min<unsigned int>(addr.get_size(), COOKIE_ADDRESS_SIZE);
+	memcpy(data, addr.get_sockaddr(), addrSize);
+	memcpy(data + addrSize, &time, sizeof(time));
+	data[addrSize + sizeof(time)] = purpose;
+	return siphash(m_key, data, addrSize + sizeof(time) + 1);
+}
+
+void CookieGenerator::issue(NetWriter& writer, const Address& addr, net_time now) const
+{
+	uint32_t time = cookie_time(now);
+	writer.write(time);
+	writer.write(hash(addr, time, COOKIE_PURPOSE_MAC));
+}
+
+bool CookieGenerator::verify(NetReader& reader, const Address& addr, net_time now, magic_t& magic) const
+{
+	uint32_t time;
+	uint64_t mac;
+	if (!reader.read(time) || !reader.read(mac))
+		return false;
+	uint32_t current = cookie_time(now);
+	if (time > current || current - time >= COOKIE_LIFETIME || mac != hash(addr, time, COOKIE_PURPOSE_MAC))
+		return false;
+
+	// Never mistaken for a handshake datagram
+	magic = (magic_t)hash(addr, time, COOKIE_PURPOSE_MAGIC);
+	while (is_handshake(magic))
+		magic++;
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef _NETGAME_HANDSHAKE_H
+#define _NETGAME_HANDSHAKE_H
+
+#include <cstdint>
+
+#include <netlib/address.h>
+#include <netlib/serialization.h>
+
+#include "protocol.h"
+#include "timing.h"
+
+// Opening a connection, the server keeps nothing until the client echoes a cookie
+// it was given for its address:
+//   client -> server  HANDSHAKE_REQUEST    padded to `HANDSHAKE_REQUEST_SIZE`
+//   server -> client  HANDSHAKE_CHALLENGE  cookie
+//   client -> server  HANDSHAKE_RESPONSE   cookie
+//   server -> client  HANDSHAKE_ACCEPT     magic number of the connection
+// Every datagram starts with its type, the client repeats its last one until it's answered
+const magic_t HANDSHAKE_REQUEST = 0x4E474852;
+const magic_t HANDSHAKE_CHALLENGE = 0x4E474843;
+const magic_t HANDSHAKE_RESPONSE = 0x4E474845;
+const magic_t HANDSHAKE_ACCEPT = 0x4E474841;
+
+// Smallest request the server answers, the challenge is smaller so spoofed
+// requests can't make the server amplify traffic
+const unsigned int HANDSHAKE_REQUEST_SIZE = 64;
+
+// Seconds a cookie stays valid
+const unsigned int COOKIE_LIFETIME = 10;
+
+// How often the client repeats an unanswered handshake datagram
+const std::chrono::milliseconds HANDSHAKE_RETRY_INTERVAL(250);
+
+inline bool is_handshake(magic_t type)
+{
+	return type == HANDSHAKE_REQUEST || type == HANDSHAKE_CHALLENGE || type == HANDSHAKE_RESPONSE || type == HANDSHAKE_ACCEPT;
+}
+
+// SipHash-2-4 of `data` under `key` (the 16 key bytes as two little-endian words)
+uint64_t siphash(const uint64_t key[2], const unsigned char *data, unsigned int size);
+
+// Issues and checks the handshake cookies: a timestamp and a keyed hash (SipHash-2-4)
+// of it and the client's address under a secret picked at random
+class CookieGenerator
+{
+public:
+	CookieGenerator();
+
+	// Write a cookie for `addr`
+	void issue(NetWriter& writer, const Address& addr, net_time now) const;
+
+	// Read a cookie and check it was issued for `addr` less than `COOKIE_LIFETIME` ago
+	// `magic` is set to the magic number of the connection it opens (the same for every
+	// copy of the cookie, unknown to anyone who hasn't seen the accept)
+	bool verify(NetReader& reader, const Address& addr, net_time now, magic_t& magic) const;
+
+private:
+	uint64_t hash(const Address& addr, uint32_t time, unsigned char purpose) const;
+
+	uint64_t m_key[2];
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include "link_emulator.h"
+
+#include <algorithm>
+#include <climits>
+
+#include "connection.h"
+
+LinkConditions::LinkConditions()
+	: latency(0)
+	, jitter(0)
+	, loss(0.0)
+	, burst_enter(0.0)
+	, burst_exit(1.0)
+	, burst_loss(0.0)
+	, reorder(0.0)
+	, reorder_delay(0)
+	, duplicate(0.0)
+	, bandwidth(0)
+	, queue_limit(UINT_MAX)
+	, mtu(0)
+{
+}
+
+LinkEmulator::End::End()
+	: m_link(nullptr)
+	, m_side(0)
+	, m_bad(false)
+{
+}
+
+unsigned int LinkEmulator::End::receive(PacketPool& /*pool*/, Datagram *out, unsigned int count)
+{
+	// The sender's buffer is handed over as is, sent packets are never written again
+	End& from = m_link->m_ends[1 - m_side];
+	unsigned int received = 0;
+	while (received < count && !m_incoming.empty() && m_incoming.top().arrival <= m_link->m_now) {
+		out[received].address = from.m_address;
+		out[received].packet = m_incoming.top().packet;
+		m_incoming.pop();
+		// Only counted once it is handed over, not while it is still on the way
+		from.m_link_stats.delivered++;
+		from.m_link_stats.bytes_delivered += out[received].packet.size();
+		received++;
+	}
+	m_stats.recv_calls++;
+	m_stats.recv_datagrams += received;
+	return received;
+}
+
+void LinkEmulator::End::send(const Address& /*addr*/, const Packet& packet)
+{
+	m_stats.send_calls++;
+	m_stats.send_datagrams++;
+	m_link->transmit(*this, packet);
+}
+
+LinkEmulator::LinkEmulator(uint32_t seed)
+	: m_now(net_clock::now())
+	, m_order(0)
+	, m_random(seed)
+{
+	for (unsigned int side = 0; side < 2; side++) {
+		m_ends[side].m_link = this;
+		m_ends[side].m_side = side;
+		m_ends[side].m_address = Address::inet_any((unsigned short)(side + 1));
+		m_ends[side].m_busy_until = m_now;
+	}
+}
+
+void LinkEmulator::set_conditions(unsigned int side, const LinkConditions& conditions)
+{
+	m_ends[side].m_conditions = conditions;
+}
+
+void LinkEmulator::set_conditions(const LinkConditions& conditions)
+{
+	set_conditions(0, conditions);
+	set_conditions(1, conditions);
+}
+
+void LinkEmulator::advance_to(net_time time)
+{
+	m_now = std::max(m_now, time);
+}
+
+net_time LinkEmulator::next_arrival() const
+{
+	net_time next = net_time::max();
+	for (auto& end : m_ends) {
+		if (!end.m_incoming.empty())
+			next = std::min(next, end.m_incoming.top().arrival);
+	}
+	return next;
+}
+
+bool LinkEmulator::chance(double p)
+{
+	return p > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(m_random) < p;
+}
+
+void LinkEmulator::transmit(End& from, const Packet& packet)
+{
+	const LinkConditions& cond = from.m_conditions;
+	LinkStats& stats = from.m_link_stats;
+	End& to = m_ends[1 - from.m_side];
+	stats.sent++;
+
+	if (cond.mtu != 0 && packet.size() > cond.mtu) {
+		stats.mtu_drops++;
+		return;
+	}
+
+	// Gilbert-Elliott: switch state, then lose with the loss of the state
+	from.m_bad = from.m_bad ? !chance(cond.burst_exit) : chance(cond.burst_enter);
+	if (chance(from.m_bad ? cond.burst_loss : cond.loss)) {
+		stats.lost++;
+		return;
+	}
+
+	unsigned int copies = chance(cond.duplicate) ? 2 : 1;
+	stats.duplicated += copies - 1;
+	for (unsigned int i = 0; i < copies; i++) {
+		// Every copy waits behind the datagrams already in the bottleneck
+		net_time departure = m_now;
+		if (cond.bandwidth != 0) {
+			net_time start = std::max(m_now, from.m_busy_until);
+			double queued = std::chrono::duration<double>(start - m_now).count() * cond.bandwidth;
+			if (queued + packet.size() > cond.queue_limit) {
+				stats.queue_drops++;
+				continue;
+			}
+			from.m_busy_until = start + std::chrono::duration_cast<net_duration>(std::chrono::duration<double>((double)packet.size() / cond.bandwidth));
+			departure = from.m_busy_until;
+		}
+
+		net_duration delay = cond.latency;
+		if (cond.jitter.count() != 0) {
+			double jitter = std::normal_distribution<double>(0.0, std::chrono::duration<double>(cond.jitter).count())(m_random);
+			delay = std::max(net_duration(0), delay + std::chrono::duration_cast<net_duration>(std::chrono::duration<double>(jitter)));
+		}
+		if (chance(cond.reorder)) {
+			delay += cond.reorder_delay;
+			stats.reordered++;
+		}
+		to.m_incoming.push(InFlight(departure + delay, m_order++, packet));
+	}
+}
+
+void LinkEmulator::run(Connection& a, Connection& b, net_time end, const std::function<void(unsigned int, net_time)>& tick)
+{
+	Connection *conns[2] = { &a, &b };
+	net_time nextSend[2] = { m_now, m_now };
+	Datagram recv[IO_BATCH_SIZE];
+	PacketPool pool(MAX_PACKET_SIZE);
+
+	while (true) {
+		net_time next = std::min(std::min(nextSend[0], nextSend[1]), next_arrival());
+		if (next > end)
+			break;
+		advance_to(next);
+
+		for (unsigned int side = 0; side < 2; side++) {
+			unsigned int count;
+			do {
+				count = m_ends[side].receive(pool, recv, IO_BATCH_SIZE);
+				for (unsigned int i = 0; i < count; i++) {
+					conns[side]->process_packet(recv[i].packet, m_now);
+					recv[i].packet = Packet();
+				}
+			} while (count == IO_BATCH_SIZE);
+		}
+
+		for (unsigned int side = 0; side < 2; side++) {
+			if (nextSend[side] > m_now)
+				continue;
+			if (tick)
+				tick(side, m_now);
+			conns[side]->send_outgoing(m_ends[side], m_now);
+			nextSend[side] += conns[side]->send_interval();
+		}
+	}
+	advance_to(end);
+}
\ No newline at end of file
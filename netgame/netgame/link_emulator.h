@@ -0,0 +1,162 @@
+#ifndef _NETGAME_LINK_EMULATOR_H
+#define _NETGAME_LINK_EMULATOR_H
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include <netlib/address.h>
+
+#include "protocol.h"
+#include "packet.h"
+#include "transport.h"
+#include "timing.h"
+
+class Connection;
+
+// How one direction of an emulated link treats the datagrams
+struct LinkConditions
+{
+	LinkConditions();
+
+	// One-way delay, plus a normally distributed jitter with this deviation (never below zero)
+	net_duration latency;
+	net_duration jitter;
+
+	// Chance a datagram is lost, and the burst loss of a Gilbert-Elliott model:
+	// the link turns bad with `burst_enter` per datagram, back good with `burst_exit`,
+	// and while bad loses datagrams with `burst_loss`
+	double loss;
+	double burst_enter;
+	double burst_exit;
+	double burst_loss;
+
+	// Chance a datagram is held back `reorder_delay` more (lets later ones overtake it)
+	double reorder;
+	net_duration reorder_delay;
+
+	// Chance a datagram arrives twice
+	double duplicate;
+
+	// Bottleneck rate in bytes per second (0 for none), datagrams queue behind each other
+	// and are dropped once `queue_limit` bytes wait
+	unsigned int bandwidth;
+	unsigned int queue_limit;
+
+	// Largest datagram that gets through (0 for no limit)
+	unsigned int mtu;
+};
+
+// What happened to the datagrams sent in one direction
+struct LinkStats
+{
+	LinkStats()
+		: sent(0)
+		, delivered(0)
+		, lost(0)
+		, queue_drops(0)
+		, mtu_drops(0)
+		, duplicated(0)
+		, reordered(0)
+		, bytes_delivered(0)
+	{ }
+
+	unsigned long long sent;
+	// Handed to the other end (the ones still on the way are not counted)
+	unsigned long long delivered;
+	unsigned long long lost;
+	unsigned long long queue_drops;
+	unsigned long long mtu_drops;
+	unsigned long long duplicated;
+	unsigned long long reordered;
+	unsigned long long bytes_delivered;
+};
+
+// A link between two in-process endpoints running in virtual time, stands in for
+// the UDP sockets to test the whole stack reproducibly (and faster than real time)
+// Every random choice comes from one seeded generator, so a seed replays a run exactly
+class LinkEmulator
+{
+public:
+	explicit LinkEmulator(uint32_t seed = 1);
+
+	// Conditions of the datagrams sent by `side` (0 or 1), or of both directions
+	void set_conditions(unsigned int side, const LinkConditions& conditions);
+	void set_conditions(const LinkConditions& conditions);
+
+	// The transport of an end, what one sends the other receives (from `address()` of the sender)
+	Transport& transport(unsigned int side) { return m_ends[side]; }
+	const Address& address(unsigned int side) const { return m_ends[side].m_address; }
+
+	const LinkStats& stats(unsigned int side) const { return m_ends[side].m_link_stats; }
+
+	// Virtual time, only moves forward
+	net_time now() const { return m_now; }
+	void advance_to(net_time time);
+
+	// When the next datagram in flight arrives (`net_time::max()` if none)
+	net_time next_arrival() const;
+
+	// Run two connections over the link until `end`: each sends every `send_interval()`
+	// and processes the datagrams as they arrive
+	// `tick(side, now)` is called before every send (eg. to queue messages), may be empty
+	void run(Connection& a, Connection& b, net_time end, const std::function<void(unsigned int, net_time)>& tick);
+
+private:
+	LinkEmulator(const LinkEmulator&);
+
+	struct InFlight
+	{
+		InFlight(net_time arrival, uint64_t order, const Packet& packet)
+			: arrival(arrival)
+			, order(order)
+			, packet(packet)
+		{ }
+
+		// Earliest first, in sending order on ties
+		bool operator<(const InFlight& rhs) const {
+			return arrival != rhs.arrival ? arrival > rhs.arrival : order > rhs.order;
+		}
+
+		net_time arrival;
+		uint64_t order;
+		Packet packet;
+	};
+
+	class End : public Transport
+	{
+	public:
+		End();
+
+		virtual unsigned int receive(PacketPool& pool, Datagram *out, unsigned int count);
+		virtual void send(const Address& addr, const Packet& packet);
+
+	private:
+		friend class LinkEmulator;
+
+		LinkEmulator *m_link;
+		unsigned int m_side;
+		Address m_address;
+		LinkConditions m_conditions;
+		LinkStats m_link_stats;
+		// Datagrams on their way to this end
+		std::priority_queue<InFlight> m_incoming;
+		// When the bottleneck of the outgoing direction is free again
+		net_time m_busy_until;
+		// Gilbert-Elliott state of the outgoing direction
+		bool m_bad;
+	};
+
+	// Put a datagram sent by `from` on the way to the other end
+	void transmit(End& from, const Packet& packet);
+	bool chance(double p);
+
+	net_time m_now;
+	uint64_t m_order;
+	std::mt19937 m_random;
+	End m_ends[2];
+};
+
+#endif
\ No newline at end of file
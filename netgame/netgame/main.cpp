@@ -5,15 +5,40 @@
 #include "protocol.h"
 #include "packet.h"
 #include "connection.h"
-
+#include "transport.h"
+#include "uring_transport.h"
+#include "handshake.h"
+#include "server.h"
+#include "event_loop.h"
+#include "timing.h"
+#include "bench.h"
+#include "checks.h"
+
+#include <atomic>
 #include <memory>
 #include <thread>
+#include <vector>
 #include <map>
 #include <iostream>
 
 NetServiceHandle handle;
 
-void server(unsigned short port)
+// How often the server and the client print their metrics
+const std::chrono::seconds METRICS_DUMP_INTERVAL(5);
+
+// Clients and duration of the load test
+const unsigned int LOAD_CLIENTS = 2000;
+const unsigned int LOAD_SECONDS = 10;
+
+// How the single threaded server moves datagrams
+enum ServerIo
+{
+	IO_SINGLE,
+	IO_BATCHED,
+	IO_URING,
+};
+
+void server(unsigned short port, ServerIo io)
 {
 	Address address = Address::inet_any(port);
 	Socket socket(address, SocketType::UDP);
@@ -23,38 +48,72 @@ void server(unsigned short port)
 	if (ret != 0)
 		std::cout << "Failed to set the socket non-blocking (" << ret << ")" << std::endl;
 
-	std::map<Address, Connection> connections;
-
-	PacketPool recvPool(MAX_PACKET_SIZE);
-	Address recva(sizeof (sockaddr_in));
+	std::unique_ptr<Transport> transport;
+	int readyFd = socket.get_handle();
+#ifdef __linux__
+	if (io == IO_URING) {
+		std::unique_ptr<UringTransport> uring(new UringTransport(socket.get_handle()));
+		if (uring->is_open()) {
+			// The completions are waited for instead of the socket
+			readyFd = uring->event_fd();
+			transport = std::move(uring);
+		} else {
+			std::cout << "io_uring is not available" << std::endl;
+			io = IO_BATCHED;
+		}
+	}
+#else
+	if (io == IO_URING)
+		io = IO_BATCHED;
+#endif
+	if (io == IO_BATCHED)
+		transport.reset(new BatchTransport(socket, IO_BATCH_SIZE));
+	else if (io == IO_SINGLE)
+		transport.reset(new SocketTransport(socket));
+	std::cout << "Using " << (io == IO_URING ? "io_uring" : io == IO_BATCHED ? "batched" : "single") << " datagram I/O" << std::endl;
+
+	ServerShard shard(std::move(transport));
+	shard.set_metrics_dump(&std::cout, METRICS_DUMP_INTERVAL, false);
+	EventLoop loop;
+	loop.watch(readyFd);
 
 	while (true)
 	{
-		Packet recvp;
-		while (!(recvp = recvPool.allocate(socket.receive_from(recva, recvPool.nextData(), recvPool.nextSize()))).empty()) {
-			auto it = connections.find(recva);
-			if (it == connections.end()) {
-				// A new connection
-				std::cout << "New connection " << recva << std::endl;
-				connections[recva] = Connection(recva, 0xDEADBEEF);
-				connections[recva].m_DEBUG_packet_loss = 0.5f;
-				std::cout << "Creating a connection with the magic number " << 0xDEADBEEF << std::endl;
-				char buf[4]; NetWriter writer(buf, 4); writer.write(0xDEADBEEF);
-				socket.send_to(recva, writer.data(), writer.write_amount());
-			} else {
-				it->second.process_packet(recvp);
-			}
-		}
-
-		for (auto& conn : connections) {
-			conn.second.DEBUG_print_status();
-			conn.second.send_outgoing(socket);
-		}
-		std::this_thread::sleep_for(std::chrono::milliseconds(33));
+		shard.receive();
+		shard.tick(net_clock::now());
+		loop.wait_until(shard.next_deadline());
 	}
 
 }
 
+void sharded_server(unsigned short port)
+{
+	ShardedServer server(port, std::thread::hardware_concurrency(), ShardedServer::STEER_REUSEPORT, true);
+	server.run();
+}
+
+void pipelined_server(unsigned short port)
+{
+	// Receive, shards and send on their own cores
+	unsigned int cores = std::thread::hardware_concurrency();
+	ShardedServer server(port, cores > 2 ? cores - 2 : 1, ShardedServer::STEER_HASH, true, true);
+	server.set_cpu_affinity(true);
+
+	// Print the queue metrics on the side until the server stops
+	std::atomic<bool> running(true);
+	EventLoop metricsLoop;
+	std::thread metrics([&]() {
+		while (running) {
+			metricsLoop.wait_until(net_clock::now() + METRICS_DUMP_INTERVAL);
+			write_pipeline_metrics_text(std::cout, server.pipeline_metrics());
+		}
+	});
+	server.run();
+	running = false;
+	metricsLoop.notify();
+	metrics.join();
+}
+
 void client(const char* addr, const char* port)
 {
 	Address address = *Address::find_by_name(addr, port, SocketType::UDP, AF_INET).begin();
@@ -66,48 +125,126 @@ void client(const char* addr, const char* port)
 	if (ret != 0)
 		std::cout << "Failed to set the socket non-blocking (" << ret << ")" << std::endl;
 	std::cout << "Connecting to " << address << std::endl;
-	std::cout << "Sent connection request (" << socket.send_to(address, "ebin", 4) << ")" << std::endl;
 
 	Connection connection;
+	SocketTransport transport(socket);
+	EventLoop loop;
+	loop.watch(socket.get_handle());
 
 	PacketPool recvPool(MAX_PACKET_SIZE);
-	
-	while (true) {
-		Packet recvp = recvPool.allocate(socket.receive(recvPool.nextData(), recvPool.nextSize()));
-		if (!recvp.empty()) {
+
+	// Handshake, the last datagram is repeated until the server answers it
+	std::vector<char> handshake(HANDSHAKE_REQUEST_SIZE, 0);
+	NetWriter(handshake.data(), (unsigned int)handshake.size()).write(HANDSHAKE_REQUEST);
+	net_time nextTry = net_clock::now();
+	bool connected = false;
+	while (!connected) {
+		if (net_clock::now() >= nextTry) {
+			socket.send_to(address, handshake.data(), (int)handshake.size());
+			nextTry = net_clock::now() + HANDSHAKE_RETRY_INTERVAL;
+		}
+
+		Packet recvp;
+		while (!connected && !(recvp = recvPool.allocate(socket.receive(recvPool.nextData(), recvPool.nextSize()))).empty()) {
 			NetReader reader = recvp.read();
-			magic_t magic;
-			if (!reader.read(magic)) {
+			magic_t type, magic;
+			if (!reader.read(type))
 				continue;
+			if (type == HANDSHAKE_CHALLENGE) {
+				// Echo the cookie
+				std::cout << "Answering the challenge" << std::endl;
+				handshake.assign(recvp.data(), recvp.data() + recvp.size());
+				NetWriter(handshake.data(), (unsigned int)handshake.size()).write(HANDSHAKE_RESPONSE);
+				nextTry = net_clock::now();
+			} else if (type == HANDSHAKE_ACCEPT && reader.read(magic)) {
+				std::cout << "Established a connection with the magic number " << magic << std::endl;
+				connection = Connection(address, magic, net_clock::now());
+				connected = true;
 			}
-			std::cout << "Established a connection with the magic number " << magic << std::endl;
-			connection = Connection(address, magic);
-			break;
 		}
+		if (!connected)
+			loop.wait_until(nextTry);
 	}
 
+	net_time nextSend = net_clock::now();
+	net_time nextDump = nextSend + METRICS_DUMP_INTERVAL;
 	while (true) {
 		Packet recvp;
 		while (!(recvp = recvPool.allocate(socket.receive(recvPool.nextData(), recvPool.nextSize()))).empty()) {
-			connection.process_packet(recvp);
+			connection.process_packet(recvp, net_clock::now());
 		}
-		
-		connection.send_outgoing(socket);
 
-		connection.DEBUG_print_status();
+		net_time now = net_clock::now();
+		if (now >= nextSend) {
+			connection.send_outgoing(transport, now);
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(33));
+			if (now >= nextDump) {
+				write_metrics_text(std::cout, "client", connection.metrics());
+				nextDump = now + METRICS_DUMP_INTERVAL;
+			}
+
+			nextSend += connection.send_interval();
+			if (nextSend <= now)
+				nextSend = now + connection.send_interval();
+		}
+
+		loop.wait_until(nextSend);
 	}
 }
 
+void run_benchmarks()
+{
+	bench_transport();
+	bench_packet_handoff();
+	bench_pool();
+	bench_channel_receive();
+	bench_packer();
+	bench_ack();
+	bench_compression();
+	bench_broadcast();
+	bench_connection_store();
+}
+
 int main(int argc, char **argv)
 {
-	switch (getchar()) {
+	// The mode is the first argument, or read from the input
+	int mode = argc > 1 ? argv[1][0] : getchar();
+	unsigned int failures = 0;
+	switch (mode) {
 	case 'c':
 		client("localhost", "1337");
 		break;
 	case 's':
-		server(1337);
+		server(1337, IO_SINGLE);
+		break;
+	case 'S':
+		server(1337, IO_BATCHED);
+		break;
+	case 'u':
+		server(1337, IO_URING);
+		break;
+	case 'm':
+		sharded_server(1337);
+		break;
+	case 'p':
+		pipelined_server(1337);
+		break;
+	case 't':
+		failures = run_checks(std::cout);
+		break;
+	case 'j':
+		// Everything as JSON lines, to keep and compare
+		set_bench_output(std::cout, true);
+		run_benchmarks();
+		bench_load(LOAD_CLIENTS, LOAD_SECONDS);
+		break;
+	case 'b':
+		run_benchmarks();
+		break;
+	case 'l':
+		bench_load(LOAD_CLIENTS, LOAD_SECONDS);
 		break;
 	}
+	failures += bench_failures();
+	return failures != 0 ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include "metrics.h"
+
+#include <algorithm>
+
+#include "util.h"
+
+Histogram::Histogram()
+	: count(0)
+	, sum(0)
+	, max(0)
+{
+	std::fill(buckets, buckets + HISTOGRAM_BUCKETS, 0ull);
+}
+
+void Histogram::add(uint64_t value)
+{
+	unsigned int bucket = 0;
+	if (value > 0) {
+		uint32_t clamped = (uint32_t)std::min<uint64_t>(value, UINT32_MAX);
+		bucket = std::min(highest_bit(clamped), HISTOGRAM_BUCKETS - 1);
+	}
+	buckets[bucket]++;
+	count++;
+	sum += value;
+	max = std::max(max, value);
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+	if (count == 0)
+		return 0;
+	double rank = p * count;
+	unsigned long long seen = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (seen + buckets[i] > rank) {
+			// Assume the values are spread evenly over the bucket
+			double low = i == 0 ? 0.0 : (double)(1ull << i);
+			double high = (double)(2ull << i);
+			uint64_t value = (uint64_t)(low + (high - low) * (rank - seen) / buckets[i]);
+			return std::min(value, max);
+		}
+		seen += buckets[i];
+	}
+	return max;
+}
+
+ChannelMetrics::ChannelMetrics()
+	: id(0)
+	, messages_sent(0)
+	, bytes_sent(0)
+	, messages_resent(0)
+	, messages_received(0)
+	, bytes_received(0)
+	, messages_dropped(0)
+	, queued(0)
+	, buffered(0)
+{
+}
+
+ConnectionMetrics::ConnectionMetrics()
+	: datagrams_sent(0)
+	, bytes_sent(0)
+	, payload_bytes(0)
+	, fragments_sent(0)
+	, probes_sent(0)
+	, datagrams_received(0)
+	, bytes_received(0)
+	, fragments_received(0)
+	, duplicates(0)
+	, rejected(0)
+	, packets_lost(0)
+	, timeouts(0)
+	, srtt_us(0)
+	, rto_us(0)
+	, bandwidth(0)
+	, packet_size(0)
+	, packets_in_flight(0)
+	, pool_pages(0)
+{
+}
+
+void write_metrics_text(std::ostream& out, const char *name, const ConnectionMetrics& m)
+{
+	out << name
+		<< " sent " << m.datagrams_sent << "/" << m.bytes_sent << "B"
+		<< " recv " << m.datagrams_received << "/" << m.bytes_received << "B"
+		<< " lost " << m.packets_lost << " (timeouts " << m.timeouts << ")"
+		<< " dup " << m.duplicates << " rejected " << m.rejected
+		<< " frags " << m.fragments_sent << "/" << m.fragments_received
+		<< " efficiency " << m.efficiency()
+		<< " rtt " << m.srtt_us << "us (p50 " << m.rtt.percentile(0.5) << " p99 " << m.rtt.percentile(0.99) << ")"
+		<< " jitter p99 " << m.jitter.percentile(0.99) << "us"
+		<< " rto " << m.rto_us << "us"
+		<< " rate " << m.bandwidth << "B/s mtu " << m.packet_size
+		<< " in-flight " << m.packets_in_flight << " pages " << m.pool_pages
+		<< " compression " << m.compression.ratio() << "\n";
+	for (auto& c : m.channels) {
+		out << "  channel " << c.id
+			<< " sent " << c.messages_sent << "/" << c.bytes_sent << "B"
+			<< " resent " << c.messages_resent
+			<< " recv " << c.messages_received << "/" << c.bytes_received << "B"
+			<< " dropped " << c.messages_dropped
+			<< " queued " << c.queued << " buffered " << c.buffered << "\n";
+	}
+}
+
+static void write_histogram_json(std::ostream& out, const Histogram& h)
+{
+	out << "{\"count\":" << h.count << ",\"mean\":" << h.mean() << ",\"p50\":" << h.percentile(0.5)
+		<< ",\"p99\":" << h.percentile(0.99) << ",\"max\":" << h.max << ",\"buckets\":[";
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		out << (i ? "," : "") << h.buckets[i];
+	out << "]}";
+}
+
+void write_metrics_json(std::ostream& out, const char *name, const ConnectionMetrics& m)
+{
+	out << "{\"name\":\"" << name << "\""
+		<< ",\"datagrams_sent\":" << m.datagrams_sent
+		<< ",\"bytes_sent\":" << m.bytes_sent
+		<< ",\"payload_bytes\":" << m.payload_bytes
+		<< ",\"efficiency\":" << m.efficiency()
+		<< ",\"fragments_sent\":" << m.fragments_sent
+		<< ",\"probes_sent\":" << m.probes_sent
+		<< ",\"datagrams_received\":" << m.datagrams_received
+		<< ",\"bytes_received\":" << m.bytes_received
+		<< ",\"fragments_received\":" << m.fragments_received
+		<< ",\"duplicates\":" << m.duplicates
+		<< ",\"rejected\":" << m.rejected
+		<< ",\"packets_lost\":" << m.packets_lost
+		<< ",\"timeouts\":" << m.timeouts
+		<< ",\"srtt_us\":" << m.srtt_us
+		<< ",\"rto_us\":" << m.rto_us
+		<< ",\"bandwidth\":" << m.bandwidth
+		<< ",\"packet_size\":" << m.packet_size
+		<< ",\"packets_in_flight\":" << m.packets_in_flight
+		<< ",\"pool_pages\":" << m.pool_pages
+		<< ",\"compression_ratio\":" << m.compression.ratio()
+		<< ",\"rtt\":";
+	write_histogram_json(out, m.rtt);
+	out << ",\"jitter\":";
+	write_histogram_json(out, m.jitter);
+	out << ",\"channels\":[";
+	for (size_t i = 0; i < m.channels.size(); i++) {
+		const ChannelMetrics& c = m.channels[i];
+		out << (i ? "," : "")
+			<< "{\"id\":" << c.id
+			<< ",\"messages_sent\":" << c.messages_sent
+			<< ",\"bytes_sent\":" << c.bytes_sent
+			<< ",\"messages_resent\":" << c.messages_resent
+			<< ",\"messages_received\":" << c.messages_received
+			<< ",\"bytes_received\":" << c.bytes_received
+			<< ",\"messages_dropped\":" << c.messages_dropped
+			<< ",\"queued\":" << c.queued
+			<< ",\"buffered\":" << c.buffered << "}";
+	}
+	out << "]}";
+}
+
+MetricsPublisher::MetricsPublisher()
+	: m_wanted(true)
+{
+}
+
+ConnectionMetrics MetricsPublisher::snapshot()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_wanted.store(true, std::memory_order_relaxed);
+	return m_published;
+}
+
+void MetricsPublisher::publish(const ConnectionMetrics& metrics)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// Reuses the buffers of the last copy
+	m_published = metrics;
+	m_wanted.store(false, std::memory_order_relaxed);
+}
\ No newline at end of file
@@ -0,0 +1,122 @@
+#ifndef _NETGAME_METRICS_H
+#define _NETGAME_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "protocol.h"
+#include "compress.h"
+
+// Number of power-of-two buckets of a histogram (microseconds up to ~8 seconds)
+const unsigned int HISTOGRAM_BUCKETS = 24;
+
+// Counts of values in power-of-two buckets, bucket `i` holds [2^i, 2^(i+1)) (and 0 is in the first)
+// Adding is a bit scan and an increment so it can stay on in release builds
+struct Histogram
+{
+	Histogram();
+
+	void add(uint64_t value);
+
+	// Estimate of the `p` quantile (0 to 1), interpolated in the bucket it falls in
+	uint64_t percentile(double p) const;
+	double mean() const { return count ? (double)sum / count : 0.0; }
+
+	unsigned long long buckets[HISTOGRAM_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;
+	uint64_t max;
+};
+
+// Traffic of one channel (both directions)
+struct ChannelMetrics
+{
+	ChannelMetrics();
+
+	channel_id_t id;
+	unsigned long long messages_sent;
+	unsigned long long bytes_sent;
+	// Messages (or fragments) queued again after a loss
+	unsigned long long messages_resent;
+	unsigned long long messages_received;
+	unsigned long long bytes_received;
+	// Received messages too far ahead for the receive window to widen to
+	unsigned long long messages_dropped;
+
+	// Messages waiting to be sent and received ones not read yet (filled in snapshots)
+	unsigned int queued;
+	unsigned int buffered;
+};
+
+// Counters of a connection, the gauges and channels are filled in when a snapshot is taken
+struct ConnectionMetrics
+{
+	ConnectionMetrics();
+
+	// Share of the sent datagram bytes that were message payloads
+	double efficiency() const { return bytes_sent ? (double)payload_bytes / bytes_sent : 0.0; }
+
+	unsigned long long datagrams_sent;
+	unsigned long long bytes_sent;
+	unsigned long long payload_bytes;
+	unsigned long long fragments_sent;
+	unsigned long long probes_sent;
+	unsigned long long datagrams_received;
+	unsigned long long bytes_received;
+	unsigned long long fragments_received;
+	// Received packets that were duplicates or didn't parse (eg. wrong magic)
+	unsigned long long duplicates;
+	unsigned long long rejected;
+	// Sent packets considered lost, and those found by a retransmission timeout
+	unsigned long long packets_lost;
+	unsigned long long timeouts;
+
+	// Round-trip samples and the difference between consecutive ones (microseconds)
+	Histogram rtt;
+	Histogram jitter;
+
+	// Gauges
+	unsigned long long srtt_us;
+	unsigned long long rto_us;
+	unsigned int bandwidth;
+	unsigned int packet_size;
+	unsigned int packets_in_flight;
+	unsigned int pool_pages;
+	CompressionStats compression;
+
+	std::vector<ChannelMetrics> channels;
+};
+
+// One line per connection and per channel
+void write_metrics_text(std::ostream& out, const char *name, const ConnectionMetrics& m);
+
+// One JSON object (no trailing newline)
+void write_metrics_json(std::ostream& out, const char *name, const ConnectionMetrics& m);
+
+// Hands the metrics of a connection to other threads
+// The owner publishes a copy only after a reader asked for it, so an unwatched
+// connection pays nothing
+class MetricsPublisher
+{
+public:
+	MetricsPublisher();
+
+	// The last published metrics (any thread), asks the owner for fresh ones
+	ConnectionMetrics snapshot();
+
+	// Whether a reader is waiting for fresh metrics (owner thread)
+	bool wanted() const { return m_wanted.load(std::memory_order_relaxed); }
+	void publish(const ConnectionMetrics& metrics);
+
+private:
+	MetricsPublisher(const MetricsPublisher&);
+
+	std::mutex m_mutex;
+	ConnectionMetrics m_published;
+	std::atomic<bool> m_wanted;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include "mtu.h"
+
+#include <algorithm>
+
+// Time before searching again for a larger size (the path may have changed)
+const std::chrono::seconds MTU_RAISE_INTERVAL(600);
+
+PathMtu::PathMtu()
+	: m_size(MIN_PACKET_SIZE)
+	, m_max(MAX_PACKET_SIZE)
+	, m_high(MAX_PACKET_SIZE + 1)
+	, m_attempts(0)
+	, m_in_flight(false)
+	, m_losses(0)
+	, m_lost_size(0)
+{
+}
+
+void PathMtu::set_max(unsigned int size)
+{
+	m_max = std::max(std::min(size, MAX_PACKET_SIZE), MIN_PACKET_SIZE);
+	m_size = std::min(m_size, m_max);
+	m_high = m_max + 1;
+	m_attempts = 0;
+}
+
+unsigned int PathMtu::next_probe() const
+{
+	// The largest size first, most paths carry a full Ethernet frame
+	if (m_high == m_max + 1)
+		return m_max;
+	return (m_size + m_high) / 2;
+}
+
+unsigned int PathMtu::probe_size(net_time now) const
+{
+	if (m_in_flight || m_size >= m_max)
+		return 0;
+	// A new search starts from the top
+	if (done())
+		return now < m_raise_time ? 0 : m_max;
+	return next_probe();
+}
+
+void PathMtu::probe_sent()
+{
+	// A new search after the raise interval
+	if (done())
+		m_high = m_max + 1;
+	m_in_flight = true;
+}
+
+void PathMtu::probe_acked(unsigned int size, net_time now)
+{
+	m_in_flight = false;
+	m_attempts = 0;
+	if (size > m_size)
+		m_size = size;
+	if (done())
+		search_ended(now);
+}
+
+void PathMtu::probe_lost(unsigned int size, net_time now)
+{
+	m_in_flight = false;
+	if (++m_attempts < MTU_PROBE_ATTEMPTS)
+		return;
+	m_attempts = 0;
+	m_high = std::min(m_high, size);
+	if (done())
+		search_ended(now);
+}
+
+void PathMtu::packet_acked(unsigned int size)
+{
+	if (size >= m_lost_size)
+		m_losses = 0;
+}
+
+bool PathMtu::packet_lost(unsigned int size, net_time now)
+{
+	// Packets that small always get through, they were lost to congestion
+	if (size <= MIN_PACKET_SIZE)
+		return false;
+	m_lost_size = m_losses == 0 ? size : std::min(m_lost_size, size);
+	if (++m_losses < MTU_BLACK_HOLE_LOSSES)
+		return false;
+	m_losses = 0;
+
+	// Search again from the top, the next probe is the largest size
+	m_size = MIN_PACKET_SIZE;
+	m_high = m_max + 1;
+	m_attempts = 0;
+	m_raise_time = now;
+	return true;
+}
+
+void PathMtu::search_ended(net_time now)
+{
+	m_raise_time = now + MTU_RAISE_INTERVAL;
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef _NETGAME_MTU_H
+#define _NETGAME_MTU_H
+
+#include "protocol.h"
+#include "timing.h"
+
+// Probes sent for a size before it's considered too large (a single loss can be chance)
+const unsigned int MTU_PROBE_ATTEMPTS = 3;
+
+// The search stops when the largest working and smallest failed sizes are this close
+const unsigned int MTU_SEARCH_STEP = 32;
+
+// Packets larger than `MIN_PACKET_SIZE` lost in a row, with none as large acked in
+// between, before the path is taken to have stopped carrying them (a black hole)
+const unsigned int MTU_BLACK_HOLE_LOSSES = 10;
+
+// Packet size discovery (packetization layer PMTUD, RFC 8899)
+// Probes are sent padded to a larger size, an acked probe raises the packet
+// size and one lost `MTU_PROBE_ATTEMPTS` times lowers the next probe (binary search)
+// If the path shrinks the size falls back to `MIN_PACKET_SIZE` and the search starts
+// over, the fragments of sent messages are cut again when they are resent
+class PathMtu
+{
+public:
+	PathMtu();
+
+	// Largest size to probe for (at most `MAX_PACKET_SIZE`), `MIN_PACKET_SIZE` turns the discovery off
+	void set_max(unsigned int size);
+
+	// Size of the packets to send
+	unsigned int packet_size() const { return m_size; }
+
+	// Size of the probe to send now, or 0 if no probe should be sent
+	unsigned int probe_size(net_time now) const;
+
+	void probe_sent();
+	void probe_acked(unsigned int size, net_time now);
+	void probe_lost(unsigned int size, net_time now);
+
+	// A packet that isn't a probe got through or was lost
+	// Returns true if the size fell back because of the losses
+	void packet_acked(unsigned int size);
+	bool packet_lost(unsigned int size, net_time now);
+
+	// Whether the search has ended (until the next raise interval)
+	bool done() const { return m_high - m_size < MTU_SEARCH_STEP; }
+
+private:
+	// Next size to probe, halfway to the smallest failed size
+	unsigned int next_probe() const;
+	void search_ended(net_time now);
+
+	unsigned int m_size;
+	unsigned int m_max;
+	// Smallest size known not to work (or `m_max + 1`)
+	unsigned int m_high;
+	unsigned int m_attempts;
+	bool m_in_flight;
+	// Large packets lost in a row and the smallest of them
+	unsigned int m_losses;
+	unsigned int m_lost_size;
+	// When to search again after the search ended
+	net_time m_raise_time;
+};
+
+#endif
\ No newline at end of file
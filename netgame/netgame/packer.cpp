@@ -0,0 +1,103 @@
+#include "packer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "util.h"
+
+Packer::Packer(unsigned int packetSize)
+	: m_count(0)
+	, m_packet_size(packetSize)
+{
+	for (unsigned int i = 0; i < NUM_BUCKETS; i++)
+		m_buckets[i] = -1;
+	memset(m_bits, 0, sizeof(m_bits));
+}
+
+void Packer::add(SendPacket&& p)
+{
+	unsigned int size = p.wire_size();
+	m_count++;
+
+	if (size > max_single_packet_message_size(m_packet_size)) {
+		m_large.insert(std::make_pair(size, std::move(p)));
+		return;
+	}
+
+	// Push to the front of the bucket's list
+	m_next.push_back(m_buckets[size]);
+	m_buckets[size] = (int)m_items.size();
+	m_items.push_back(std::move(p));
+	m_bits[size / 32] |= 1u << (size % 32);
+}
+
+int Packer::find_bucket(unsigned int size) const
+{
+	if (size >= NUM_BUCKETS)
+		size = NUM_BUCKETS - 1;
+
+	// Mask off the buckets larger than `size` in the first word
+	int word = size / 32;
+	uint32_t bits = m_bits[word];
+	if (size % 32 != 31)
+		bits &= (1u << (size % 32 + 1)) - 1;
+
+	while (true) {
+		if (bits != 0)
+			return word * 32 + highest_bit(bits);
+		if (word == 0)
+			return -1;
+		bits = m_bits[--word];
+	}
+}
+
+void Packer::take_bucket(unsigned int bucket, SendPacket& out)
+{
+	int index = m_buckets[bucket];
+	out = std::move(m_items[index]);
+	m_buckets[bucket] = m_next[index];
+	if (m_next[index] < 0)
+		m_bits[bucket / 32] &= ~(1u << (bucket % 32));
+	m_count--;
+}
+
+bool Packer::take_largest(SendPacket& out)
+{
+	if (!m_large.empty()) {
+		auto it = m_large.begin();
+		out = std::move(it->second);
+		m_large.erase(it);
+		m_count--;
+		return true;
+	}
+	int bucket = find_bucket(NUM_BUCKETS - 1);
+	if (bucket < 0)
+		return false;
+	take_bucket(bucket, out);
+	return true;
+}
+
+bool Packer::take_fitting(unsigned int offset, SendPacket& out)
+{
+	if (offset + MSG_HEADER_SIZE > m_packet_size)
+		return false;
+	int bucket = find_bucket(m_packet_size - MSG_HEADER_SIZE - offset);
+	if (bucket < 0)
+		return false;
+	take_bucket(bucket, out);
+	return true;
+}
+
+bool Packer::take_less_fragmented(unsigned int offset, SendPacket& out)
+{
+	// Messages that fit in a new packet are never fragmented, so only the large ones can qualify
+	for (auto it = m_large.begin(); it != m_large.end(); ++it) {
+		if (fragment_count(offset, it->first, m_packet_size) < fragment_count(HEADER_SIZE, it->first, m_packet_size)) {
+			out = std::move(it->second);
+			m_large.erase(it);
+			m_count--;
+			return true;
+		}
+	}
+	return false;
+}
\ No newline at end of file
@@ -0,0 +1,158 @@
+#ifndef _NETGAME_PACKER_H
+#define _NETGAME_PACKER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "protocol.h"
+#include "channel.h"
+#include "packet.h"
+
+// A message waiting to be packed into a datagram
+struct SendPacket
+{
+	SendPacket()
+		: seq(0)
+		, chan(0)
+		, reliable(false)
+		, wants_ack(false)
+		, frag_index(0)
+		, frag_count(0)
+	{
+	}
+	SendPacket(channel_id_t ch, bool rel, bool ack, ChannelOut::OutgoingPacket&& p)
+		: seq(p.seq)
+		, packet(std::move(p.packet))
+		, chan(ch)
+		, reliable(rel)
+		, wants_ack(ack)
+		, frag_index(p.frag_index)
+		, frag_count(p.frag_count)
+		, message(std::move(p.message))
+	{
+	}
+	SendPacket(SendPacket&& p)
+		: seq(p.seq)
+		, packet(std::move(p.packet))
+		, chan(p.chan)
+		, reliable(p.reliable)
+		, wants_ack(p.wants_ack)
+		, frag_index(p.frag_index)
+		, frag_count(p.frag_count)
+		, message(std::move(p.message))
+	{
+	}
+	SendPacket& operator=(SendPacket p)
+	{
+		seq = p.seq;
+		std::swap(packet, p.packet);
+		chan = p.chan;
+		reliable = p.reliable;
+		wants_ack = p.wants_ack;
+		frag_index = p.frag_index;
+		frag_count = p.frag_count;
+		std::swap(message, p.message);
+		return *this;
+	}
+
+	// A resent fragment that must be sent whole with its original fragment header
+	bool is_fragment() const { return frag_count != 0; }
+
+	// Size to pack, counted against `MSG_HEADER_SIZE` (fragments have a larger header)
+	unsigned int wire_size() const {
+		return packet.size() + (is_fragment() ? FRAG_MSG_HEADER_SIZE - MSG_HEADER_SIZE : 0);
+	}
+
+	seq_t seq;
+	// The whole message, or only the fragment's data if `is_fragment()`
+	Packet packet;
+	channel_id_t chan;
+	bool reliable;
+	// Tell the channel when the message is acknowledged (not resent)
+	bool wants_ack;
+
+	fragment_id_t frag_index;
+	fragment_id_t frag_count;
+	// The whole message of a resent fragment
+	Packet message;
+};
+
+// Largest message that fits whole in a new packet of `packetSize`
+inline unsigned int max_single_packet_message_size(unsigned int packetSize)
+{
+	return packetSize - HEADER_SIZE - MSG_HEADER_SIZE;
+}
+
+// Largest message that fits whole in a new packet of any size
+const unsigned int MAX_SINGLE_PACKET_MESSAGE_SIZE = MAX_PACKET_SIZE - HEADER_SIZE - MSG_HEADER_SIZE;
+
+inline bool can_fit_any(unsigned int offset, unsigned int packetSize)
+{
+	// Can fit at least one byte
+	return offset + MSG_HEADER_SIZE < packetSize - 1;
+}
+
+// Number of packets of `packetSize` a message of `size` is split to if started at `offset`
+inline unsigned int fragment_count(unsigned int offset, unsigned int size, unsigned int packetSize)
+{
+	// Fits whole in the current packet
+	if (offset + MSG_HEADER_SIZE + size <= packetSize)
+		return 1;
+	// No room for even a fragment here
+	if (offset + FRAG_MSG_HEADER_SIZE >= packetSize)
+		return UINT_MAX;
+	// Fragments are at most `max_fragment_size()` even after a short packet header
+	unsigned int fragment = max_fragment_size(packetSize);
+	unsigned int first = std::min(packetSize - FRAG_MSG_HEADER_SIZE - offset, fragment);
+	return (size - first + fragment - 1) / fragment + 1;
+}
+
+// Index of the messages to pack during one `send_outgoing`
+// Messages that fit in a single packet are bucketed by exact size with a bitmap
+// of the non-empty buckets, so the best fit for any free space is found with a
+// few bit scans. The rare larger messages are kept in a sorted map.
+// Meant to live on the stack: it holds no memory between ticks
+class Packer
+{
+public:
+	// Packs to packets of `packetSize`
+	explicit Packer(unsigned int packetSize);
+
+	void add(SendPacket&& p);
+
+	bool empty() const { return m_count == 0; }
+	unsigned int size() const { return m_count; }
+
+	// Take the largest message
+	bool take_largest(SendPacket& out);
+
+	// Take the largest message that fits whole at `offset`
+	bool take_fitting(unsigned int offset, SendPacket& out);
+
+	// Take the largest message that would be split to fewer packets if started
+	// at `offset` than if started in a new packet
+	bool take_less_fragmented(unsigned int offset, SendPacket& out);
+
+private:
+	static const unsigned int NUM_BUCKETS = MAX_SINGLE_PACKET_MESSAGE_SIZE + 1;
+	static const unsigned int NUM_WORDS = (NUM_BUCKETS + 31) / 32;
+
+	// Largest non-empty bucket <= `size` or -1
+	int find_bucket(unsigned int size) const;
+	void take_bucket(unsigned int bucket, SendPacket& out);
+
+	std::vector<SendPacket> m_items;
+	// Next item in the same bucket for every item (-1 at the end)
+	std::vector<int> m_next;
+	// First item of every bucket (-1 if empty)
+	int m_buckets[NUM_BUCKETS];
+	uint32_t m_bits[NUM_WORDS];
+	std::multimap<unsigned int, SendPacket, std::greater<unsigned int>> m_large;
+	unsigned int m_count;
+	unsigned int m_packet_size;
+};
+
+#endif
\ No newline at end of file
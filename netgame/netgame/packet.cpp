@@ -1,4 +1,8 @@
 #include "packet.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <new>
 #include <utility>
 
 Packet::Packet()
@@ -13,7 +17,7 @@ Packet::Packet(char *buf, unsigned int start, unsigned int size)
 	, m_size(size)
 {
 	if (m_buffer != nullptr)
-		++*reinterpret_cast<unsigned int*>(m_buffer);
+		PacketPool::retain(m_buffer);
 }
 Packet::Packet(const Packet& p)
 	: m_buffer(p.m_buffer)
@@ -22,7 +26,7 @@ Packet::Packet(const Packet& p)
 {
 	// Increase refcount
 	if (m_buffer != nullptr)
-		++*reinterpret_cast<unsigned int*>(m_buffer);
+		PacketPool::retain(m_buffer);
 }
 Packet::Packet(Packet&& p)
 	: m_buffer(p.m_buffer)
@@ -42,76 +46,475 @@ Packet::~Packet()
 {
 	// Decrease refcount
 	if (m_buffer != nullptr)
-		--*reinterpret_cast<unsigned int*>(m_buffer);
+		PacketPool::release(m_buffer);
 }
 Packet Packet::subpacket(unsigned int start, unsigned int size) const
 {
 	return Packet(m_buffer, m_start + start, size);
 }
 
-// Pages contain a refcount block before the data
-#define PAGE_HEADER_SIZE (sizeof(unsigned int))
+// Size classes of the pages
+enum
+{
+	// Shared by many packets, allocated with `allocate()`
+	CLASS_SMALL = 0,
+	// One buffer of `maxBufferSize` per page
+	CLASS_BUFFER = 1,
+	// One buffer of a custom size per page, never reused
+	CLASS_OVERSIZE = 2,
+
+	NUM_RECYCLED_CLASSES = 2,
+};
+
+// How many `trim()` calls a page needs to stay free before it can be released
+const unsigned int TRIM_IDLE_CALLS = 30;
+
+// Pages kept around by default
+const unsigned int DEFAULT_HIGH_WATER = 8;
+
+// Pages contain a header before the data, packets point to the start of the page
+struct PacketPool::PageHeader
+{
+	std::atomic<unsigned int> refcount;
+	// Copy of `Shared::concurrent` so the refcount operations don't need the pool
+	bool concurrent;
+	unsigned int size_class;
+	// Index in `Shared::pages`
+	unsigned int index;
+	// Value of `Shared::trim_calls` when the page was freed
+	unsigned int free_since;
+	Shared *pool;
+	// Next page in the free list or the return queue
+	PageHeader *next_free;
+};
+
+// Keep the data aligned after the header
+#define PAGE_HEADER_SIZE ((sizeof(PacketPool::PageHeader) + 15) & ~15)
+
+// Counter that is only atomic if it needs to be
+// (a relaxed load and store compile to plain memory operations)
+inline void counter_add(std::atomic<unsigned int>& c, bool concurrent)
+{
+	if (concurrent)
+		c.fetch_add(1, std::memory_order_relaxed);
+	else
+		c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+// Returns true if the counter reached zero
+inline bool counter_sub(std::atomic<unsigned int>& c, bool concurrent)
+{
+	if (concurrent)
+		return c.fetch_sub(1, std::memory_order_acq_rel) == 1;
+	unsigned int value = c.load(std::memory_order_relaxed) - 1;
+	c.store(value, std::memory_order_relaxed);
+	return value == 0;
+}
+
+// Bookkeeping of a pool, lives until the pool and all of its pages are released
+struct PacketPool::Shared
+{
+	Shared(unsigned int pageSize, unsigned int bufferSize, bool concurrent)
+		: refs(1)
+		, concurrent(concurrent)
+		, returned(nullptr)
+		, high_water(DEFAULT_HIGH_WATER)
+		, trim_calls(0)
+	{
+		page_sizes[CLASS_SMALL] = pageSize;
+		page_sizes[CLASS_BUFFER] = bufferSize ? bufferSize + PAGE_HEADER_SIZE : 0;
+		for (unsigned int i = 0; i < NUM_RECYCLED_CLASSES; i++)
+			free_list[i] = nullptr;
+	}
+	~Shared()
+	{
+		for (auto page : pages)
+			delete[] reinterpret_cast<char*>(page);
+	}
+
+	PageHeader *new_page(unsigned int sizeClass, unsigned int size)
+	{
+		PageHeader *page = reinterpret_cast<PageHeader*>(new char[size]);
+		new (&page->refcount) std::atomic<unsigned int>(0);
+		page->concurrent = concurrent;
+		page->size_class = sizeClass;
+		page->index = (unsigned int)pages.size();
+		page->pool = this;
+		page->next_free = nullptr;
+		pages.push_back(page);
+
+		stats.pages_created++;
+		stats.pages = (unsigned int)pages.size();
+		stats.peak_pages = std::max(stats.peak_pages, stats.pages);
+		return page;
+	}
+
+	void delete_page(PageHeader *page)
+	{
+		// Swap-remove from the page table
+		pages[page->index] = pages.back();
+		pages[page->index]->index = page->index;
+		pages.pop_back();
+		stats.pages = (unsigned int)pages.size();
+
+		delete[] reinterpret_cast<char*>(page);
+	}
+
+	// Owner thread: Put a page with no references to the free list
+	void free_page(PageHeader *page)
+	{
+		if (page->size_class == CLASS_OVERSIZE) {
+			delete_page(page);
+			return;
+		}
+		page->free_since = trim_calls;
+		page->next_free = free_list[page->size_class];
+		free_list[page->size_class] = page;
+		stats.free_pages++;
+	}
+
+	// Owner thread: Move the pages released by other threads to the free lists
+	void drain_returned()
+	{
+		PageHeader *page = returned.exchange(nullptr, std::memory_order_acquire);
+		while (page != nullptr) {
+			PageHeader *next = page->next_free;
+			free_page(page);
+			page = next;
+		}
+	}
+
+	// The pool and every page in use hold a reference
+	std::atomic<unsigned int> refs;
+	const bool concurrent;
+
+	// Pages released from any thread of a concurrent pool (lock-free stack)
+	std::atomic<PageHeader*> returned;
+
+	unsigned int page_sizes[NUM_RECYCLED_CLASSES];
+	PageHeader *free_list[NUM_RECYCLED_CLASSES];
+	std::vector<PageHeader*> pages;
+	unsigned int high_water;
+	unsigned int trim_calls;
+	PacketPoolStats stats;
+};
 
 PacketPool::PacketPool()
+	: m_alloc_page(nullptr)
+	, m_alloc_ptr(0)
+	, m_page_size(0)
+	, m_packet_size(0)
+	, m_shared(nullptr)
 {
 }
 PacketPool::PacketPool(PacketPool&& p)
-	: m_pages(std::move(p.m_pages))
-	, m_alloc_page(p.m_alloc_page)
+	: m_alloc_page(p.m_alloc_page)
 	, m_alloc_ptr(p.m_alloc_ptr)
 	, m_page_size(p.m_page_size)
 	, m_packet_size(p.m_packet_size)
+	, m_shared(p.m_shared)
 {
+	p.m_alloc_page = nullptr;
+	p.m_shared = nullptr;
 }
 PacketPool& PacketPool::operator=(PacketPool p)
 {
-	m_pages.swap(p.m_pages);
-	m_alloc_page = p.m_alloc_page;
-	m_alloc_ptr = p.m_alloc_ptr;
-	m_page_size = p.m_page_size;
-	m_packet_size = p.m_packet_size;
+	std::swap(m_alloc_page, p.m_alloc_page);
+	std::swap(m_alloc_ptr, p.m_alloc_ptr);
+	std::swap(m_page_size, p.m_page_size);
+	std::swap(m_packet_size, p.m_packet_size);
+	std::swap(m_shared, p.m_shared);
 
 	return *this;
 }
-PacketPool::PacketPool(unsigned int maxPacketSize)
-	: m_alloc_page(0)
-	, m_alloc_ptr(PAGE_HEADER_SIZE)
+PacketPool::PacketPool(unsigned int maxPacketSize, unsigned int maxBufferSize, bool concurrent)
+	: m_alloc_ptr(PAGE_HEADER_SIZE)
 	, m_page_size(maxPacketSize * 10 + PAGE_HEADER_SIZE)
 	, m_packet_size(maxPacketSize)
+	, m_shared(new Shared(maxPacketSize * 10 + PAGE_HEADER_SIZE, maxBufferSize, concurrent))
+{
+	m_alloc_page = take_page(CLASS_SMALL);
+	retain(m_alloc_page);
+}
+PacketPool::~PacketPool()
 {
-	add_page();
+	if (m_shared == nullptr)
+		return;
+
+	// Drop the reference to the current page
+	release(m_alloc_page);
+
+	// The pages still in use keep the bookkeeping alive, the last one frees everything
+	if (counter_sub(m_shared->refs, m_shared->concurrent))
+		delete m_shared;
 }
 
-void PacketPool::add_page()
+void PacketPool::retain(char *data)
 {
-	m_pages.emplace_back(new char[m_page_size]);
-	*reinterpret_cast<unsigned int*>(m_pages.back().get()) = 0;
+	PageHeader *page = reinterpret_cast<PageHeader*>(data);
+	counter_add(page->refcount, page->concurrent);
+}
+
+void PacketPool::release(char *data)
+{
+	PageHeader *page = reinterpret_cast<PageHeader*>(data);
+	if (!counter_sub(page->refcount, page->concurrent))
+		return;
+
+	// Give the page back to the pool
+	Shared *shared = page->pool;
+	if (shared->concurrent) {
+		// This may be any thread, let the owner pick the page up later
+		PageHeader *head = shared->returned.load(std::memory_order_relaxed);
+		do {
+			page->next_free = head;
+		} while (!shared->returned.compare_exchange_weak(head, page,
+			std::memory_order_release, std::memory_order_relaxed));
+	} else {
+		shared->free_page(page);
+	}
+
+	// Free the bookkeeping if the pool is already gone
+	if (counter_sub(shared->refs, shared->concurrent))
+		delete shared;
+}
+
+char *PacketPool::take_page(unsigned int sizeClass)
+{
+	Shared& shared = *m_shared;
+	if (shared.concurrent)
+		shared.drain_returned();
+
+	PageHeader *page = shared.free_list[sizeClass];
+	if (page != nullptr) {
+		// Recycle a released page
+		shared.free_list[sizeClass] = page->next_free;
+		page->next_free = nullptr;
+		shared.stats.free_pages--;
+		shared.stats.pages_recycled++;
+	} else {
+		page = shared.new_page(sizeClass, shared.page_sizes[sizeClass]);
+	}
+
+	// The page is in use until its refcount drops back to zero
+	counter_add(shared.refs, shared.concurrent);
+	return reinterpret_cast<char*>(page);
 }
 
 Packet PacketPool::allocate(int size)
 {
 	if (size <= 0)
 		return Packet();
-	Packet ret(m_pages[m_alloc_page].get(), m_alloc_ptr, size);
+	Packet ret(m_alloc_page, m_alloc_ptr, size);
+
+	m_shared->stats.allocations++;
+	m_shared->stats.bytes_allocated += size;
 
 	// Advance the allocation location
 	m_alloc_ptr += size;
 	// If there is not enough room in the current page
 	if (m_alloc_ptr >= m_page_size - m_packet_size) {
-		// Try to find an empty one
-		unsigned int i;
-		for (i = 0; i < m_pages.size(); i++) {
-			if (*reinterpret_cast<unsigned int*>(m_pages[i].get()) == 0) {
-				break;
+		m_shared->stats.bytes_wasted += m_page_size - m_alloc_ptr;
+
+		// Let go of the current page and continue in a free one
+		release(m_alloc_page);
+		m_alloc_page = take_page(CLASS_SMALL);
+		retain(m_alloc_page);
+		m_alloc_ptr = PAGE_HEADER_SIZE;
+	}
+
+	return ret;
+}
+
+Packet PacketPool::allocate_buffer(unsigned int size)
+{
+	if (size == 0)
+		return Packet();
+	if (size <= m_packet_size)
+		return allocate(size);
+
+	Shared& shared = *m_shared;
+	char *page;
+	unsigned int capacity = shared.page_sizes[CLASS_BUFFER] - PAGE_HEADER_SIZE;
+	if (shared.page_sizes[CLASS_BUFFER] != 0 && size <= capacity) {
+		page = take_page(CLASS_BUFFER);
+	} else {
+		page = reinterpret_cast<char*>(shared.new_page(CLASS_OVERSIZE, size + PAGE_HEADER_SIZE));
+		counter_add(shared.refs, shared.concurrent);
+		capacity = size;
+	}
+
+	shared.stats.allocations++;
+	shared.stats.bytes_allocated += size;
+	shared.stats.bytes_wasted += capacity - size;
+	return Packet(page, PAGE_HEADER_SIZE, size);
+}
+
+void PacketPool::set_high_water(unsigned int pages)
+{
+	m_shared->high_water = pages;
+}
+
+void PacketPool::trim()
+{
+	Shared& shared = *m_shared;
+	if (shared.concurrent)
+		shared.drain_returned();
+
+	shared.trim_calls++;
+	if (shared.pages.size() <= shared.high_water)
+		return;
+
+	for (unsigned int c = 0; c < NUM_RECYCLED_CLASSES; c++) {
+		PageHeader **link = &shared.free_list[c];
+		while (*link != nullptr && shared.pages.size() > shared.high_water) {
+			PageHeader *page = *link;
+			if (shared.trim_calls - page->free_since >= TRIM_IDLE_CALLS) {
+				*link = page->next_free;
+				shared.stats.free_pages--;
+				shared.stats.pages_trimmed++;
+				shared.delete_page(page);
+			} else {
+				link = &page->next_free;
 			}
 		}
-		m_alloc_page = i;
-		m_alloc_ptr = PAGE_HEADER_SIZE;
-		// If the page doesn't exist create it
-		if (i == m_pages.size()) {
-			add_page();
+	}
+}
+
+unsigned int PacketPool::numPages() const
+{
+	return m_shared ? (unsigned int)m_shared->pages.size() : 0;
+}
+
+const PacketPoolStats& PacketPool::stats() const
+{
+	return m_shared->stats;
+}
+
+PacketChain::PacketChain()
+	: m_size(0)
+{
+}
+PacketChain::PacketChain(const Packet& p)
+	: m_first(p)
+	, m_size(p.size())
+{
+}
+PacketChain::PacketChain(const PacketChain& c)
+	: m_first(c.m_first)
+	, m_more(c.m_more)
+	, m_size(c.m_size)
+{
+}
+PacketChain::PacketChain(PacketChain&& c)
+	: m_first(std::move(c.m_first))
+	, m_more(std::move(c.m_more))
+	, m_size(c.m_size)
+{
+	c.m_size = 0;
+}
+PacketChain& PacketChain::operator=(PacketChain c)
+{
+	std::swap(m_first, c.m_first);
+	m_more.swap(c.m_more);
+	std::swap(m_size, c.m_size);
+	return *this;
+}
+
+void PacketChain::append(const Packet& p)
+{
+	if (empty())
+		m_first = p;
+	else
+		m_more.push_back(p);
+	m_size += p.size();
+}
+
+void PacketChain::resize(unsigned int slices)
+{
+	clear();
+	if (slices > 1)
+		m_more.resize(slices - 1);
+}
+
+void PacketChain::set_slice(unsigned int index, const Packet& p)
+{
+	Packet& slot = index == 0 ? m_first : m_more[index - 1];
+	m_size += p.size() - slot.size();
+	slot = p;
+}
+
+void PacketChain::clear()
+{
+	m_first = Packet();
+	m_more.clear();
+	m_size = 0;
+}
+
+Packet PacketChain::flatten(PacketPool& pool) const
+{
+	if (m_more.empty())
+		return m_first;
+	Packet p = pool.allocate_buffer(m_size);
+	copy_to(p.data());
+	return p;
+}
+
+void PacketChain::copy_to(char *out) const
+{
+	if (!m_first.empty()) {
+		memcpy(out, m_first.data(), m_first.size());
+		out += m_first.size();
+	}
+	for (auto& slice : m_more) {
+		memcpy(out, slice.data(), slice.size());
+		out += slice.size();
+	}
+}
+
+ChainReader::ChainReader(const PacketChain& chain)
+	: m_chain(chain)
+	, m_slice(0)
+	, m_offset(0)
+	, m_remaining(chain.size())
+{
+}
+
+bool ChainReader::read(char *out, unsigned int size)
+{
+	if (size > m_remaining)
+		return false;
+	m_remaining -= size;
+	while (size > 0) {
+		const Packet& slice = m_chain.slice(m_slice);
+		unsigned int n = std::min(size, slice.size() - m_offset);
+		memcpy(out, slice.data() + m_offset, n);
+		out += n;
+		size -= n;
+		m_offset += n;
+		if (m_offset == slice.size()) {
+			m_slice++;
+			m_offset = 0;
 		}
 	}
+	return true;
+}
 
-	return ret;
+const char *ChainReader::read_direct(unsigned int size)
+{
+	if (size > m_remaining)
+		return nullptr;
+	// Skip the exhausted (or empty) slices
+	while (m_slice < m_chain.num_slices() && m_offset == m_chain.slice(m_slice).size()) {
+		m_slice++;
+		m_offset = 0;
+	}
+	if (m_slice == m_chain.num_slices())
+		return nullptr;
+	const Packet& slice = m_chain.slice(m_slice);
+	if (slice.size() - m_offset < size)
+		return nullptr;
+	const char *data = slice.data() + m_offset;
+	m_offset += size;
+	m_remaining -= size;
+	return data;
 }
\ No newline at end of file
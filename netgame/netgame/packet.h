@@ -42,36 +42,161 @@ private:
 	char* m_buffer;
 };
 
+// Allocation counters of a `PacketPool`
+struct PacketPoolStats
+{
+	PacketPoolStats()
+		: allocations(0)
+		, bytes_allocated(0)
+		, bytes_wasted(0)
+		, pages_created(0)
+		, pages_recycled(0)
+		, pages_trimmed(0)
+		, pages(0)
+		, free_pages(0)
+		, peak_pages(0)
+	{ }
+
+	// Share of the used page memory lost to page tails and oversized buffers
+	double fragmentation() const {
+		unsigned long long total = bytes_allocated + bytes_wasted;
+		return total ? (double)bytes_wasted / total : 0.0;
+	}
+
+	unsigned long long allocations;
+	unsigned long long bytes_allocated;
+	unsigned long long bytes_wasted;
+	unsigned long long pages_created;
+	unsigned long long pages_recycled;
+	unsigned long long pages_trimmed;
+	unsigned int pages;
+	unsigned int free_pages;
+	unsigned int peak_pages;
+};
+
 class PacketPool
 {
 public:
 	PacketPool();
-	PacketPool(unsigned int maxPacketSize);
+	// `maxBufferSize` is the size class for `allocate_buffer()` (eg. reassembled messages)
+	// If `concurrent` the packets may be copied and released on any thread, the pool
+	// itself is still used by one thread and picks up the released pages lazily
+	PacketPool(unsigned int maxPacketSize, unsigned int maxBufferSize=0, bool concurrent=false);
 	PacketPool(PacketPool&& p);
 	PacketPool& operator=(PacketPool p);
+	~PacketPool();
 
-	char *nextData() { return &m_pages[m_alloc_page][m_alloc_ptr]; }
-	const char *nextData() const { return &m_pages[m_alloc_page][m_alloc_ptr]; }
+	char *nextData() { return m_alloc_page + m_alloc_ptr; }
+	const char *nextData() const { return m_alloc_page + m_alloc_ptr; }
 	unsigned int nextSize() const { return m_packet_size; }
 
+	// Number of `nextSize()` slots that can be filled starting from `nextData()`
+	// Allocating the slots in order with `allocate(nextSize())` returns them
+	unsigned int nextCount() const { return (m_page_size - m_alloc_ptr - 1) / m_packet_size; }
+
 	// Allocate a new packet
 	// Contains data written to the buffer pointed by `nextData()`
 	// If `size <= 0` returns an empty packet
 	Packet allocate(int size);
 
-	unsigned int numPages() const { return m_pages.size(); }
+	// Allocate an uninitialized buffer of any size
+	// Sizes up to `nextSize()` share pages with `allocate()`, larger ones get
+	// a block of `maxBufferSize` (or an unpooled block if even that is too small)
+	Packet allocate_buffer(unsigned int size);
+
+	// Keep at most `pages` pages around once they have been idle for a while
+	void set_high_water(unsigned int pages);
+
+	// Free idle pages above the high-water mark, call periodically (eg. every tick)
+	void trim();
+
+	unsigned int numPages() const;
+	const PacketPoolStats& stats() const;
 
 private:
+	friend class Packet;
+	struct Shared;
+	struct PageHeader;
+
 	PacketPool(const PacketPool& p);
 
-	void add_page();
+	static void retain(char *page);
+	static void release(char *page);
+	char *take_page(unsigned int sizeClass);
 
-	std::vector<std::unique_ptr<char[]>> m_pages;
-	unsigned int m_alloc_page;
+	// Current page of the small size class (the pool holds a reference to it)
+	char *m_alloc_page;
 	unsigned int m_alloc_ptr;
 
 	unsigned int m_page_size;
 	unsigned int m_packet_size;
+
+	// Free lists and bookkeeping, on the heap so pages can find it after the pool moves
+	Shared *m_shared;
+};
+
+// A message made of packet slices, eg. the fragments of a message as they
+// arrived or the header and payloads of a datagram to send
+// Lets large messages move around without copying them to one buffer
+class PacketChain
+{
+public:
+	PacketChain();
+	PacketChain(const Packet& p);
+	PacketChain(const PacketChain& c);
+	PacketChain(PacketChain&& c);
+	PacketChain& operator=(PacketChain c);
+
+	// Add a slice to the end
+	void append(const Packet& p);
+
+	// Set the number of slices (new ones are empty until `set_slice()`)
+	void resize(unsigned int slices);
+	void set_slice(unsigned int index, const Packet& p);
+
+	void clear();
+
+	const Packet& slice(unsigned int index) const { return index == 0 ? m_first : m_more[index - 1]; }
+	unsigned int num_slices() const { return m_first.empty() && m_more.empty() ? 0 : (unsigned int)m_more.size() + 1; }
+
+	// Total size of the slices
+	unsigned int size() const { return m_size; }
+	bool empty() const { return num_slices() == 0; }
+
+	// The message in one buffer, copied to `pool` only if it has many slices
+	Packet flatten(PacketPool& pool) const;
+
+	// Copy the whole message to `out` (must have room for `size()` bytes)
+	void copy_to(char *out) const;
+
+private:
+	// The first slice is inline so single slice chains don't allocate
+	Packet m_first;
+	std::vector<Packet> m_more;
+	unsigned int m_size;
+};
+
+// Reads a `PacketChain` like `NetReader` reads a buffer, values may cross slices
+class ChainReader
+{
+public:
+	explicit ChainReader(const PacketChain& chain);
+
+	template <typename T>
+	bool read(T& value) { return read(reinterpret_cast<char*>(&value), sizeof(T)); }
+	bool read(char *out, unsigned int size);
+
+	// Read the next `size` bytes without copying, if they are in one slice
+	// (else returns nullptr, read them with `read()`)
+	const char *read_direct(unsigned int size);
+
+	unsigned int remaining() const { return m_remaining; }
+
+private:
+	const PacketChain& m_chain;
+	unsigned int m_slice;
+	unsigned int m_offset;
+	unsigned int m_remaining;
 };
 
 #endif
\ No newline at end of file
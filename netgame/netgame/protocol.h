@@ -21,23 +21,15 @@ typedef uint8_t fragment_id_t;
 
 typedef uint32_t fragment_bitfield_t;
 
-// Can hold every count of messages
-typedef uint8_t message_count_t;
-
 // Can hold every size of a message sent over a channel
 typedef uint16_t message_size_t;
 
-// Maxium size of a packet to send
-const unsigned int MAX_PACKET_SIZE = 512;
-
-// Packet header size
-const unsigned int HEADER_SIZE = sizeof(magic_t) + 2 * sizeof(seq_t) + sizeof(ack_bitfield_t) + sizeof(message_count_t);
-
-// Message header size
-const unsigned int MSG_HEADER_SIZE = sizeof(channel_id_t) + sizeof(seq_t) + sizeof(message_size_t) + sizeof(fragment_id_t);
+// Size of the packets every connection starts with (fits any path)
+const unsigned int MIN_PACKET_SIZE = 512;
 
-// Fragmented message header size
-const unsigned int FRAG_MSG_HEADER_SIZE = MSG_HEADER_SIZE + sizeof(fragment_id_t) + sizeof(message_size_t);
+// Largest packet a connection can discover its path carries (an Ethernet MTU
+// without the IPv4 and UDP headers), the receive buffers are this large
+const unsigned int MAX_PACKET_SIZE = 1472;
 
 // Number of bits in a `ack_bitfield_t`
 const unsigned int ACKS_PER_BITFIELD = sizeof(ack_bitfield_t) * CHAR_BIT;
@@ -45,10 +37,36 @@ const unsigned int ACKS_PER_BITFIELD = sizeof(ack_bitfield_t) * CHAR_BIT;
 // How many fragments can one bitfield contain
 const unsigned int FRAGMENTS_PER_BITFIELD = sizeof(fragment_bitfield_t) * CHAR_BIT;
 
-// Maximum size of an unfragmented message sent through a channel
-const unsigned int MAX_UNFRAGMENTED_MESSAGE_SIZE = (MAX_PACKET_SIZE - HEADER_SIZE - FRAG_MSG_HEADER_SIZE);
+// The headers are bit-packed (see `BitWriter`), the sizes below are the largest they can be
+
+// Longest varints of the channel, sequence and size of a message header (7 bits per byte)
+const unsigned int MSG_VARINTS_SIZE = (sizeof(channel_id_t) * CHAR_BIT + 6) / 7 + (sizeof(seq_t) * CHAR_BIT + 6) / 7 + (sizeof(message_size_t) * CHAR_BIT + 6) / 7;
+
+// Packet header size
+// magic, compressed and probe flags, sequence and ack (2 bits width + up to 32 bits each), ack bits (1 bit if all set)
+const unsigned int HEADER_SIZE = (sizeof(magic_t) * CHAR_BIT + 2 + 2 * (2 + sizeof(seq_t) * CHAR_BIT) + 1 + ACKS_PER_BITFIELD + CHAR_BIT - 1) / CHAR_BIT;
+
+// Message header size
+// fragment and same channel flags, channel, sequence (or delta) and size as varints
+const unsigned int MSG_HEADER_SIZE = (2 + CHAR_BIT * MSG_VARINTS_SIZE + CHAR_BIT - 1) / CHAR_BIT;
+
+// Bits of the fragment count and index
+const unsigned int FRAGMENT_ID_BITS = 5;
+
+// Fragmented message header size
+const unsigned int FRAG_MSG_HEADER_SIZE = (2 + 2 * FRAGMENT_ID_BITS + CHAR_BIT * MSG_VARINTS_SIZE + CHAR_BIT - 1) / CHAR_BIT;
+
+// Largest fragment in packets of `packetSize`
+inline unsigned int max_fragment_size(unsigned int packetSize)
+{
+	return packetSize - HEADER_SIZE - FRAG_MSG_HEADER_SIZE;
+}
+
+// Maximum size of an unfragmented message sent through a channel (on any path)
+const unsigned int MAX_UNFRAGMENTED_MESSAGE_SIZE = (MIN_PACKET_SIZE - HEADER_SIZE - FRAG_MSG_HEADER_SIZE);
 
-// Maximum size of a message sent through a channel
+// Maximum size of a message sent through a channel (the same on every path,
+// larger packets just split it to fewer fragments)
 const unsigned int MAX_MESSAGE_SIZE = MAX_UNFRAGMENTED_MESSAGE_SIZE * FRAGMENTS_PER_BITFIELD;
 
 #endif
\ No newline at end of file
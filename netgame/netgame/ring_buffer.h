@@ -0,0 +1,114 @@
+#ifndef _NETGAME_RING_BUFFER_H
+#define _NETGAME_RING_BUFFER_H
+
+#include <memory>
+#include <utility>
+
+// Slots a `RingBuffer` allocates on its first push
+const unsigned int RING_BUFFER_MIN_CAPACITY = 8;
+
+// Queue open at both ends, kept in one power-of-two ring of slots
+// Nothing is allocated until the first push, so an unused queue is a few words
+// (a `std::deque` allocates on construction), and the ring only doubles when it's
+// full so a queue that is filled and drained every tick doesn't allocate again
+// The free slots hold default constructed entries
+template <typename T>
+class RingBuffer
+{
+public:
+	RingBuffer()
+		: m_capacity(0)
+		, m_head(0)
+		, m_size(0)
+	{ }
+
+	RingBuffer(RingBuffer&& b)
+		: m_slots(std::move(b.m_slots))
+		, m_capacity(b.m_capacity)
+		, m_head(b.m_head)
+		, m_size(b.m_size)
+	{
+		b.m_capacity = 0;
+		b.m_head = 0;
+		b.m_size = 0;
+	}
+
+	RingBuffer& operator=(RingBuffer b)
+	{
+		swap(b);
+		return *this;
+	}
+
+	void swap(RingBuffer& b)
+	{
+		m_slots.swap(b.m_slots);
+		std::swap(m_capacity, b.m_capacity);
+		std::swap(m_head, b.m_head);
+		std::swap(m_size, b.m_size);
+	}
+
+	bool empty() const { return m_size == 0; }
+	unsigned int size() const { return m_size; }
+	unsigned int capacity() const { return m_capacity; }
+
+	T& front() { return m_slots[m_head]; }
+	const T& front() const { return m_slots[m_head]; }
+
+	// The entry `i` places from the front
+	T& operator[](unsigned int i) { return m_slots[(m_head + i) & (m_capacity - 1)]; }
+	const T& operator[](unsigned int i) const { return m_slots[(m_head + i) & (m_capacity - 1)]; }
+
+	void push_back(T item)
+	{
+		if (m_size == m_capacity)
+			grow();
+		m_slots[(m_head + m_size) & (m_capacity - 1)] = std::move(item);
+		m_size++;
+	}
+
+	void push_front(T item)
+	{
+		if (m_size == m_capacity)
+			grow();
+		m_head = (m_head - 1) & (m_capacity - 1);
+		m_slots[m_head] = std::move(item);
+		m_size++;
+	}
+
+	// The slot is reset so it doesn't keep the buffers of the entry alive
+	void pop_front()
+	{
+		m_slots[m_head] = T();
+		m_head = (m_head + 1) & (m_capacity - 1);
+		m_size--;
+	}
+
+	// Drop every entry and keep the ring
+	void clear()
+	{
+		while (!empty())
+			pop_front();
+	}
+
+private:
+	RingBuffer(const RingBuffer&);
+
+	// Double the ring, the entries go back in order from the first slot
+	void grow()
+	{
+		unsigned int capacity = m_capacity != 0 ? m_capacity * 2 : RING_BUFFER_MIN_CAPACITY;
+		std::unique_ptr<T[]> slots(new T[capacity]);
+		for (unsigned int i = 0; i < m_size; i++)
+			slots[i] = std::move((*this)[i]);
+		m_slots.swap(slots);
+		m_capacity = capacity;
+		m_head = 0;
+	}
+
+	std::unique_ptr<T[]> m_slots;
+	unsigned int m_capacity;
+	unsigned int m_head;
+	unsigned int m_size;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,44 @@
+#include "rtt.h"
+
+#include <algorithm>
+
+// Timeout before the first sample
+const std::chrono::milliseconds INITIAL_RTO(500);
+
+// Bounds of the timeout, the minimum is well below TCP's since the packets are
+// sent at a fixed rate and a late retransmit costs more than a spurious one
+const std::chrono::milliseconds MIN_RTO(50);
+const std::chrono::milliseconds MAX_RTO(3000);
+
+RttEstimator::RttEstimator()
+	: m_has_sample(false)
+	, m_srtt(0)
+	, m_rttvar(0)
+	, m_rto(INITIAL_RTO)
+	, m_granularity(0)
+{
+}
+
+void RttEstimator::add_sample(net_duration rtt)
+{
+	if (!m_has_sample) {
+		m_srtt = rtt;
+		m_rttvar = rtt / 2;
+		m_has_sample = true;
+	} else {
+		net_duration err = m_srtt > rtt ? m_srtt - rtt : rtt - m_srtt;
+		m_rttvar = (m_rttvar * 3 + err) / 4;
+		m_srtt = (m_srtt * 7 + rtt) / 8;
+	}
+	update_rto(m_srtt + std::max(m_granularity, m_rttvar * 4));
+}
+
+void RttEstimator::backoff()
+{
+	update_rto(m_rto * 2);
+}
+
+void RttEstimator::update_rto(net_duration rto)
+{
+	m_rto = std::min<net_duration>(std::max<net_duration>(rto, MIN_RTO), MAX_RTO);
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef _NETGAME_RTT_H
+#define _NETGAME_RTT_H
+
+#include "timing.h"
+
+// Smoothed round-trip time and retransmission timeout (RFC 6298)
+class RttEstimator
+{
+public:
+	RttEstimator();
+
+	// Add a measured round-trip time
+	void add_sample(net_duration rtt);
+
+	// Double the timeout after a retransmission timeout (until the next sample)
+	void backoff();
+
+	// Least margin over the smoothed time (RFC 6298's clock granularity), eg. the
+	// interval the acks are sent at so a steady round trip doesn't time out
+	void set_granularity(net_duration granularity) { m_granularity = granularity; }
+
+	bool has_sample() const { return m_has_sample; }
+	net_duration srtt() const { return m_srtt; }
+	net_duration rttvar() const { return m_rttvar; }
+	net_duration rto() const { return m_rto; }
+
+private:
+	void update_rto(net_duration rto);
+
+	bool m_has_sample;
+	net_duration m_srtt;
+	net_duration m_rttvar;
+	net_duration m_rto;
+	net_duration m_granularity;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,123 @@
+#ifndef _NETGAME_SEQUENCE_BUFFER_H
+#define _NETGAME_SEQUENCE_BUFFER_H
+
+#include <memory>
+#include <utility>
+
+#include "protocol.h"
+
+// Fixed window of entries indexed by `seq % capacity`
+// Every slot is tagged with the sequence it holds, so an entry for a newer
+// sequence replaces the one `capacity` sequences older. The slots are allocated
+// at once on construction and nothing after that
+template <typename T>
+class SequenceBuffer
+{
+public:
+	// `capacity` is rounded up to a power of two (at least 2)
+	// A capacity of 0 allocates nothing and never holds an entry (don't `insert()`)
+	explicit SequenceBuffer(unsigned int capacity)
+		: m_capacity(0)
+		, m_mask(0)
+		, m_count(0)
+	{
+		if (capacity == 0)
+			return;
+		m_capacity = 2;
+		while (m_capacity < capacity)
+			m_capacity <<= 1;
+		m_mask = m_capacity - 1;
+		m_slots.reset(new Slot[m_capacity]);
+		clear();
+	}
+
+	// = default
+	SequenceBuffer(SequenceBuffer&& b)
+		: m_slots(std::move(b.m_slots))
+		, m_capacity(b.m_capacity)
+		, m_mask(b.m_mask)
+		, m_count(b.m_count)
+	{
+	}
+
+	SequenceBuffer& operator=(SequenceBuffer b)
+	{
+		m_slots.swap(b.m_slots);
+		std::swap(m_capacity, b.m_capacity);
+		std::swap(m_mask, b.m_mask);
+		std::swap(m_count, b.m_count);
+		return *this;
+	}
+
+	// Returns the entry of `seq` or nullptr if it isn't in the buffer
+	T *find(seq_t seq)
+	{
+		if (m_capacity == 0)
+			return nullptr;
+		Slot& slot = m_slots[seq & m_mask];
+		return slot.tag == seq ? &slot.entry : nullptr;
+	}
+	const T *find(seq_t seq) const
+	{
+		if (m_capacity == 0)
+			return nullptr;
+		const Slot& slot = m_slots[seq & m_mask];
+		return slot.tag == seq ? &slot.entry : nullptr;
+	}
+
+	bool exists(seq_t seq) const { return find(seq) != nullptr; }
+
+	// Claim the slot of `seq`, dropping the entry that was there
+	// The entry keeps its old contents so its buffers can be reused, reset what's needed
+	T& insert(seq_t seq)
+	{
+		unsigned int index = seq & m_mask;
+		if (!is_tagged(index))
+			m_count++;
+		m_slots[index].tag = seq;
+		return m_slots[index].entry;
+	}
+
+	// Free the slot of `seq` (does not touch the entry)
+	void remove(seq_t seq)
+	{
+		if (m_capacity == 0)
+			return;
+		unsigned int index = seq & m_mask;
+		if (m_slots[index].tag == seq) {
+			m_slots[index].tag = empty_tag(index);
+			m_count--;
+		}
+	}
+
+	void clear()
+	{
+		for (unsigned int i = 0; i < m_capacity; i++)
+			m_slots[i].tag = empty_tag(i);
+		m_count = 0;
+	}
+
+	unsigned int size() const { return m_count; }
+	unsigned int capacity() const { return m_capacity; }
+
+private:
+	// The tag next to its entry, so a lookup touches one place
+	struct Slot
+	{
+		seq_t tag;
+		T entry;
+	};
+
+	SequenceBuffer(const SequenceBuffer&);
+
+	// An empty slot holds a sequence that can never map to it
+	seq_t empty_tag(unsigned int index) const { return index + 1; }
+	bool is_tagged(unsigned int index) const { return (m_slots[index].tag & m_mask) == index; }
+
+	std::unique_ptr<Slot[]> m_slots;
+	unsigned int m_capacity;
+	unsigned int m_mask;
+	unsigned int m_count;
+};
+
+#endif
\ No newline at end of file
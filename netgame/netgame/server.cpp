@@ -0,0 +1,563 @@
+#include "server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+// Number of datagrams that can wait in the inbox of a shard
+const unsigned int SHARD_INBOX_SIZE = 4096;
+
+// Number of datagrams a shard can queue for the send thread
+const unsigned int SHARD_OUTBOX_SIZE = 4096;
+
+// Longest time to sleep without checking if the server was stopped
+const std::chrono::milliseconds STOP_POLL_INTERVAL(100);
+
+// Time without a packet after which a connection is dropped
+const std::chrono::seconds CONNECTION_TIMEOUT(10);
+
+static std::unique_ptr<Transport> make_transport(Socket& socket, bool batched)
+{
+	if (batched)
+		return std::unique_ptr<Transport>(new BatchTransport(socket, IO_BATCH_SIZE));
+	return std::unique_ptr<Transport>(new SocketTransport(socket));
+}
+
+ServerShard::ServerShard(std::unique_ptr<Transport> transport)
+	: m_transport(std::move(transport))
+	, m_log(&std::cout)
+	, m_dump_out(nullptr)
+	, m_dump_interval(0)
+	, m_dump_json(false)
+	, m_recv_pool(MAX_PACKET_SIZE)
+{
+}
+
+void ServerShard::receive()
+{
+	unsigned int count;
+	do {
+		count = m_transport->receive(m_recv_pool, m_recv, IO_BATCH_SIZE);
+		for (unsigned int i = 0; i < count; i++) {
+			process_datagram(m_recv[i].address, m_recv[i].packet);
+			// Release the buffer back to the pool
+			m_recv[i].packet = Packet();
+		}
+	} while (count == IO_BATCH_SIZE);
+}
+
+void ServerShard::process_datagram(const Address& addr, const Packet& packet)
+{
+	net_time now = net_clock::now();
+	ConnectionHandle h = m_connections.find(addr);
+	Connection *conn = m_connections.get(h);
+	if (conn != nullptr && conn->process_packet(packet, now)) {
+		m_connections.received(h, now);
+		return;
+	}
+	process_handshake(addr, packet, h, now);
+}
+
+void ServerShard::process_handshake(const Address& addr, const Packet& packet, ConnectionHandle h, net_time now)
+{
+	NetReader reader = packet.read();
+	magic_t type;
+	if (!reader.read(type))
+		return;
+
+	if (type == HANDSHAKE_REQUEST) {
+		// Answer with a cookie and forget about it
+		if (packet.size() < HANDSHAKE_REQUEST_SIZE)
+			return;
+		NetWriter writer(m_recv_pool.nextData(), m_recv_pool.nextSize());
+		writer.write(HANDSHAKE_CHALLENGE);
+		m_cookies.issue(writer, addr, now);
+		m_transport->send(addr, m_recv_pool.allocate(writer.write_amount()));
+	} else if (type == HANDSHAKE_RESPONSE) {
+		magic_t magic;
+		if (!m_cookies.verify(reader, addr, now, magic))
+			return;
+
+		// A repeated response gets the accept again, a new cookie means the client restarted
+		Connection *conn = m_connections.get(h);
+		if (conn == nullptr) {
+			if (m_log != nullptr)
+				*m_log << "New connection " << addr << std::endl;
+			Connection accepted(addr, magic, now);
+			net_time deadline = now + accepted.send_interval();
+			m_send_timers.schedule(deadline, m_connections.add(addr, std::move(accepted), deadline));
+		} else if (conn->magic() != magic) {
+			if (m_log != nullptr)
+				*m_log << "Reconnection " << addr << std::endl;
+			*conn = Connection(addr, magic, now);
+			m_connections.received(h, now);
+		}
+		NetWriter writer(m_recv_pool.nextData(), m_recv_pool.nextSize());
+		writer.write(HANDSHAKE_ACCEPT);
+		writer.write(magic);
+		m_transport->send(addr, m_recv_pool.allocate(writer.write_amount()));
+	}
+}
+
+void ServerShard::tick(net_time now)
+{
+	// Drop the clients that went silent (with their pools)
+	m_connections.collect_silent(now - CONNECTION_TIMEOUT, m_due);
+	for (auto h : m_due) {
+		if (m_log != nullptr)
+			*m_log << "Connection timed out " << m_connections.address(h) << std::endl;
+		m_connections.remove(h);
+	}
+
+	m_send_timers.advance(now, [&](ConnectionHandle h, net_time /*tick*/) {
+		Connection *conn = m_connections.get(h);
+		if (conn == nullptr)
+			return;
+		conn->send_outgoing(*m_transport, now);
+
+		// Keep the rate steady but don't try to catch up after a stall
+		net_time next = m_connections.deadline(h) + conn->send_interval();
+		if (next <= now)
+			next = now + conn->send_interval();
+		m_connections.sent(h, now, next);
+		m_send_timers.schedule(next, h);
+	});
+	m_transport->flush();
+	m_recv_pool.trim();
+
+	if (m_dump_out != nullptr && now >= m_next_dump) {
+		dump_metrics(*m_dump_out, m_dump_json);
+		m_next_dump = now + m_dump_interval;
+	}
+}
+
+void ServerShard::set_metrics_dump(std::ostream *out, net_duration interval, bool json)
+{
+	m_dump_out = out;
+	m_dump_interval = interval;
+	m_dump_json = json;
+	m_next_dump = net_clock::now() + interval;
+}
+
+void ServerShard::dump_metrics(std::ostream& out, bool json) const
+{
+	// Written at once so the dumps of the shards don't interleave
+	std::ostringstream dump;
+	m_connections.for_each([&](ConnectionHandle h, const Connection& conn) {
+		std::ostringstream name;
+		name << m_connections.address(h);
+		if (json) {
+			write_metrics_json(dump, name.str().c_str(), conn.metrics());
+			dump << "\n";
+		} else {
+			write_metrics_text(dump, name.str().c_str(), conn.metrics());
+		}
+	});
+	out << dump.str() << std::flush;
+}
+
+unsigned int ServerShard::broadcast(channel_id_t id, const Packet& message)
+{
+	unsigned int count = 0;
+	m_connections.for_each([&](ConnectionHandle /*h*/, Connection& conn) {
+		if (conn.send(id, message))
+			count++;
+	});
+	return count;
+}
+
+unsigned int ServerShard::broadcast(channel_id_t id, const Packet& message, const std::vector<Address>& to)
+{
+	unsigned int count = 0;
+	for (auto& addr : to) {
+		Connection *conn = m_connections.get(m_connections.find(addr));
+		if (conn != nullptr && conn->send(id, message))
+			count++;
+	}
+	return count;
+}
+
+#ifdef __linux__
+// Open a non-blocking UDP socket that shares `port` with the other shards
+static int open_reuseport_socket(unsigned short port)
+{
+	int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+
+	int one = 1;
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0
+	 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+
+void write_pipeline_metrics_text(std::ostream& out, const PipelineMetrics& m)
+{
+	for (size_t i = 0; i < m.inboxes.size(); i++) {
+		const QueueMetrics& q = m.inboxes[i];
+		out << "inbox " << i << ": " << q.pushed << " datagrams, depth " << q.depth << "/" << q.capacity
+			<< " (peak " << q.peak_depth << "), " << q.stalls << " stalls\n";
+	}
+	for (size_t i = 0; i < m.outboxes.size(); i++) {
+		const QueueMetrics& q = m.outboxes[i];
+		out << "outbox " << i << ": " << q.pushed << " datagrams, depth " << q.depth << "/" << q.capacity
+			<< " (peak " << q.peak_depth << "), " << q.stalls << " stalls\n";
+	}
+	if (!m.outboxes.empty())
+		out << "sent " << m.sent << " datagrams\n";
+	out << std::flush;
+}
+
+// The transport of a shard when pipelined: queues the datagrams for the send thread
+// They are copied to a pool whose packets may be released on the send thread (the
+// connections' own pools may not)
+class ShardedServer::OutboxTransport : public Transport
+{
+public:
+	OutboxTransport(ShardedServer& server, Worker& worker)
+		: m_server(server)
+		, m_worker(worker)
+		, m_pool(MAX_PACKET_SIZE, 0, true)
+	{ }
+
+	virtual unsigned int receive(PacketPool& /*pool*/, Datagram * /*out*/, unsigned int /*count*/) { return 0; }
+
+	virtual void send(const Address& addr, const Packet& packet)
+	{
+		memcpy(m_pool.nextData(), packet.data(), packet.size());
+		push(addr, m_pool.allocate(packet.size()));
+	}
+
+	virtual void send_gather(const Address& addr, const PacketChain& chain)
+	{
+		chain.copy_to(m_pool.nextData());
+		push(addr, m_pool.allocate(chain.size()));
+	}
+
+	virtual void flush() { m_pool.trim(); }
+
+private:
+	void push(const Address& addr, Packet&& packet)
+	{
+		SpscQueue<Datagram>& outbox = *m_worker.outbox;
+		// Wait for the send thread rather than dropping what the protocol already sent
+		Datagram *slot;
+		bool stalled = false;
+		while ((slot = outbox.push_slot()) == nullptr && m_server.m_running) {
+			stalled = true;
+			m_server.m_send_loop.notify();
+			std::this_thread::yield();
+		}
+		if (slot == nullptr)
+			return;
+		slot->address = addr;
+		slot->packet = std::move(packet);
+		unsigned int depth = outbox.push();
+		m_worker.outbox_counters.pushed(depth, stalled);
+		m_stats.send_datagrams++;
+		// Wake up the send thread if it may have gone to sleep with every outbox empty
+		if (depth == 1)
+			m_server.m_send_loop.notify();
+	}
+
+	ShardedServer& m_server;
+	Worker& m_worker;
+	PacketPool m_pool;
+};
+
+ShardedServer::QueueCounters::QueueCounters()
+	: pushes(0)
+	, stalls(0)
+	, peak_depth(0)
+{
+}
+
+void ShardedServer::QueueCounters::pushed(unsigned int depth, bool stalled)
+{
+	// Only the producer writes, no need for read-modify-write operations
+	pushes.store(pushes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	if (stalled)
+		stalls.store(stalls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	if (depth > peak_depth.load(std::memory_order_relaxed))
+		peak_depth.store(depth, std::memory_order_relaxed);
+}
+
+QueueMetrics ShardedServer::QueueCounters::snapshot(const SpscQueue<Datagram>& queue) const
+{
+	QueueMetrics m;
+	m.pushed = pushes.load(std::memory_order_relaxed);
+	m.stalls = stalls.load(std::memory_order_relaxed);
+	m.depth = queue.size();
+	m.peak_depth = peak_depth.load(std::memory_order_relaxed);
+	m.capacity = queue.capacity();
+	return m;
+}
+
+ShardedServer::Worker::Worker()
+	: fd(-1)
+{
+}
+
+ShardedServer::Worker::~Worker()
+{
+#ifdef __linux__
+	shard.reset();
+	if (fd >= 0)
+		close(fd);
+#endif
+}
+
+ShardedServer::ShardedServer(unsigned short port, unsigned int numShards, Steering steering, bool batched, bool pipelined)
+	: m_port(port)
+	, m_steering(pipelined ? STEER_HASH : steering)
+	, m_pipelined(pipelined)
+	, m_pin(false)
+	, m_running(false)
+	// The shards release the received packets
+	, m_recv_pool(MAX_PACKET_SIZE, 0, true)
+	, m_sent(0)
+{
+	numShards = std::max(numShards, 1u);
+
+	std::vector<int> fds;
+#ifdef __linux__
+	if (m_steering == STEER_REUSEPORT) {
+		for (unsigned int i = 0; i < numShards; i++) {
+			int fd = open_reuseport_socket(port);
+			if (fd < 0)
+				break;
+			fds.push_back(fd);
+		}
+		// Don't mix the modes if some socket failed to open
+		if (fds.size() != numShards) {
+			for (int fd : fds)
+				close(fd);
+			fds.clear();
+		}
+	}
+#endif
+	if (fds.empty()) {
+		m_steering = STEER_HASH;
+
+		m_socket.reset(new Socket(Address::inet_any(port), SocketType::UDP));
+		auto ret = m_socket->set_blocking(false);
+		if (ret != 0)
+			std::cout << "Failed to set the socket non-blocking (" << ret << ")" << std::endl;
+		m_transport = make_transport(*m_socket, batched);
+		m_loop.watch(m_socket->get_handle());
+		if (m_pipelined)
+			m_send_transport = make_transport(*m_socket, batched);
+	}
+
+	for (unsigned int i = 0; i < numShards; i++) {
+		std::unique_ptr<Worker> w(new Worker());
+		std::unique_ptr<Transport> transport;
+#ifdef __linux__
+		if (m_steering == STEER_REUSEPORT) {
+			w->fd = fds[i];
+			w->loop.watch(w->fd);
+			transport.reset(new BatchTransport(w->fd, IO_BATCH_SIZE));
+		}
+#endif
+		if (m_steering == STEER_HASH) {
+			// Receive through the steering thread and send with the shared socket
+			// (or through the send thread)
+			w->inbox.reset(new SpscQueue<Datagram>(SHARD_INBOX_SIZE));
+			if (m_pipelined) {
+				w->outbox.reset(new SpscQueue<Datagram>(SHARD_OUTBOX_SIZE));
+				transport.reset(new OutboxTransport(*this, *w));
+			} else {
+				transport = make_transport(*m_socket, batched);
+			}
+		}
+		w->shard.reset(new ServerShard(std::move(transport)));
+		m_workers.push_back(std::move(w));
+	}
+}
+
+ShardedServer::~ShardedServer()
+{
+	stop();
+	for (auto& w : m_workers) {
+		if (w->thread.joinable())
+			w->thread.join();
+	}
+	if (m_send_thread.joinable())
+		m_send_thread.join();
+}
+
+void ShardedServer::run()
+{
+	std::cout << "Serving port " << m_port << " with " << m_workers.size() << " shards ("
+		<< (m_steering == STEER_REUSEPORT ? "reuse-port" : "hash") << " steering"
+		<< (m_pipelined ? ", pipelined" : "") << ")" << std::endl;
+
+	m_running = true;
+	for (unsigned int i = 0; i < m_workers.size(); i++) {
+		Worker *worker = m_workers[i].get();
+		m_workers[i]->thread = std::thread([=]() {
+			pin_thread(2 + i);
+			worker_loop(*worker);
+		});
+	}
+	if (m_pipelined) {
+		m_send_thread = std::thread([=]() {
+			pin_thread(1);
+			send_loop();
+		});
+	}
+
+	if (m_steering == STEER_HASH) {
+		pin_thread(0);
+		steer_loop();
+	}
+
+	for (auto& w : m_workers)
+		w->thread.join();
+	if (m_send_thread.joinable())
+		m_send_thread.join();
+}
+
+void ShardedServer::stop()
+{
+	m_running = false;
+	m_loop.notify();
+	m_send_loop.notify();
+	for (auto& w : m_workers)
+		w->loop.notify();
+}
+
+void ShardedServer::pin_thread(unsigned int index)
+{
+#ifdef __linux__
+	if (!m_pin)
+		return;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(index % std::max(std::thread::hardware_concurrency(), 1u), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+}
+
+PipelineMetrics ShardedServer::pipeline_metrics() const
+{
+	PipelineMetrics m;
+	for (auto& w : m_workers) {
+		if (w->inbox)
+			m.inboxes.push_back(w->inbox_counters.snapshot(*w->inbox));
+		if (w->outbox)
+			m.outboxes.push_back(w->outbox_counters.snapshot(*w->outbox));
+	}
+	m.sent = m_sent.load(std::memory_order_relaxed);
+	return m;
+}
+
+void ShardedServer::steer_loop()
+{
+	Datagram recv[IO_BATCH_SIZE];
+	while (m_running) {
+		unsigned int count = m_transport->receive(m_recv_pool, recv, IO_BATCH_SIZE);
+		for (unsigned int i = 0; i < count; i++) {
+			Worker& w = *m_workers[address_hash(recv[i].address) % m_workers.size()];
+
+			// Hand the packet over without copying
+			// If the shard can't keep up stop receiving until it can, the kernel holds
+			// (or drops) what comes in meanwhile instead of us reading it for nothing
+			Datagram *slot;
+			bool stalled = false;
+			while ((slot = w.inbox->push_slot()) == nullptr && m_running) {
+				stalled = true;
+				w.loop.notify();
+				std::this_thread::yield();
+			}
+			if (slot != nullptr) {
+				slot->address = recv[i].address;
+				slot->packet = std::move(recv[i].packet);
+				// Wake up the shard if it may have gone to sleep with an empty inbox
+				unsigned int depth = w.inbox->push();
+				w.inbox_counters.pushed(depth, stalled);
+				if (depth == 1)
+					w.loop.notify();
+			}
+			recv[i].packet = Packet();
+		}
+		if (count == 0) {
+			m_recv_pool.trim();
+			m_loop.wait_until(net_clock::now() + STOP_POLL_INTERVAL);
+		}
+	}
+}
+
+void ShardedServer::send_loop()
+{
+	while (m_running) {
+		unsigned int sent = 0;
+		for (auto& w : m_workers) {
+			Datagram *d;
+			while ((d = w->outbox->front()) != nullptr) {
+				m_send_transport->send(d->address, d->packet);
+				// The transport keeps its own reference until it's flushed
+				d->packet = Packet();
+				w->outbox->pop();
+				if (++sent % IO_BATCH_SIZE == 0)
+					m_send_transport->flush();
+			}
+		}
+		m_send_transport->flush();
+		m_sent.store(m_sent.load(std::memory_order_relaxed) + sent, std::memory_order_relaxed);
+
+		// The shards wake this thread up when they queue to an empty outbox
+		if (sent == 0 && outboxes_idle())
+			m_send_loop.wait_until(net_clock::now() + STOP_POLL_INTERVAL);
+	}
+}
+
+bool ShardedServer::outboxes_idle() const
+{
+	for (auto& w : m_workers) {
+		if (!w->outbox->idle())
+			return false;
+	}
+	return true;
+}
+
+void ShardedServer::worker_loop(Worker& w)
+{
+	ServerShard& shard = *w.shard;
+	while (m_running) {
+		if (w.inbox) {
+			Datagram *d;
+			while ((d = w.inbox->front()) != nullptr) {
+				shard.process_datagram(d->address, d->packet);
+				// Released on this thread, the steering thread's pool picks the page up later
+				d->packet = Packet();
+				w.inbox->pop();
+			}
+		} else {
+			shard.receive();
+		}
+
+		shard.tick(net_clock::now());
+		if (!w.inbox || w.inbox->idle())
+			w.loop.wait_until(std::min(shard.next_deadline(), net_clock::now() + STOP_POLL_INTERVAL));
+	}
+}
\ No newline at end of file
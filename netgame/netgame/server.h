@@ -0,0 +1,238 @@
+#ifndef _NETGAME_SERVER_H
+#define _NETGAME_SERVER_H
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include <netlib/address.h>
+#include <netlib/socket.h>
+
+#include "protocol.h"
+#include "packet.h"
+#include "connection.h"
+#include "transport.h"
+#include "spsc_queue.h"
+#include "timing.h"
+#include "timer_wheel.h"
+#include "connection_store.h"
+#include "event_loop.h"
+#include "handshake.h"
+
+// A subset of the server's connections and everything needed to serve them
+// A shard is only ever touched by one thread, so it needs no locks
+class ServerShard
+{
+public:
+	explicit ServerShard(std::unique_ptr<Transport> transport);
+
+	// Receive and process everything pending in the shard's transport
+	void receive();
+
+	// Handle a datagram received from `addr`
+	// Unknown addresses only get a connection once they complete the handshake
+	void process_datagram(const Address& addr, const Packet& packet);
+
+	// Send the outgoing packets of the connections that are due and flush the transport
+	// Connections that received nothing for `CONNECTION_TIMEOUT` are dropped
+	void tick(net_time now);
+
+	// Queue `message` on the channel `id` of every connection, of the connections at `to`
+	// or of the ones `filter(const Connection&)` accepts, returns the number of recipients
+	// The message is serialized once and all the connections share its buffer: large
+	// payloads go out as slices of it so the cost per recipient doesn't grow with the
+	// message size (DELTA channels still encode a delta per connection)
+	unsigned int broadcast(channel_id_t id, const Packet& message);
+	unsigned int broadcast(channel_id_t id, const Packet& message, const std::vector<Address>& to);
+	template <typename Filter>
+	unsigned int broadcast_if(channel_id_t id, const Packet& message, Filter filter)
+	{
+		unsigned int count = 0;
+		m_connections.for_each([&](ConnectionHandle h, Connection& conn) {
+			if (filter(static_cast<const Connection&>(conn)) && conn.send(id, message))
+				count++;
+		});
+		return count;
+	}
+
+	// Call `f(Connection&)` for every connection (eg. to read their messages)
+	template <typename F>
+	void for_each_connection(F f)
+	{
+		m_connections.for_each([&](ConnectionHandle /*h*/, Connection& conn) {
+			f(conn);
+		});
+	}
+
+	// When `tick()` needs to be called next
+	net_time next_deadline() const { return m_send_timers.next_deadline(); }
+
+	// Write the metrics of every connection to `out` every `interval` from `tick()`
+	// as text or as JSON lines, null to stop
+	void set_metrics_dump(std::ostream *out, net_duration interval, bool json);
+	void dump_metrics(std::ostream& out, bool json) const;
+
+	// Where the connections and disconnections are logged (`std::cout` by default), null for nowhere
+	void set_log(std::ostream *log) { m_log = log; }
+
+	PacketPool& recv_pool() { return m_recv_pool; }
+	size_t num_connections() const { return m_connections.size(); }
+
+private:
+	ServerShard(const ServerShard&);
+
+	// Answer a handshake datagram, `h` is the connection of `addr` if there is one
+	void process_handshake(const Address& addr, const Packet& packet, ConnectionHandle h, net_time now);
+
+	std::unique_ptr<Transport> m_transport;
+	ConnectionStore m_connections;
+	// Every connection waits here for its next send, a handle fires once and is
+	// scheduled again after sending (removed connections are skipped when they fire)
+	TimerWheel<ConnectionHandle> m_send_timers;
+	// Connections found by the timeout scan of `tick()`
+	std::vector<ConnectionHandle> m_due;
+	CookieGenerator m_cookies;
+	std::ostream *m_log;
+
+	std::ostream *m_dump_out;
+	net_duration m_dump_interval;
+	bool m_dump_json;
+	net_time m_next_dump;
+	PacketPool m_recv_pool;
+	Datagram m_recv[IO_BATCH_SIZE];
+};
+
+// Flow through one of the queues between the threads of a `ShardedServer`
+struct QueueMetrics
+{
+	QueueMetrics()
+		: pushed(0)
+		, stalls(0)
+		, depth(0)
+		, peak_depth(0)
+		, capacity(0)
+	{ }
+
+	unsigned long long pushed;
+	// Times the producer found the queue full and had to wait for the consumer
+	unsigned long long stalls;
+	unsigned int depth;
+	unsigned int peak_depth;
+	unsigned int capacity;
+};
+
+// The queues of a `ShardedServer`: receive thread to shards (when steering by hash)
+// and shards to send thread (when pipelined), one of each per shard
+struct PipelineMetrics
+{
+	PipelineMetrics()
+		: sent(0)
+	{ }
+
+	std::vector<QueueMetrics> inboxes;
+	std::vector<QueueMetrics> outboxes;
+	unsigned long long sent;
+};
+
+// One line per queue
+void write_pipeline_metrics_text(std::ostream& out, const PipelineMetrics& m);
+
+// Runs the connections on multiple threads, one shard per thread
+class ShardedServer
+{
+public:
+	enum Steering
+	{
+		// One socket, the calling thread steers datagrams to the shards by address hash
+		STEER_HASH,
+		// Every shard receives from its own SO_REUSEPORT socket and the kernel
+		// steers by address hash (Linux only, falls back to STEER_HASH)
+		STEER_REUSEPORT,
+	};
+
+	// If `pipelined` the shards only process: a thread receives and steers by hash and
+	// another sends what the shards queued, so the system calls don't hold up the
+	// protocol work (implies STEER_HASH)
+	ShardedServer(unsigned short port, unsigned int numShards, Steering steering, bool batched, bool pipelined = false);
+	~ShardedServer();
+
+	// Serve until `stop()` is called
+	void run();
+	void stop();
+
+	// Pin the threads to a core each (receive, send, then the shards) when they start
+	// (Linux only)
+	void set_cpu_affinity(bool pin) { m_pin = pin; }
+
+	Steering steering() const { return m_steering; }
+	bool pipelined() const { return m_pipelined; }
+
+	// Depths and back-pressure of the queues (any thread)
+	PipelineMetrics pipeline_metrics() const;
+
+private:
+	ShardedServer(const ShardedServer&);
+
+	// Kept by the producer of a queue, read by anyone
+	struct QueueCounters
+	{
+		QueueCounters();
+
+		// A push that left `depth` items queued, after `stalled` waits
+		void pushed(unsigned int depth, bool stalled);
+		QueueMetrics snapshot(const SpscQueue<Datagram>& queue) const;
+
+		std::atomic<unsigned long long> pushes;
+		std::atomic<unsigned long long> stalls;
+		std::atomic<unsigned int> peak_depth;
+	};
+
+	class OutboxTransport;
+
+	struct Worker
+	{
+		Worker();
+		~Worker();
+
+		std::unique_ptr<ServerShard> shard;
+		std::unique_ptr<SpscQueue<Datagram>> inbox;
+		QueueCounters inbox_counters;
+		// Datagrams for the send thread (pipelined)
+		std::unique_ptr<SpscQueue<Datagram>> outbox;
+		QueueCounters outbox_counters;
+		EventLoop loop;
+		std::thread thread;
+		int fd;
+	};
+
+	void worker_loop(Worker& w);
+	void steer_loop();
+	void send_loop();
+	// Send thread: Whether every outbox is still empty right before sleeping
+	bool outboxes_idle() const;
+	void pin_thread(unsigned int index);
+
+	unsigned short m_port;
+	Steering m_steering;
+	bool m_pipelined;
+	bool m_pin;
+	std::atomic<bool> m_running;
+
+	// Shared socket when steering by hash
+	std::unique_ptr<Socket> m_socket;
+	std::unique_ptr<Transport> m_transport;
+	PacketPool m_recv_pool;
+	EventLoop m_loop;
+
+	// Send thread (pipelined)
+	std::unique_ptr<Transport> m_send_transport;
+	EventLoop m_send_loop;
+	std::thread m_send_thread;
+	std::atomic<unsigned long long> m_sent;
+
+	std::vector<std::unique_ptr<Worker>> m_workers;
+};
+
+#endif
\ No newline at end of file
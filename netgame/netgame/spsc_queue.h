@@ -0,0 +1,94 @@
+#ifndef _NETGAME_SPSC_QUEUE_H
+#define _NETGAME_SPSC_QUEUE_H
+
+#include <atomic>
+#include <memory>
+
+// Lock-free ring buffer for one producer thread and one consumer thread
+// The slots are preallocated and filled in place to avoid copies
+template <typename T>
+class SpscQueue
+{
+public:
+	// `capacity` is rounded up to a power of two
+	explicit SpscQueue(unsigned int capacity)
+		: m_head(0)
+		, m_tail(0)
+	{
+		m_capacity = 1;
+		while (m_capacity < capacity)
+			m_capacity <<= 1;
+		m_mask = m_capacity - 1;
+		m_items.reset(new T[m_capacity]);
+	}
+
+	// Producer: Returns the slot to fill next or nullptr if the queue is full
+	T *push_slot()
+	{
+		unsigned int tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) == m_capacity)
+			return nullptr;
+		return &m_items[tail & m_mask];
+	}
+
+	// Producer: Publish the slot returned by `push_slot()`
+	// Returns the number of queued items including this one, 1 means the consumer may
+	// have found the queue empty and gone to sleep, so it has to be woken up
+	unsigned int push()
+	{
+		unsigned int tail = m_tail.load(std::memory_order_relaxed) + 1;
+		m_tail.store(tail, std::memory_order_release);
+		// Pairs with the fence in `idle()`: either the consumer sees this item before
+		// sleeping or we see every item it has popped
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return tail - m_head.load(std::memory_order_relaxed);
+	}
+
+	// Consumer: Returns the oldest slot or nullptr if the queue is empty
+	T *front()
+	{
+		unsigned int head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return nullptr;
+		return &m_items[head & m_mask];
+	}
+
+	// Consumer: Release the slot returned by `front()` back to the producer
+	void pop()
+	{
+		m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Consumer: Check the queue is still empty right before going to sleep
+	// A producer pushing meanwhile either gets 1 from `push()` or makes this false
+	bool idle() const
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return m_tail.load(std::memory_order_relaxed) == m_head.load(std::memory_order_relaxed);
+	}
+
+	// Approximate number of queued items (exact from either end's own thread)
+	unsigned int size() const
+	{
+		return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+	}
+
+	unsigned int capacity() const { return m_capacity; }
+
+private:
+	SpscQueue(const SpscQueue&);
+	SpscQueue& operator=(const SpscQueue&);
+
+	std::unique_ptr<T[]> m_items;
+	unsigned int m_capacity;
+	unsigned int m_mask;
+
+	// Keep the indices on separate cache lines so the threads don't fight over them
+	char m_pad0[64];
+	std::atomic<unsigned int> m_head;
+	char m_pad1[64];
+	std::atomic<unsigned int> m_tail;
+	char m_pad2[64];
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,110 @@
+#ifndef _NETGAME_TIMER_WHEEL_H
+#define _NETGAME_TIMER_WHEEL_H
+
+#include <cstdint>
+#include <vector>
+
+#include "timing.h"
+
+// Hashed timing wheel: O(1) scheduling with millisecond resolution
+// Items further away than one revolution wait in their slot for later rounds
+template <typename T>
+class TimerWheel
+{
+public:
+	explicit TimerWheel(unsigned int numSlots = 1024)
+		: m_origin(net_clock::now())
+		, m_current(0)
+		, m_count(0)
+	{
+		unsigned int n = 1;
+		while (n < numSlots)
+			n <<= 1;
+		m_slots.resize(n);
+		m_mask = n - 1;
+	}
+
+	// Schedule `item` to fire at `deadline`
+	void schedule(net_time deadline, const T& item)
+	{
+		uint64_t tick = to_tick(deadline);
+		// Never schedule to the past, it would wait for a whole revolution
+		if (tick < m_current)
+			tick = m_current;
+		Entry e;
+		e.tick = tick;
+		e.item = item;
+		m_slots[tick & m_mask].push_back(e);
+		m_count++;
+	}
+
+	// Call `fn(item, deadline)` for every item due at or before `now`
+	// `fn` may schedule new items
+	template <typename F>
+	void advance(net_time now, F fn)
+	{
+		uint64_t target = to_tick(now);
+		// Visit every slot at most once even if a lot of time has passed
+		if (target >= m_current + m_slots.size())
+			m_current = target - m_slots.size() + 1;
+
+		while (m_current <= target) {
+			std::vector<Entry>& slot = m_slots[m_current & m_mask];
+			m_current++;
+			if (slot.empty())
+				continue;
+
+			m_firing.swap(slot);
+			for (auto& e : m_firing) {
+				if (e.tick <= target) {
+					m_count--;
+					fn(e.item, from_tick(e.tick));
+				} else {
+					// Due in a later revolution
+					m_slots[e.tick & m_mask].push_back(e);
+				}
+			}
+			m_firing.clear();
+		}
+	}
+
+	// The earliest time something may be due (may be early but never late)
+	net_time next_deadline() const
+	{
+		for (uint64_t t = m_current; t < m_current + m_slots.size(); t++) {
+			if (!m_slots[t & m_mask].empty())
+				return from_tick(t);
+		}
+		return from_tick(m_current + m_slots.size());
+	}
+
+	size_t size() const { return m_count; }
+
+private:
+	struct Entry
+	{
+		uint64_t tick;
+		T item;
+	};
+
+	uint64_t to_tick(net_time t) const
+	{
+		if (t <= m_origin)
+			return 0;
+		return std::chrono::duration_cast<std::chrono::milliseconds>(t - m_origin).count();
+	}
+
+	net_time from_tick(uint64_t tick) const
+	{
+		return m_origin + std::chrono::milliseconds(tick);
+	}
+
+	std::vector<std::vector<Entry>> m_slots;
+	std::vector<Entry> m_firing;
+	unsigned int m_mask;
+	net_time m_origin;
+	uint64_t m_current;
+	size_t m_count;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef _NETGAME_TIMING_H
+#define _NETGAME_TIMING_H
+
+#include <chrono>
+
+// Clock used for all the protocol timing
+typedef std::chrono::steady_clock net_clock;
+typedef net_clock::time_point net_time;
+typedef net_clock::duration net_duration;
+
+// Rate to call `Connection::send_outgoing` at if not configured (per second)
+const unsigned int DEFAULT_SEND_RATE = 30;
+
+#endif
\ No newline at end of file
@@ -0,0 +1,218 @@
+#include "transport.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+void Transport::send_gather(const Address& addr, const PacketChain& chain)
+{
+	send(addr, chain.flatten(m_gather_pool));
+}
+
+unsigned int SocketTransport::receive(PacketPool& pool, Datagram *out, unsigned int count)
+{
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		out[i].address = Address(sizeof (sockaddr_in));
+		int size = m_socket.receive_from(out[i].address, pool.nextData(), pool.nextSize());
+		m_stats.recv_calls++;
+		out[i].packet = pool.allocate(size);
+		if (out[i].packet.empty())
+			break;
+	}
+	m_stats.recv_datagrams += i;
+	return i;
+}
+
+void SocketTransport::send(const Address& addr, const Packet& packet)
+{
+	m_socket.send_to(addr, packet.data(), packet.size());
+	m_stats.send_calls++;
+	m_stats.send_datagrams++;
+}
+
+BatchTransport::BatchTransport(Socket& socket, unsigned int batchSize)
+	: m_socket(&socket)
+	, m_batch_size(batchSize)
+#ifdef __linux__
+	, m_fd(socket.get_handle())
+	, m_msgs(batchSize)
+	, m_iovecs(batchSize)
+	, m_names(batchSize)
+#endif
+{
+}
+
+#ifdef __linux__
+BatchTransport::BatchTransport(int fd, unsigned int batchSize)
+	: m_socket(nullptr)
+	, m_batch_size(batchSize)
+	, m_fd(fd)
+	, m_msgs(batchSize)
+	, m_iovecs(batchSize)
+	, m_names(batchSize)
+{
+}
+#endif
+
+#ifdef __linux__
+
+unsigned int BatchTransport::receive(PacketPool& pool, Datagram *out, unsigned int count)
+{
+	unsigned int total = 0;
+	while (total < count) {
+		// Point the messages to the free slots of the current pool page
+		unsigned int n = std::min(std::min(count - total, m_batch_size), pool.nextCount());
+		unsigned int slotSize = pool.nextSize();
+		char *base = pool.nextData();
+		for (unsigned int i = 0; i < n; i++) {
+			m_iovecs[i].iov_base = base + i * slotSize;
+			m_iovecs[i].iov_len = slotSize;
+
+			msghdr& hdr = m_msgs[i].msg_hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_name = &m_names[i];
+			hdr.msg_namelen = sizeof(sockaddr_storage);
+			hdr.msg_iov = &m_iovecs[i];
+			hdr.msg_iovlen = 1;
+		}
+
+		int got = recvmmsg(m_fd, m_msgs.data(), n, MSG_DONTWAIT, nullptr);
+		m_stats.recv_calls++;
+		if (got <= 0)
+			break;
+
+		// Claim the filled slots in order
+		unsigned int kept = 0;
+		for (int i = 0; i < got; i++) {
+			Packet slot = pool.allocate(slotSize);
+			// Larger than a slot, drop it rather than deliver it cut short
+			if (m_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				m_stats.recv_dropped++;
+				continue;
+			}
+			Datagram& d = out[total + kept++];
+			d.packet = slot.subpacket(0, m_msgs[i].msg_len);
+			d.address = Address(reinterpret_cast<const sockaddr*>(&m_names[i]), m_msgs[i].msg_hdr.msg_namelen);
+		}
+		total += kept;
+
+		// The socket is drained
+		if ((unsigned int)got < n)
+			break;
+	}
+	m_stats.recv_datagrams += total;
+	return total;
+}
+
+void BatchTransport::flush()
+{
+	size_t done = 0;
+	while (done < m_queue.size()) {
+		unsigned int n = (unsigned int)std::min<size_t>(m_batch_size, m_queue.size() - done);
+
+		// An iovec for every slice
+		size_t slices = 0;
+		for (unsigned int i = 0; i < n; i++)
+			slices += m_queue[done + i].count;
+		if (m_iovecs.size() < slices)
+			m_iovecs.resize(slices);
+
+		size_t iov = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			Outgoing& d = m_queue[done + i];
+			msghdr& hdr = m_msgs[i].msg_hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_name = const_cast<sockaddr*>(d.address.get_sockaddr());
+			hdr.msg_namelen = d.address.get_size();
+			hdr.msg_iov = &m_iovecs[iov];
+			hdr.msg_iovlen = d.count;
+
+			for (unsigned int j = 0; j < d.count; j++) {
+				const Packet& slice = m_slices[d.first + j];
+				m_iovecs[iov].iov_base = const_cast<char*>(slice.data());
+				m_iovecs[iov].iov_len = slice.size();
+				iov++;
+			}
+		}
+
+		int sent = sendmmsg(m_fd, m_msgs.data(), n, 0);
+		m_stats.send_calls++;
+		if (sent > 0) {
+			m_stats.send_datagrams += sent;
+			done += sent;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR) {
+			// The socket buffer is full, keep the rest for the next flush
+			break;
+		} else {
+			// The first datagram was refused (eg. unreachable address), drop it and keep going
+			m_stats.send_dropped++;
+			done++;
+		}
+	}
+
+	// Don't let the queue grow while the socket stays full
+	if (m_queue.size() - done > SEND_QUEUE_LIMIT) {
+		size_t excess = m_queue.size() - done - SEND_QUEUE_LIMIT;
+		m_stats.send_dropped += excess;
+		done += excess;
+	}
+
+	if (done == m_queue.size()) {
+		m_queue.clear();
+		m_slices.clear();
+		return;
+	}
+	unsigned int firstSlice = m_queue[done].first;
+	m_queue.erase(m_queue.begin(), m_queue.begin() + done);
+	m_slices.erase(m_slices.begin(), m_slices.begin() + firstSlice);
+	for (auto& d : m_queue)
+		d.first -= firstSlice;
+}
+
+#else
+
+unsigned int BatchTransport::receive(PacketPool& pool, Datagram *out, unsigned int count)
+{
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		out[i].address = Address(sizeof (sockaddr_in));
+		int size = m_socket->receive_from(out[i].address, pool.nextData(), pool.nextSize());
+		m_stats.recv_calls++;
+		out[i].packet = pool.allocate(size);
+		if (out[i].packet.empty())
+			break;
+	}
+	m_stats.recv_datagrams += i;
+	return i;
+}
+
+void BatchTransport::flush()
+{
+	for (auto& d : m_queue) {
+		// No gather support, copy the slices of the datagram together
+		PacketChain chain;
+		for (unsigned int j = 0; j < d.count; j++)
+			chain.append(m_slices[d.first + j]);
+		Packet packet = chain.flatten(m_gather_pool);
+		m_socket->send_to(d.address, packet.data(), packet.size());
+		m_stats.send_calls++;
+		m_stats.send_datagrams++;
+	}
+	m_queue.clear();
+	m_slices.clear();
+}
+
+#endif
+
+void BatchTransport::send(const Address& addr, const Packet& packet)
+{
+	m_queue.push_back(Outgoing(addr, (unsigned int)m_slices.size(), 1));
+	m_slices.push_back(packet);
+}
+
+void BatchTransport::send_gather(const Address& addr, const PacketChain& chain)
+{
+	m_queue.push_back(Outgoing(addr, (unsigned int)m_slices.size(), chain.num_slices()));
+	for (unsigned int i = 0; i < chain.num_slices(); i++)
+		m_slices.push_back(chain.slice(i));
+}
\ No newline at end of file
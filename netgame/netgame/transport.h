@@ -0,0 +1,175 @@
+#ifndef _NETGAME_TRANSPORT_H
+#define _NETGAME_TRANSPORT_H
+
+#include <cstring>
+#include <vector>
+
+#include <netlib/address.h>
+#include <netlib/socket.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#include "protocol.h"
+#include "packet.h"
+
+// Hash of the raw socket address (for steering and hash tables)
+inline size_t address_hash(const Address& addr)
+{
+	// FNV-1a
+	const unsigned char *data = reinterpret_cast<const unsigned char*>(addr.get_sockaddr());
+	size_t hash = 2166136261u;
+	for (int i = 0; i < addr.get_size(); i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Whether two addresses are the same raw socket address (what `address_hash()` hashes)
+inline bool address_equal(const Address& a, const Address& b)
+{
+	return a.get_size() == b.get_size() && memcmp(a.get_sockaddr(), b.get_sockaddr(), a.get_size()) == 0;
+}
+
+// Default number of datagrams to move with one call in batched mode
+const unsigned int IO_BATCH_SIZE = 64;
+
+// Most datagrams a batched transport keeps for the next flush while the socket is full
+// Past this the oldest are dropped, like a full socket buffer drops what comes in
+const unsigned int SEND_QUEUE_LIMIT = 4096;
+
+// A packet received from or sent to an address
+struct Datagram
+{
+	Datagram()
+	{ }
+	Datagram(const Address& a, const Packet& p)
+		: address(a)
+		, packet(p)
+	{ }
+
+	Address address;
+	Packet packet;
+};
+
+// Counters for the calls a transport does to the OS
+struct TransportStats
+{
+	TransportStats()
+		: recv_calls(0)
+		, recv_datagrams(0)
+		, recv_dropped(0)
+		, send_calls(0)
+		, send_datagrams(0)
+		, send_dropped(0)
+	{ }
+
+	unsigned long long recv_calls;
+	unsigned long long recv_datagrams;
+	// Received datagrams that were too large for a buffer
+	unsigned long long recv_dropped;
+	unsigned long long send_calls;
+	unsigned long long send_datagrams;
+	// Datagrams the OS refused to send, or dropped while the socket stayed full
+	unsigned long long send_dropped;
+};
+
+// Moves datagrams between the connections and a socket
+class Transport
+{
+public:
+	Transport()
+		: m_gather_pool(MAX_PACKET_SIZE)
+	{ }
+	virtual ~Transport() { }
+
+	// Receive up to `count` datagrams to `out`, the data is allocated from `pool`
+	// Returns the number of datagrams received
+	virtual unsigned int receive(PacketPool& pool, Datagram *out, unsigned int count) = 0;
+
+	// Send a datagram (may be queued until `flush()`)
+	virtual void send(const Address& addr, const Packet& packet) = 0;
+
+	// Send a datagram made of the slices of `chain`
+	// Copies it to one buffer unless the transport can gather the slices itself
+	virtual void send_gather(const Address& addr, const PacketChain& chain);
+
+	// Send the queued datagrams, the ones the OS can't take yet stay queued for the next call
+	virtual void flush() { }
+
+	const TransportStats& stats() const { return m_stats; }
+
+protected:
+	TransportStats m_stats;
+	// Buffers for `send_gather()` when the slices have to be copied
+	PacketPool m_gather_pool;
+};
+
+// Sends and receives one datagram per call
+class SocketTransport : public Transport
+{
+public:
+	explicit SocketTransport(Socket& socket)
+		: m_socket(socket)
+	{ }
+
+	virtual unsigned int receive(PacketPool& pool, Datagram *out, unsigned int count);
+	virtual void send(const Address& addr, const Packet& packet);
+
+private:
+	Socket& m_socket;
+};
+
+// Receives straight into consecutive pool slots and sends the datagrams of a
+// whole tick at once (`recvmmsg`/`sendmmsg` on Linux, one call per datagram elsewhere)
+// Gathered datagrams are sent from their slices (an iovec per slice) without copying
+class BatchTransport : public Transport
+{
+public:
+	BatchTransport(Socket& socket, unsigned int batchSize);
+#ifdef __linux__
+	// Use a descriptor that is not owned by a `Socket` (eg. a SO_REUSEPORT one)
+	BatchTransport(int fd, unsigned int batchSize);
+#endif
+
+	virtual unsigned int receive(PacketPool& pool, Datagram *out, unsigned int count);
+	virtual void send(const Address& addr, const Packet& packet);
+	virtual void send_gather(const Address& addr, const PacketChain& chain);
+	virtual void flush();
+
+	// Datagrams waiting for `flush()` (or kept by it)
+	unsigned int queued() const { return (unsigned int)m_queue.size(); }
+
+private:
+	// A datagram waiting for `flush()`, made of `count` slices from `first` in `m_slices`
+	struct Outgoing
+	{
+		Outgoing(const Address& a, unsigned int first, unsigned int count)
+			: address(a)
+			, first(first)
+			, count(count)
+		{ }
+
+		Address address;
+		unsigned int first;
+		unsigned int count;
+	};
+
+	Socket* m_socket;
+	unsigned int m_batch_size;
+	std::vector<Outgoing> m_queue;
+	// The slices of all the queued datagrams (flat so queueing doesn't allocate)
+	std::vector<Packet> m_slices;
+
+#ifdef __linux__
+	int m_fd;
+	std::vector<mmsghdr> m_msgs;
+	std::vector<iovec> m_iovecs;
+	std::vector<sockaddr_storage> m_names;
+#endif
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,400 @@
+#include "uring_transport.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Room for the source address in a receive buffer (fits a sockaddr_in6, keeps the payload aligned)
+const unsigned int RECV_NAME_SIZE = 32;
+
+// The kernel writes a header and the source address before the payload
+const unsigned int RECV_HEADER_SIZE = sizeof(io_uring_recvmsg_out) + RECV_NAME_SIZE;
+
+// Receive buffers are pool slots of this size
+const unsigned int RECV_SLOT_SIZE = (RECV_HEADER_SIZE + MAX_PACKET_SIZE + 15) & ~15;
+
+// Buffer group of the receive buffers
+const unsigned short RECV_BUFFER_GROUP = 0;
+
+// Tags of the operations that are not sends (sends are tagged with their slot)
+const unsigned long long RECV_USER_DATA = ~0ull;
+const unsigned long long CANCEL_USER_DATA = ~0ull - 1;
+
+static int io_uring_setup(unsigned int entries, io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int count)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+UringTransport::UringTransport(int fd, unsigned int sendSlots)
+	: m_fd(fd)
+	, m_ring_fd(-1)
+	, m_event_fd(-1)
+	, m_ring(MAP_FAILED)
+	, m_ring_size(0)
+	, m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED))
+	, m_sqes_size(0)
+	, m_sq_local_tail(0)
+	, m_buf_ring(static_cast<io_uring_buf*>(MAP_FAILED))
+	, m_buf_ring_size(0)
+	, m_buf_tail(0)
+	, m_buffers(URING_RECV_BUFFERS)
+	// The receivers may release the packets on another thread
+	, m_pool(RECV_SLOT_SIZE, 0, true)
+	, m_recv_armed(false)
+	, m_recv_failed(false)
+	, m_received_next(0)
+	, m_sends(sendSlots)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	// Room for a completion per receive buffer and per send
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = 2 * (URING_RECV_BUFFERS + sendSlots);
+	int ringFd = io_uring_setup(sendSlots + 16, &params);
+	if (ringFd < 0)
+		return;
+	m_ring_fd = ringFd;
+
+	// The queues share one mapping (every kernel with the features we need supports it)
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	m_ring_size = std::max(sqSize, cqSize);
+	m_ring = mmap(nullptr, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+	m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES));
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || m_ring == MAP_FAILED || m_sqes == MAP_FAILED) {
+		close_ring();
+		return;
+	}
+
+	char *ring = static_cast<char*>(m_ring);
+	m_sq_head = reinterpret_cast<unsigned int*>(ring + params.sq_off.head);
+	m_sq_tail = reinterpret_cast<unsigned int*>(ring + params.sq_off.tail);
+	m_sq_array = reinterpret_cast<unsigned int*>(ring + params.sq_off.array);
+	m_sq_mask = *reinterpret_cast<unsigned int*>(ring + params.sq_off.ring_mask);
+	m_sq_entries = params.sq_entries;
+	m_sq_local_tail = *m_sq_tail;
+	m_cq_head = reinterpret_cast<unsigned int*>(ring + params.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned int*>(ring + params.cq_off.tail);
+	m_cq_mask = *reinterpret_cast<unsigned int*>(ring + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(ring + params.cq_off.cqes);
+
+	// Register the ring of receive buffers
+	m_buf_ring_size = URING_RECV_BUFFERS * sizeof(io_uring_buf);
+	m_buf_ring = static_cast<io_uring_buf*>(mmap(nullptr, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (m_buf_ring == MAP_FAILED) {
+		close_ring();
+		return;
+	}
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uintptr_t>(m_buf_ring);
+	reg.ring_entries = URING_RECV_BUFFERS;
+	reg.bgid = RECV_BUFFER_GROUP;
+	if (io_uring_register(m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		close_ring();
+		return;
+	}
+
+	// Signal an event fd on completions so an event loop can wait for them
+	m_event_fd = eventfd(0, EFD_NONBLOCK);
+	if (m_event_fd < 0 || io_uring_register(m_ring_fd, IORING_REGISTER_EVENTFD, &m_event_fd, 1) < 0) {
+		close_ring();
+		return;
+	}
+
+	for (unsigned int i = 0; i < URING_RECV_BUFFERS; i++)
+		provide((unsigned short)i);
+	publish_buffers();
+
+	// Only the address is received to the buffers, the payload follows it
+	memset(&m_recv_header, 0, sizeof(m_recv_header));
+	m_recv_header.msg_namelen = RECV_NAME_SIZE;
+
+	m_received.reserve(URING_RECV_BUFFERS);
+	for (unsigned int i = 0; i < sendSlots; i++)
+		m_free_sends.push_back(sendSlots - 1 - i);
+
+	// Kernels without multishot recvmsg reject it as it is submitted, let the
+	// caller fall back to another transport rather than never receiving
+	arm_receive();
+	if (!submit(0)) {
+		close_ring();
+		return;
+	}
+	reap();
+	if (m_recv_failed)
+		close_ring();
+}
+
+UringTransport::~UringTransport()
+{
+	if (!is_open())
+		return;
+
+	// The kernel may still be using the buffers, wait for the operations to end before releasing them
+	io_uring_sqe *sqe = next_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = RECV_USER_DATA;
+	sqe->user_data = CANCEL_USER_DATA;
+	bool ok = submit(0);
+	while (ok && (m_recv_armed || m_free_sends.size() < m_sends.size())) {
+		ok = submit(1);
+		reap();
+	}
+	close_ring();
+}
+
+void UringTransport::close_ring()
+{
+	if (m_event_fd >= 0)
+		close(m_event_fd);
+	if (m_buf_ring != MAP_FAILED)
+		munmap(m_buf_ring, m_buf_ring_size);
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqes_size);
+	if (m_ring != MAP_FAILED)
+		munmap(m_ring, m_ring_size);
+	close(m_ring_fd);
+	m_event_fd = -1;
+	m_ring_fd = -1;
+	m_buf_ring = static_cast<io_uring_buf*>(MAP_FAILED);
+	m_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	m_ring = MAP_FAILED;
+}
+
+io_uring_sqe *UringTransport::next_sqe()
+{
+	// Make room by submitting what is prepared
+	if (m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == m_sq_entries)
+		submit(0);
+	while (m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == m_sq_entries)
+		submit(1);
+
+	unsigned int index = m_sq_local_tail & m_sq_mask;
+	io_uring_sqe *sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sq_array[index] = index;
+	m_sq_local_tail++;
+	return sqe;
+}
+
+bool UringTransport::submit(unsigned int wait)
+{
+	unsigned int pending = m_sq_local_tail - *m_sq_tail;
+	if (pending == 0 && wait == 0)
+		return true;
+	__atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+
+	int ret;
+	do {
+		ret = io_uring_enter(m_ring_fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	// Busy means the completion queue is full, the caller reaps and retries
+	return ret >= 0 || errno == EBUSY;
+}
+
+void UringTransport::reap()
+{
+	unsigned int head = *m_cq_head;
+	unsigned int tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+	bool provided = false;
+
+	for (; head != tail; head++) {
+		const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+
+		if (cqe.user_data == RECV_USER_DATA) {
+			// The receive stops on errors or when it ran out of buffers, post it again
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				m_recv_armed = false;
+			if (cqe.res == -EINVAL)
+				m_recv_failed = true;
+			if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+				continue;
+
+			unsigned short id = (unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			Packet buffer = std::move(m_buffers[id]);
+			provide(id);
+			provided = true;
+
+			const io_uring_recvmsg_out *msg = reinterpret_cast<const io_uring_recvmsg_out*>(buffer.data());
+			if ((msg->flags & MSG_TRUNC) || msg->namelen > RECV_NAME_SIZE)
+				continue;
+			m_received.push_back(Datagram());
+			Datagram& d = m_received.back();
+			d.address = Address(reinterpret_cast<const sockaddr*>(msg + 1), msg->namelen);
+			d.packet = buffer.subpacket(RECV_HEADER_SIZE, msg->payloadlen);
+		} else if (cqe.user_data < m_sends.size()) {
+			SendSlot& slot = m_sends[(size_t)cqe.user_data];
+			if (cqe.res >= 0)
+				m_stats.send_datagrams++;
+			slot.slices.clear();
+			m_free_sends.push_back((unsigned int)cqe.user_data);
+		}
+	}
+	__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+	if (provided)
+		publish_buffers();
+}
+
+void UringTransport::arm_receive()
+{
+	io_uring_sqe *sqe = next_sqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = m_fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(&m_recv_header);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->user_data = RECV_USER_DATA;
+	m_recv_armed = true;
+}
+
+void UringTransport::provide(unsigned short id)
+{
+	// The previous packet of the slot (if any) now belongs to whoever received it
+	m_buffers[id] = m_pool.allocate(RECV_SLOT_SIZE);
+
+	io_uring_buf& buf = m_buf_ring[m_buf_tail & (URING_RECV_BUFFERS - 1)];
+	buf.addr = reinterpret_cast<uintptr_t>(m_buffers[id].data());
+	buf.len = RECV_SLOT_SIZE;
+	buf.bid = id;
+	m_buf_tail++;
+}
+
+void UringTransport::publish_buffers()
+{
+	// The tail of the ring overlaps the reserved field of the first entry
+	__atomic_store_n(&m_buf_ring[0].resv, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+unsigned int UringTransport::receive(PacketPool& /*pool*/, Datagram *out, unsigned int count)
+{
+	if (!is_open())
+		return 0;
+
+	if (m_received_next == m_received.size()) {
+		m_received.clear();
+		m_received_next = 0;
+
+		// Reset the readiness of the event fd (this also lets the kernel post pending completions)
+		uint64_t value;
+		if (read(m_event_fd, &value, sizeof(value)) < 0) { }
+		m_stats.recv_calls++;
+		reap();
+
+		if (!m_recv_armed && !m_recv_failed) {
+			// What is already waiting in the socket is received as the receive is posted
+			arm_receive();
+			submit(0);
+			m_stats.recv_calls++;
+			reap();
+		}
+	}
+
+	unsigned int n = (unsigned int)std::min<size_t>(count, m_received.size() - m_received_next);
+	for (unsigned int i = 0; i < n; i++)
+		out[i] = std::move(m_received[m_received_next + i]);
+	m_received_next += n;
+	m_stats.recv_datagrams += n;
+	return n;
+}
+
+unsigned int UringTransport::take_send_slot(const Address& addr)
+{
+	// All the slots are in flight, wait for some to complete
+	while (m_free_sends.empty()) {
+		if (!submit(1))
+			break;
+		m_stats.send_calls++;
+		reap();
+	}
+	if (m_free_sends.empty())
+		return (unsigned int)m_sends.size();
+
+	unsigned int index = m_free_sends.back();
+	m_free_sends.pop_back();
+	SendSlot& slot = m_sends[index];
+	memcpy(&slot.name, addr.get_sockaddr(), addr.get_size());
+	memset(&slot.header, 0, sizeof(slot.header));
+	slot.header.msg_name = &slot.name;
+	slot.header.msg_namelen = addr.get_size();
+	return index;
+}
+
+void UringTransport::queue_send(unsigned int index)
+{
+	SendSlot& slot = m_sends[index];
+	slot.iovecs.resize(slot.slices.size());
+	for (size_t i = 0; i < slot.slices.size(); i++) {
+		slot.iovecs[i].iov_base = const_cast<char*>(slot.slices[i].data());
+		slot.iovecs[i].iov_len = slot.slices[i].size();
+	}
+	slot.header.msg_iov = slot.iovecs.data();
+	slot.header.msg_iovlen = slot.iovecs.size();
+
+	// Submitted with the rest of the tick in `flush()`
+	io_uring_sqe *sqe = next_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = m_fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(&slot.header);
+	sqe->user_data = index;
+}
+
+void UringTransport::send(const Address& addr, const Packet& packet)
+{
+	if (!is_open())
+		return;
+	unsigned int index = take_send_slot(addr);
+	if (index == m_sends.size())
+		return;
+	m_sends[index].slices.push_back(packet);
+	queue_send(index);
+}
+
+void UringTransport::send_gather(const Address& addr, const PacketChain& chain)
+{
+	if (!is_open())
+		return;
+	unsigned int index = take_send_slot(addr);
+	if (index == m_sends.size())
+		return;
+	for (unsigned int i = 0; i < chain.num_slices(); i++)
+		m_sends[index].slices.push_back(chain.slice(i));
+	queue_send(index);
+}
+
+void UringTransport::flush()
+{
+	if (!is_open())
+		return;
+	if (m_sq_local_tail != *m_sq_tail) {
+		submit(0);
+		m_stats.send_calls++;
+	}
+	// Pick up the completed sends so their packets go back to the pools
+	reap();
+	m_pool.trim();
+}
+
+#endif
\ No newline at end of file
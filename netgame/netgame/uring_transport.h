@@ -0,0 +1,115 @@
+#ifndef _NETGAME_URING_TRANSPORT_H
+#define _NETGAME_URING_TRANSPORT_H
+
+#include "transport.h"
+
+#ifdef __linux__
+
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Number of receive buffers the kernel can fill before we pick them up (a power of two)
+const unsigned int URING_RECV_BUFFERS = 1024;
+
+// Number of sends that can be in flight
+const unsigned int URING_SEND_SLOTS = 256;
+
+// Moves datagrams with io_uring (Linux 6.0 or later)
+// A multishot recvmsg stays posted and the kernel picks its buffers from a ring
+// of pool slots (provided buffers), each completion becomes a packet pointing
+// into the slot it was received to
+// Sends are queued until `flush()` and submitted with one call, their slices are
+// referenced until the kernel is done with them so nothing is copied
+class UringTransport : public Transport
+{
+public:
+	explicit UringTransport(int fd, unsigned int sendSlots = URING_SEND_SLOTS);
+	~UringTransport();
+
+	// Whether the ring could be set up and the kernel accepted the receive, else use another transport
+	bool is_open() const { return m_ring_fd >= 0; }
+
+	// Readable when completions are waiting, watch it in place of the socket
+	int event_fd() const { return m_event_fd; }
+
+	// The packets come from the transport's own pool (they can be released on any thread), `pool` is unused
+	virtual unsigned int receive(PacketPool& pool, Datagram *out, unsigned int count);
+	virtual void send(const Address& addr, const Packet& packet);
+	virtual void send_gather(const Address& addr, const PacketChain& chain);
+	virtual void flush();
+
+private:
+	// A send that was queued and not completed yet
+	struct SendSlot
+	{
+		msghdr header;
+		sockaddr_storage name;
+		std::vector<iovec> iovecs;
+		std::vector<Packet> slices;
+	};
+
+	UringTransport(const UringTransport&);
+
+	void close_ring();
+
+	io_uring_sqe *next_sqe();
+	// Submit the prepared entries and wait for `wait` completions
+	bool submit(unsigned int wait);
+	// Handle the completions: queue the datagrams received and free the slots of the sends
+	void reap();
+
+	void arm_receive();
+	// Give buffer `id` a fresh pool slot and hand it to the kernel
+	void provide(unsigned short id);
+	// Let the kernel see the buffers provided since the last call
+	void publish_buffers();
+
+	unsigned int take_send_slot(const Address& addr);
+	void queue_send(unsigned int index);
+
+	int m_fd;
+	int m_ring_fd;
+	int m_event_fd;
+
+	// Submission and completion queues shared with the kernel
+	void *m_ring;
+	size_t m_ring_size;
+	io_uring_sqe *m_sqes;
+	size_t m_sqes_size;
+	unsigned int *m_sq_head;
+	unsigned int *m_sq_tail;
+	unsigned int *m_sq_array;
+	unsigned int m_sq_mask;
+	unsigned int m_sq_entries;
+	// Tail including the entries that were prepared but not submitted yet
+	unsigned int m_sq_local_tail;
+	unsigned int *m_cq_head;
+	unsigned int *m_cq_tail;
+	unsigned int m_cq_mask;
+	io_uring_cqe *m_cqes;
+
+	// Receive buffers: the ring the kernel picks them from and the slots they point to
+	// The entries are indexed directly, C++ puts the flexible array of `io_uring_buf_ring` at another offset
+	io_uring_buf *m_buf_ring;
+	size_t m_buf_ring_size;
+	unsigned short m_buf_tail;
+	std::vector<Packet> m_buffers;
+	PacketPool m_pool;
+
+	msghdr m_recv_header;
+	bool m_recv_armed;
+	bool m_recv_failed;
+	// Received and not returned by `receive()` yet
+	std::vector<Datagram> m_received;
+	size_t m_received_next;
+
+	std::vector<SendSlot> m_sends;
+	std::vector<unsigned int> m_free_sends;
+};
+
+#endif
+
+#endif
\ No newline at end of file
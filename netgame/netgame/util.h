@@ -1,9 +1,42 @@
 #ifndef _NETGAME_UTIL_H
 #define _NETGAME_UTIL_H
 
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 inline void NETGAME_ASSERT(bool b) {
-	if (!b)
-		__asm int 3;
+	if (!b) {
+#ifdef _MSC_VER
+		__debugbreak();
+#else
+		__builtin_trap();
+#endif
+	}
+}
+
+// Index of the highest set bit (`v` must not be zero)
+inline unsigned int highest_bit(uint32_t v) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, v);
+	return index;
+#else
+	return 31 - __builtin_clz(v);
+#endif
+}
+
+// Index of the lowest set bit (`v` must not be zero)
+inline unsigned int lowest_bit(uint32_t v) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, v);
+	return index;
+#else
+	return __builtin_ctz(v);
+#endif
 }
 
 #endif
\ No newline at end of file